@@ -146,6 +146,52 @@ CAN_message_t send_msg,receive_msg;
 CAN_message_t msg;//CAN message strut
 #define send_id 0x1806E5F4 
 #define receive_id 0x18FF50E5 
+#define CHARGER_RX_TIMEOUT_MS 2500      // charger status is sent every 1s, older status means communication is lost
+
+#define ECU_CAN_BAUDRATE 250000
+#define ECU_CAN_BUSLOAD_PERCENT 30      // share of the Can2 bandwidth the BMS may use
+#define ECU_CAN_FRAME_BITS 160          // worst case bits of one 8 byte frame on the bus incl. stuffing and IFS
+#define ECU_CAN_BURST_MS 250            // max bandwidth credit that can be saved up between two services
+// cell voltages: ID = ECU_VOLT_BASE_ID + slave * ECU_VOLT_FRAMES_PER_SLAVE + group, 4 x uint16 little endian, 100uV LSB,
+//                cells 4*group..4*group+3
+// temperatures:  ID = ECU_TEMP_BASE_ID + slave * ECU_TEMP_FRAMES_PER_SLAVE + group, 8 x uint8, 1 degC LSB, -40 degC offset,
+//                thermistors 8*group..8*group+7
+// internal resistance: ID = ECU_RES_BASE_ID + slave * ECU_VOLT_FRAMES_PER_SLAVE + group, 4 x uint16 little endian, 1uOhm LSB,
+//                cells as in the voltage frames
+// the per slave base IDs are set next to ECU_VOLT_FRAMES, they move to 0x200 and up for packs above 8 slaves of 15 cells
+// state of power: ECU_SOP_DISCHARGE_ID / ECU_SOP_CHARGE_ID, 3 x uint16 little endian current limit for 2 s / 10 s / 30 s, 0.1A LSB,
+//                 byte 6: temperature derating in %, byte 7: bit 0 set while a BMS fault is active (all limits 0)
+// 0xFFFF / 0xFF marks a channel that does not exist on this slave
+// temperature trend warning: ECU_TEMP_WARN_ID, byte 0: warning bits (TREND_WARN_*, incl. the cell voltage drop), byte 1/2: slave/cell with the fastest rise,
+//                            byte 3/4: int16 little endian rise rate 0.01degC/min, byte 5/6: slave/cell of the largest outlier,
+//                            byte 7: outlier above the slave mean 0.25degC LSB
+// fault latency:  ID = ECU_LATENCY_BASE_ID + errorFlag index, 4 x uint16 little endian in ms: min, avg, p99, max
+//                  of conversion start -> BMS_FLT_3V3 low, 0xFFFF if no fault of this class was measured yet
+// balancing:      ID = ECU_BALANCE_BASE_ID + slave, byte 0/1: uint16 little endian, bit n set while cell n+1 is discharged,
+//                  byte 2: bit 0-5 number of discharged cells of this slave, bit 6/7 cells 17/18, byte 3/4: uint16 little endian start threshold
+//                  (pack minimum + BALANCE_DELTA_V) 100uV LSB, byte 5: BALANCE_ST_* bits,
+//                  byte 6: balancing dissipation of this slave 20mW LSB, byte 7: modelled board hot spot 1 degC LSB,
+//                  -40 degC offset (0xFF without a valid thermistor)
+#define ECU_SOP_DISCHARGE_ID 0x150
+#define ECU_SOP_CHARGE_ID 0x151
+#define ECU_TEMP_WARN_ID 0x152
+// fault journal: the ECU requests entry n (0 = newest) with ECU_JOURNAL_REQ_ID, byte 0 = n,
+//                the BMS answers with two frames:
+//                ECU_JOURNAL_RSP_ID:     n, errorFlag index (0xFF = no entry), flags (bit 7 cleared, bit 0-6 boot), slave, cell,
+//                                        value int16 little endian (1mV / 0.1degC), number of stored entries
+//                ECU_JOURNAL_RSP_ID + 1: millis() uint32 little endian, cycle uint32 little endian
+#define ECU_JOURNAL_REQ_ID 0x160
+#define ECU_JOURNAL_RSP_ID 0x161
+#define ECU_LATENCY_BASE_ID 0x170
+#define ECU_VOLT_FRAMES_PER_SLAVE ((LTCDEF_CELLS_PER_SLAVE + 3) / 4)
+#define ECU_TEMP_FRAMES_PER_SLAVE ((LTCDEF_TEMPS_PER_SLAVE + 7) / 8)
+#define ECU_VOLT_PERIOD_MS 100          // one complete pass over all cell voltages at most every ECU_VOLT_PERIOD_MS
+#define ECU_TEMP_PERIOD_MS 500          // temperatures change slowly
+#define ECU_RES_PERIOD_MS 1000          // resistance estimates change even slower
+#define ECU_SOP_PERIOD_MS 100           // the inverter derates on these, keep them fresh
+#define ECU_TEMP_WARN_PERIOD_MS 200
+#define ECU_LATENCY_PERIOD_MS 1000
+#define ECU_BALANCE_PERIOD_MS 500
 
 //  int max_voltage = 3950;                  //1900 coresponds to 190.0V
 // int max_current_without_decimal = 100  ; // 100 corresponds to 10.0 Amp
@@ -155,15 +201,36 @@ CAN_message_t msg;//CAN message strut
 
 // IMPORTANT MODES OF CODE
 
+// pack layout, each can be set on the compiler command line instead (the ams_bench_<slaves>x<cells> scaling builds)
+
 // number of cell monitors
+#ifndef LTCDEF_CELL_MONITOR_COUNT
 #define LTCDEF_CELL_MONITOR_COUNT 6
+#endif
+
+// cells in use on one cell monitor, spread evenly over the three 6 input sections of the LTC681x
+// (15: inputs 6, 12 and 18 are GNDed on the slave board, 18: all inputs), multiple of 3
+#ifndef LTCDEF_CELLS_PER_SLAVE
+#define LTCDEF_CELLS_PER_SLAVE 15
+#endif
+
+// thermistors of one cell monitor, the first LTCDEF_TEMPS_LOW_BANK on the low mux bank, at most 16
+#ifndef LTCDEF_TEMPS_PER_SLAVE
+#define LTCDEF_TEMPS_PER_SLAVE 15
+#endif
 
 #define seventhSlave
-#undef seventhSlave// undef only if u dont need seventh slave
+#undef seventhSlave// undef only if u dont need seventh slave (the last slave of the chain, LTCDEF_SHORT_SLAVE_CELLS cells and thermistors)
 
 #define dynamicCooling
 //#undef dynamicCooling //undef only if u dont need to turn fans on 
 
+#define predictiveCooling
+#undef predictiveCooling //define to control the fans on maxTemp + rise rate * FAN_PREDICT_MIN instead of maxTemp
+
+#define balancing
+//#undef balancing //undef to keep all discharge (DCC) switches of the cell monitors open
+
 // CHARGER SECTION
 
 #define charger_active
@@ -176,8 +243,33 @@ CAN_message_t msg;//CAN message strut
 
 //CHARGER SECTION ENDS
 
+// ECU SECTION
+
+#define ecuBroadcast
+//#undef ecuBroadcast //undef if cell data must not be sent to the ECU on Can2
+
+#ifndef faultInjection // -DfaultInjection keeps it (the host build, CMakeLists.txt)
+#define faultInjection
+#undef faultInjection //bench only: define to allow the 'f' console command to inject out of limit values for latency tests
+#endif
+
+#define simulatedChain
+#ifndef AMS_HOST // the host build (CMakeLists.txt, host/) has no hardware and always runs the simulated chain
+#undef simulatedChain //bench only: define to run against the simulated daisy chain instead of the LTC2949 / LTC681x ('x' command)
+#endif
+
+#ifndef profiling // -Dprofiling keeps it
+#define profiling
+#undef profiling //define for the DWT cycle count probes around every loop stage ('p' command), undef removes them
+#endif
+
+#ifndef kernelBenchmark // -DkernelBenchmark keeps it (ams_bench, CMakeLists.txt)
+#define kernelBenchmark
+#undef kernelBenchmark //bench only: define for the 'k' command, times the processing functions on a synthetic full pack
+#endif
+
 #define Interrupt_Debug
-#undef Interrupt_Debug //undef if u want the code to run 
+#undef Interrupt_Debug //undef if u want the code to run (only sets the start-up console mode, see 'm' command)
 
 //GUI SECTION
 #define GUI_Enabled
@@ -211,10 +303,6 @@ CAN_message_t msg;//CAN message strut
 
 //IMORTANT MODES OF CODE ENDS
 
-
-#define LTCDEF_TIMING_DEBUG
-#undef LTCDEF_TIMING_DEBUG
-
 // serial baudrate
 //Note: on Arduino Due, 250000 baud seems to be the maximum
 #define LTCDEF_BAUDRATE 250000
@@ -268,6 +356,41 @@ inline bool err_detected(byte error) { return error > 0x3; }
 inline bool err_detected(byte error) { return error != 0; }
 #endif
 
+// HARDWARE ABSTRACTION SECTION
+// every access to the LTC2949 and the LTC681x daisy chain in the measurement path goes through these,
+// so the same code runs against the real chain or the simulation (simulatedChain, see SIMULATION SECTION)
+#ifdef simulatedChain
+#define HAL_RdCells(...)        simRdCells(__VA_ARGS__)
+#define HAL_RdAux(...)          simRdAux(__VA_ARGS__)
+#define HAL_RdCfg(data)         simRdCfgReg(data, false)
+#define HAL_WrCfg(data)         simWrCfgReg(data, false)
+#define HAL_RdCfgb(data)        simRdCfgReg(data, true)
+#define HAL_WrCfgb(data)        simWrCfgReg(data, true)
+#define HAL_ClrCells()          simClr(false)
+#define HAL_ClrAux()            simClr(true)
+#define HAL_ADxx(...)           simADxx(__VA_ARGS__)
+#define HAL_ADAX(...)           simADAX(__VA_ARGS__)
+#define HAL_RdFastData(...)     simRdFastData(__VA_ARGS__)
+#define HAL_READ(...)           simREAD(__VA_ARGS__)
+#define HAL_ChkUpdate(...)      simChkUpdate(__VA_ARGS__)
+#define HAL_GetLastTBxInt()     simGetLastTBxInt()
+#else
+#define HAL_RdCells(...)        LTC2949_68XX_RdCells(__VA_ARGS__)
+#define HAL_RdAux(...)          LTC2949_68XX_RdAux(__VA_ARGS__)
+#define HAL_RdCfg(data)         LTC2949_68XX_RdCfg(data)
+#define HAL_WrCfg(data)         LTC2949_68XX_WrCfg(data)
+#define HAL_RdCfgb(data)        LTC2949_68XX_RdCfgb(data)
+#define HAL_WrCfgb(data)        LTC2949_68XX_WrCfgb(data)
+#define HAL_ClrCells()          LTC2949_68XX_ClrCells()
+#define HAL_ClrAux()            LTC2949_68XX_ClrAux()
+#define HAL_ADxx(...)           LTC2949_ADxx(__VA_ARGS__)
+#define HAL_ADAX(...)           LTC2949_ADAX(__VA_ARGS__)
+#define HAL_RdFastData(...)     LTC2949_RdFastData(__VA_ARGS__)
+#define HAL_READ(...)           LTC2949_READ(__VA_ARGS__)
+#define HAL_ChkUpdate(...)      LTC2949_ChkUpdate(__VA_ARGS__)
+#define HAL_GetLastTBxInt()     LTC2949_GetLastTBxInt()
+#endif
+
 // NTC: NTCALUG01A104F/TDK (SMD)
 #define NTC_STH_A  9.85013754e-4
 #define NTC_STH_B  1.95569870e-4
@@ -290,67 +413,129 @@ inline bool err_detected(byte error) { return error != 0; }
 #define VOLT_ERR_PIN 7              // to switch error state led on master
 #define TEMP_ERR_PIN 8              // to switch error state led on master
 
-#define voltTimer 400               // Time for voltage loop to go on in its error checking mode
-#define tempTimer 900                // Time for temperature loop to go on in its error checking mode
+// Fault debounce, see faultDebounceUpdate(): a channel has to be out of limits for the set time before voltFlag / tempFlag
+// and BMS_FLT_3V3 are asserted, and back inside the limits minus the hysteresis for the clear time before they are released.
+// Channels are updated once per measurement cycle, so the qualification time is the set time rounded up to the next cycle.
+#define voltTimer 400               // voltage fault set time in ms
+#define tempTimer 900               // temperature fault set time in ms
+#define VOLT_CLEAR_MS 1000          // voltage fault clear time
+#define TEMP_CLEAR_MS 3000          // temperature fault clear time
+#define VOLT_HYST 0.050             // V, an UV / OV cell must recover this far inside the limit
+#define TEMP_HYST 2.0               // degC, an OT sensor must cool down this far below overTempThreshold
+#define LATENCY_CLASSES 7           // fault latency statistics per errorFlag[] index 0..6
+#define LATENCY_BUCKET_MS 10
+#define LATENCY_BUCKETS 101         // last bucket collects everything >= 1 s
 #define chargeTimer 5000
 
+// Charger state machine, see chargerService()
+#define CHARGER_TX_PERIOD_MS 1000       // command frame period, the charger stops by itself after 5 s without one
+#define CHARGER_HANDSHAKE_MS 15000      // max. time from the start command to charging current
+#define CHARGER_CV_CELL_V 4.15          // highest cell at this voltage: end of the constant current phase
+#define CHARGER_TAPER_A 2.0             // charger current below this in CV: taper phase
+#define CHARGER_END_A 0.5               // charger current below this for CHARGER_END_MS: charging complete
+#define CHARGER_END_MS 30000
+
+// CC-CV current controller, see chargeControl(): PI on the highest cell voltage, output limited to
+// max_current_without_decimal and the 30 s state of power charge limit (which carries the temperature derating)
+#define CHARGE_V_TARGET (overVoltageThreshold - 0.020)   // regulated highest cell voltage
+#define CHARGE_V_GUARD (overVoltageThreshold - 0.005)    // at / above this the request is 0 at once
+#define CHARGE_KP 50.0f                 // A per V error
+#define CHARGE_KI 5.0f                  // A per V error and second
+#define CHARGE_RESEND_DROP 10           // 0.1A, a request this much below the last command is sent at once
+
+// Loop deadline monitor, see deadlineStageEnd(): every stage of loop() is timed against its budget,
+// the watchdog is only fed when the whole loop stayed within LOOP_DEADLINE_MS.
+// If it is not fed for WDOG_TIMEOUT_MS the pre-timeout interrupt pulls BMS_FLT_3V3 low, WDOG_PRETIMEOUT_MS later the MCU resets.
+#define LOOP_DEADLINE_MS 600
+#define WDOG_TIMEOUT_MS 2500                  // 0.5 s steps, 0.5..128 s
+#define WDOG_PRETIMEOUT_MS 500                // 0.5 s steps, interrupt this long before the reset
+
 #define voltage 0
 #define temp 1
 
 #define UI_BUFFER_SIZE 64
 
+#define SERIAL_TX_QUEUE_SIZE 16384  // bytes of diagnostic output buffered between loops, must be a power of 2
+#define SERIAL_TX_DRAIN_MAX 1024     // max bytes handed to Serial per drain call
+
 #define RES 30000                   // Resistor divider for BATP and BATM
 #define RES_SUM 6520000
 #define POT_DIV_BPM 76.5   // Voltage Multiplier for BPM
+#define POT_DIV_POWER 13.75786   // Power Multiplier for P1 and E1, E1 is the time integral of P1 so both must use this one
+#define ACCU_CHECK_UPDATES 50        // slow channel updates per E1 against sum(P1 * dt) cross check
+#define ACCU_CHECK_TOLERANCE 0.05    // allowed relative difference of the two energies
+#define ACCU_CHECK_MIN_KWH 0.001     // below this the window is too short to compare
 
 //CELL COUNT OF STACK
-int cellsPerStack[7]={15,15,15,15,15,15,6};
+#define LTCDEF_AUX_PER_CELL_MONITOR_COUNT 12    // RDAUXA..D
+#define LTCDEF_TEMPS_LOW_BANK 8                 // thermistors on the low mux bank (GPIO9 low), see tempAuxReg()
+#define LTCDEF_SHORT_SLAVE_CELLS 6              // seventhSlave: cells and thermistors of the last slave
+
+#ifdef seventhSlave
+#define LTCDEF_PACK_CELLS (LTCDEF_CELL_MONITOR_COUNT * LTCDEF_CELLS_PER_SLAVE - LTCDEF_CELLS_PER_SLAVE + LTCDEF_SHORT_SLAVE_CELLS)
+#else
+#define LTCDEF_PACK_CELLS (LTCDEF_CELL_MONITOR_COUNT * LTCDEF_CELLS_PER_SLAVE)
+#endif
+
+#if (LTCDEF_CELLS_PER_SLAVE % 3) || (LTCDEF_CELLS_PER_SLAVE > LTCDEF_CELLS_PER_CELL_MONITOR_COUNT) || (LTCDEF_SHORT_SLAVE_CELLS % 3)
+#error "cells per slave must be a multiple of 3 and fit the cell monitor"
+#endif
+#if LTCDEF_TEMPS_PER_SLAVE > 2 * LTCDEF_TEMPS_LOW_BANK
+#error "LTCDEF_TEMPS_PER_SLAVE: the two mux banks take 16 thermistors at most"
+#endif
+#if LTCDEF_CELL_MONITOR_COUNT > 32
+#error "the slave masks (slavesToNormalize, slavesOnSplit) take 32 slaves at most"
+#endif
+
+// cells / thermistors per slave, set by initPackLayout()
+uint8_t cellsPerStack[LTCDEF_CELL_MONITOR_COUNT];
+uint8_t tempsPerStack[LTCDEF_CELL_MONITOR_COUNT];
 
 
 //NORMALIZATION SECTION
 
-const uint8_t slavesToNormalize = 0x33; // S1 , S3, S6, S7 ->The least significant bit(first from right) represents the first slave in daisy chain and so on...
+const uint32_t slavesToNormalize = 0x33; // S1 , S3, S6, S7 ->The least significant bit(first from right) represents the first slave in daisy chain and so on...
 //                                     // In binary system if it is 1 it means that slave needs normalize convert the binary to hex and put the value  here
 //                                     // For ex. if I have slave 1 and 3 to normalize the binary equivalent will be 00000101 convert binary to hex and proceed
 
-// const uint16_t voltChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00,0x00,0x00,0x00,0x00,0x00,0x00};//
-const uint16_t voltChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00,0x00,0x00,0x00,0x00,0x00};
-// //const uint16_t voltChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00,0x00,0x00,0x00,0x00};
-// // const uint16_t voltChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00,0x00,0x00,0x00};
-// // const uint16_t voltChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00,0x00,0x00};
-// // const uint16_t voltChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00,0x00};
-//const uint16_t voltChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00};
-
-// const uint16_t tempChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x40,0x00,0x00,0x00,0x00,0x05,0x00};
-const uint16_t tempChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x201,0x00,0x00,0x00,0x20,0x00};
-// //const uint16_t tempChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00,0x00,0x00,0x00,0x00};
-// // const uint16_t tempChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00,0x00,0x00,0x00};
-// // const uint16_t tempChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00,0x00,0x00};
-// // const uint16_t tempChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00,0x00};
-//const uint16_t tempChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00};
+// const uint32_t voltChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00,0x00,0x00,0x00,0x00,0x00,0x00};//
+const uint32_t voltChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00,0x00,0x00,0x00,0x00,0x00};
+// //const uint32_t voltChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00,0x00,0x00,0x00,0x00};
+// // const uint32_t voltChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00,0x00,0x00,0x00};
+// // const uint32_t voltChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00,0x00,0x00};
+// // const uint32_t voltChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00,0x00};
+//const uint32_t voltChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00};
+
+// const uint32_t tempChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x40,0x00,0x00,0x00,0x00,0x05,0x00};
+const uint32_t tempChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x201,0x00,0x00,0x00,0x20,0x00};
+// //const uint32_t tempChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00,0x00,0x00,0x00,0x00};
+// // const uint32_t tempChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00,0x00,0x00,0x00};
+// // const uint32_t tempChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00,0x00,0x00};
+// // const uint32_t tempChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00,0x00};
+//const uint32_t tempChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00};
 
 // //NORMALIZATION SECTION ENDS
 
 //SPLIT SECTION
 
-const uint8_t slavesOnSplit = 0x01;// Least significant bit is first slave 
+const uint32_t slavesOnSplit = 0x01;// Least significant bit is first slave 
 
-//const uint16_t voltChannelOnSplit[LTCDEF_CELL_MONITOR_COUNT] = { 0x00}; // if SPlit between ch-1 and ch-2 pass "ch-2" here
-const uint16_t voltChannelOnSplit[LTCDEF_CELL_MONITOR_COUNT] = { 0x80,0x00,0x00,0x00,0x00,0x00 };
-//const uint16_t voltChannelOnSplit[LTCDEF_CELL_MONITOR_COUNT] = { 0x02,0x00,0x00,0x00,0x00 };
-//const uint16_t voltChannelOnSplit[LTCDEF_CELL_MONITOR_COUNT] = { 0x02,0x00,0x00,0x00 };
-//const uint16_t voltChannelOnSplit[LTCDEF_CELL_MONITOR_COUNT] = { 0x02,0x00,0x00};
-//const uint16_t voltChannelOnSplit[LTCDEF_CELL_MONITOR_COUNT] = { 0x02,0x00 };
-//const uint16_t voltChannelOnSplit[LTCDEF_CELL_MONITOR_COUNT] = { 0x0 };
+//const uint32_t voltChannelOnSplit[LTCDEF_CELL_MONITOR_COUNT] = { 0x00}; // if SPlit between ch-1 and ch-2 pass "ch-2" here
+const uint32_t voltChannelOnSplit[LTCDEF_CELL_MONITOR_COUNT] = { 0x80,0x00,0x00,0x00,0x00,0x00 };
+//const uint32_t voltChannelOnSplit[LTCDEF_CELL_MONITOR_COUNT] = { 0x02,0x00,0x00,0x00,0x00 };
+//const uint32_t voltChannelOnSplit[LTCDEF_CELL_MONITOR_COUNT] = { 0x02,0x00,0x00,0x00 };
+//const uint32_t voltChannelOnSplit[LTCDEF_CELL_MONITOR_COUNT] = { 0x02,0x00,0x00};
+//const uint32_t voltChannelOnSplit[LTCDEF_CELL_MONITOR_COUNT] = { 0x02,0x00 };
+//const uint32_t voltChannelOnSplit[LTCDEF_CELL_MONITOR_COUNT] = { 0x0 };
 
 // Normalize all channels
-// const uint8_t slavesToNormalize = 0xff; // S3 and S6
-// const uint16_t voltChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0xffff, 0xffff,0xffff,0xffff,0xffff,0xffff,0xffff };
-// const uint16_t tempChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0xffff, 0xffff,0xffff,0xffff,0xffff,0xffff,0xffff };
+// const uint32_t slavesToNormalize = 0xff; // S3 and S6
+// const uint32_t voltChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0xffff, 0xffff,0xffff,0xffff,0xffff,0xffff,0xffff };
+// const uint32_t tempChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0xffff, 0xffff,0xffff,0xffff,0xffff,0xffff,0xffff };
 
-//const uint8_t slavesToNormalize = 0x00;
-//const uint16_t voltChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00};
-//const uint16_t tempChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00};
+//const uint32_t slavesToNormalize = 0x00;
+//const uint32_t voltChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00};
+//const uint32_t tempChannelToNormalize[LTCDEF_CELL_MONITOR_COUNT] = { 0x00};
 
 //SPLIT SECTION ENDS
 
@@ -359,7 +544,7 @@ const uint16_t voltChannelOnSplit[LTCDEF_CELL_MONITOR_COUNT] = { 0x80,0x00,0x00,
 const double overVoltageThreshold = 4.200;
 const double underVoltageThreshold = 2.8000;
 const double overTempThreshold = 45.000;
-const double dynamicCoolingThreshold = 35.000;
+const double dynamicCoolingThreshold = 33.000;   // setpoint of the fan controller for the hottest thermistor
 
 //CHARGER THRESHOLD
 int max_voltage = 3600;                  //1900 coresponds to 190.0V
@@ -377,32 +562,277 @@ bool hw_failure=0, temp_charger=0, input_voltage=0, starting_state=0, comm=0;
 const bool fanMbed = true;
 const bool chargerEnMbed = false;
 const bool amsMasterToACUsignals[2] = { fanMbed , chargerEnMbed };
-int flag_fan =0;
+
+// Fan PI controller, see performDynamicCooling(): hardware PWM on FAN_MBED
+#define FAN_PWM_FREQ 25000              // Hz, usual for 4 wire fans and above the audible range
+#define FAN_PWM_MAX 255                 // analogWrite() full scale at the default 8 bit resolution
+#define FAN_KP 0.15f                    // duty per degC
+#define FAN_KI 0.002f                   // duty per degC and second
+#define FAN_FF_FULL_A 150.0f            // A, filtered pack current that alone asks for full duty (I^2 heating)
+#define FAN_FF_TAU_S 60.0f              // s, filter of I^2, the cells heat up slowly
+#define FAN_MIN_DUTY 0.15f              // below this the fans stall, the output is 0 instead
+#define FAN_START_DUTY 0.25f            // stopped fans only start at this duty (hysteresis to FAN_MIN_DUTY)
+#define FAN_PREDICT_MIN 3.0f            // min, predictiveCooling horizon
+
+float fanDuty = 0;          // 0..1, last output
+float fanIntegral = 0;      // duty, integral part
+float fanCurrentSq = 0;     // A^2, filtered square of the pack current
+uint32_t fanLastMs = 0;
 
 
 // SD Card logging 
-int chgrDelay = 1000;
 const int chipSelect = BUILTIN_SDCARD;
 File dataFile;
+File faultFile;
+uint8_t bootNumber = 0;
 bool BPM_ready;
-bool enteredChecking=false;
-bool chargingStarted_=true;
-bool chargingFlag=false;
 
 //SOC estimation
 bool SOC_init_flag=false;
 
+// OCV curves: discharged capacity of one cell in mAh (0 = full) over open circuit voltage,
+// stored on a uniform voltage grid so the lookup is a direct index: capacity[k] is the value at vMin + k * vStep
+// ocv[] is the inverse curve, open circuit voltage over SOC on a uniform grid: ocv[k] at SOC = k / (socPoints - 1)
+struct ocvCurve
+{
+  float vMin;
+  float vStep;
+  uint16_t points;
+  const float * capacity;
+  uint16_t socPoints;
+  const float * ocv;
+};
+
+// 25 degC discharge curve, resampled from the measured 87 point curve onto a 10 mV grid from 2.45 V to 4.20 V
+constexpr float ocvCapacity_25C[176] =
+{
+  4260.2, 4260.3, 4260.4, 4259.6, 4258.6, 4257.7, 4256.7, 4255.7,
+  4254.7, 4252.5, 4250.3, 4248.1, 4245.9, 4243.7, 4241.5, 4239.3,
+  4236.9, 4234.5, 4232.1, 4229.6, 4227.2, 4224.7, 4222.4, 4220.6,
+  4218.7, 4216.9, 4215.0, 4213.2, 4209.7, 4206.3, 4202.8, 4199.3,
+  4195.9, 4192.4, 4188.2, 4183.2, 4178.3, 4173.4, 4168.5, 4163.9,
+  4160.5, 4157.2, 4153.8, 4150.4, 4147.1, 4143.7, 4137.2, 4127.6,
+  4118.0, 4108.5, 4099.4, 4093.0, 4086.6, 4080.2, 4073.9, 4067.5,
+  4061.1, 4054.7, 4048.0, 4041.4, 4034.8, 4028.1, 4021.4, 4014.1,
+  4006.8, 3999.5, 3992.2, 3983.4, 3973.0, 3962.5, 3952.0, 3941.7,
+  3931.8, 3922.0, 3912.1, 3902.3, 3885.7, 3867.3, 3850.6, 3841.4,
+  3832.3, 3823.1, 3813.9, 3794.1, 3773.5, 3757.4, 3743.9, 3730.3,
+  3716.8, 3692.3, 3667.5, 3634.6, 3601.2, 3567.4, 3530.1, 3485.8,
+  3427.9, 3379.9, 3339.8, 3304.3, 3269.2, 3234.0, 3205.9, 3178.6,
+  3127.5, 3087.0, 3044.3, 2992.2, 2946.6, 2910.9, 2871.4, 2776.0,
+  2721.0, 2696.7, 2604.7, 2552.2, 2526.5, 2482.1, 2409.1, 2347.7,
+  2293.5, 2263.8, 2232.8, 2192.7, 2138.4, 2093.5, 2056.6, 2019.8,
+  1964.1, 1921.0, 1886.4, 1834.2, 1779.5, 1736.9, 1700.1, 1671.6,
+  1601.5, 1565.5, 1530.9, 1493.3, 1447.5, 1383.5, 1340.8, 1288.2,
+  1233.5, 1193.7, 1163.5, 1125.0, 1084.0, 1043.8, 1011.3, 980.9,
+  953.2, 923.1, 887.9, 852.6, 816.9, 779.5, 698.7, 547.4,
+  489.7, 313.2, 284.9, 211.7, 171.7, 151.1, 130.6, 113.2,
+  98.0, 82.9, 70.0, 58.0, 46.0, 34.0, 22.0, 10.0
+};
+constexpr float ocvVoltage_25C[51] =
+{
+  2.4500, 2.8163, 2.9644, 3.0922, 3.1818, 3.2468, 3.3054, 3.3507, 3.3762,
+  3.3979, 3.4137, 3.4341, 3.4583, 3.4846, 3.5039, 3.5215, 3.5427, 3.5559,
+  3.5683, 3.5856, 3.5985, 3.6210, 3.6331, 3.6479, 3.6732, 3.6907, 3.7118,
+  3.7298, 3.7512, 3.7672, 3.7873, 3.8066, 3.8273, 3.8483, 3.8631, 3.8806,
+  3.8984, 3.9224, 3.9442, 3.9727, 3.9979, 4.0206, 4.0306, 4.0362, 4.0447,
+  4.0531, 4.0579, 4.0727, 4.0879, 4.1320, 4.2000
+};
+constexpr struct ocvCurve ocvCurve_25C = { 2.45, 0.01, 176, ocvCapacity_25C, 51, ocvVoltage_25C };
+
+// select the OCV curve used for SOC here (e.g. per temperature band or cell chemistry)
+#define OCV_CURVE ocvCurve_25C
+
+// EKF SOC estimator, one RC equivalent circuit of one series element (cells in parallel):
+//   OCV(soc) --- R0 --- R1 || C1 --- terminal voltage
+// state: soc (0..1) and v1 (voltage over R1 || C1), input: pack current (positive while charging)
+#define CELL_BLOCK_CAPACITY_AH (4.2 * 5.5)  // capacity of one series element, same as used for the SoC display
+#define EKF_R0 0.004f                       // ohmic resistance of one series element until the RLS estimates ran, see cellResMean()
+#define EKF_R1 0.002f                       // polarisation resistance
+#define EKF_C1 10000.0f                     // polarisation capacitance (tau = R1 * C1 = 20 s)
+#define EKF_Q_SOC 1.0e-7f                   // process noise of soc per update
+#define EKF_Q_V1 1.0e-6f                    // process noise of v1 per update
+#define EKF_R_MEAS 2.5e-5f                  // measurement noise of the mean cell voltage (5 mV)^2
+#define CELL_V_PLAUSIBLE_MIN 0.5f           // V, readings outside this window (open input, >6 V error class) never seed a SOC
+#define CELL_V_PLAUSIBLE_MAX 6.0f
+
+struct socEkfState
+{
+  float soc;
+  float v1;
+  float P[2][2];        // state covariance
+  float innovation;     // last measured - predicted voltage, logged for offline validation
+  uint32_t lastMicros;
+  bool init;
+};
+
+struct socEkfState socEkf = { 0, 0, { {0, 0}, {0, 0} }, 0, 0, false };
+float cellFrameCurrent = 0;   // pack current in A belonging to the latest cell voltage frame
+bool cellFrameCurrentSync = false;  // cellFrameCurrent was sampled together with the cell voltages
+
 float EnergyAvailable = 0;
 
+// LTC2949 hardware accumulators (C1: charge, E1: energy, TB1: time base of both)
+// only the deltas between two slow channel updates are used, so the absolute value
+// and any reset of the accumulators does not matter
+bool accuValid = false;
+int64_t lastC1Raw = 0;
+int64_t lastE1Raw = 0;
+uint32_t lastTB1Raw = 0;
+float ChargeAccumulated = 0;      // charge in Ah since start, positive while charging
+float EnergyAccumulated = 0;      // energy in kWh since start, positive while charging
+float packPowerP1 = 0;            // W, latest P1 reading, positive while charging
+
+// cross check of the E1 energy against the integrated P1 power, catches a wrong scaling of either
+float accuCheckE1 = 0;            // kWh from E1 in the current window
+float accuCheckP1 = 0;            // kWh from sum(P1 * dt) in the current window
+uint16_t accuCheckUpdates = 0;
+uint16_t accuCheckMismatches = 0;
+
 float tf=0;
 
-double cellVoltages[LTCDEF_CELL_MONITOR_COUNT][15];     // cell voltages data
-int8_t voltageErrorLoc[LTCDEF_CELL_MONITOR_COUNT][15];  // gives location of voltage error (-1 in case of error / 0 in case of no error)
-int8_t voltageNormalize[LTCDEF_CELL_MONITOR_COUNT][15];
-int8_t voltageSplit[LTCDEF_CELL_MONITOR_COUNT][15];
-double cellTemperatures[LTCDEF_CELL_MONITOR_COUNT][15]; // cell temp data
-int8_t tempErrorLoc[LTCDEF_CELL_MONITOR_COUNT][15];  // gives location of voltage error (-1 in case of error / 0 in case of no error)
-int8_t tempNormalize[LTCDEF_CELL_MONITOR_COUNT][15];
+//CHARGER RECEIVE SECTION
+
+// latest status frame of the charger, written from the can3 FIFO interrupt (chargerReceive)
+// and copied to receive_msg by chargerStatusSnapshot()
+struct chargerRxCache
+{
+  CAN_message_t msg;
+  uint32_t rxMillis;      // millis() when msg was received
+  uint32_t count;         // number of status frames received, 0 = none yet
+};
+
+volatile struct chargerRxCache chargerRx;
+uint32_t chargerRxAge = 0xFFFFFFFF;   // ms since the status in receive_msg was received
+
+// charger status byte 4 (receive_msg.buf[4])
+#define CHARGER_ST_HW_FAIL 0x01
+#define CHARGER_ST_OVERTEMP 0x02
+#define CHARGER_ST_INPUT_V 0x04
+#define CHARGER_ST_NO_BATTERY 0x08      // also set while the charger waits for the start command
+#define CHARGER_ST_COMM 0x10
+#define CHARGER_ST_ERRORS (CHARGER_ST_HW_FAIL | CHARGER_ST_OVERTEMP | CHARGER_ST_INPUT_V | CHARGER_ST_COMM)
+
+#define CHARGER_IDLE 0          // no charger on can3, stop command
+#define CHARGER_HANDSHAKE 1     // charger answers, start command sent, waiting for current
+#define CHARGER_CC 2            // constant current
+#define CHARGER_CV 3            // highest cell at CHARGER_CV_CELL_V, current falls
+#define CHARGER_TAPER 4         // reduced current request until the end current
+#define CHARGER_FAULT 5         // BMS or charger fault / status timeout, stop command, chargerFlag set, left with 'r'
+#define CHARGER_COMPLETE 6      // done, stop command
+
+const char * const chargerStateName[7] = { "IDLE", "HANDSHAKE", "CC", "CV", "TAPER", "FAULT", "COMPLETE" };
+uint8_t chargerState = CHARGER_IDLE;
+uint32_t chargerStateMs = 0;    // millis() of the last state change
+uint32_t chargerTxMs = 0;       // millis() of the last command frame
+uint32_t chargerEndMs = 0;      // millis() since the current is below CHARGER_END_A
+float chargeIntegral = 0;       // A, integral part of the CC-CV controller
+uint32_t chargeControlMs = 0;
+int chargeRequest = 0;          // current request in 0.1A
+int chargeRequestSent = 0;
+
+//ECU CAN SECTION
+
+struct canTxStream
+{
+  uint16_t frameCount;                                // frames in one pass over the stream
+  uint16_t periodMs;                                  // min time between the start of two passes
+  void (*plan)(void);                                 // called at the start of every pass to order the frames, may be NULL
+  bool (*build)(uint16_t cursor, CAN_message_t &msg); // fills the frame at position "cursor" of the pass, false to skip it
+  uint16_t cursor;                                    // next frame to send in the current pass
+  uint32_t passStart;                                 // millis() at the start of the current pass
+};
+
+void planVoltFrames(void);
+void planTempFrames(void);
+bool buildVoltFrame(uint16_t cursor, CAN_message_t &msg);
+bool buildTempFrame(uint16_t cursor, CAN_message_t &msg);
+bool buildResFrame(uint16_t cursor, CAN_message_t &msg);
+bool buildSopFrame(uint16_t cursor, CAN_message_t &msg);
+bool buildTempWarnFrame(uint16_t cursor, CAN_message_t &msg);
+bool buildLatencyFrame(uint16_t cursor, CAN_message_t &msg);
+bool buildBalanceFrame(uint16_t cursor, CAN_message_t &msg);
+void planJournalFrames(void);
+bool buildJournalFrame(uint16_t cursor, CAN_message_t &msg);
+
+#define ECU_VOLT_FRAMES (LTCDEF_CELL_MONITOR_COUNT * ECU_VOLT_FRAMES_PER_SLAVE)
+#define ECU_TEMP_FRAMES (LTCDEF_CELL_MONITOR_COUNT * ECU_TEMP_FRAMES_PER_SLAVE)
+
+// the original IDs as long as every range fits in front of the next one, else the ranges one after the other from 0x200
+#if (ECU_VOLT_FRAMES <= 0x40) && (ECU_TEMP_FRAMES <= 0x10) && (ECU_VOLT_FRAMES <= 0x20) && (LTCDEF_CELL_MONITOR_COUNT <= 0x60)
+#define ECU_VOLT_BASE_ID 0x100
+#define ECU_TEMP_BASE_ID 0x140
+#define ECU_RES_BASE_ID 0x180
+#define ECU_BALANCE_BASE_ID 0x1A0
+#else
+#define ECU_VOLT_BASE_ID 0x200
+#define ECU_TEMP_BASE_ID (ECU_VOLT_BASE_ID + ECU_VOLT_FRAMES)
+#define ECU_RES_BASE_ID (ECU_TEMP_BASE_ID + ECU_TEMP_FRAMES)
+#define ECU_BALANCE_BASE_ID (ECU_RES_BASE_ID + ECU_VOLT_FRAMES)
+#endif
+#if (ECU_BALANCE_BASE_ID + LTCDEF_CELL_MONITOR_COUNT > 0x7FF) || (ECU_VOLT_FRAMES > 0xFF)
+#error "too many ECU frames for 11 bit IDs"
+#endif
+
+// streams are served in this order, so put the more important ones first
+struct canTxStream canTxStreams[] =
+{
+  { 2, ECU_SOP_PERIOD_MS, NULL, buildSopFrame, 2, 0 },
+  { 1, ECU_TEMP_WARN_PERIOD_MS, NULL, buildTempWarnFrame, 1, 0 },
+  { 2, 0, planJournalFrames, buildJournalFrame, 2, 0 },
+  { ECU_VOLT_FRAMES, ECU_VOLT_PERIOD_MS, planVoltFrames, buildVoltFrame, ECU_VOLT_FRAMES, 0 },
+  { ECU_TEMP_FRAMES, ECU_TEMP_PERIOD_MS, planTempFrames, buildTempFrame, ECU_TEMP_FRAMES, 0 },
+  { ECU_VOLT_FRAMES, ECU_RES_PERIOD_MS, NULL, buildResFrame, ECU_VOLT_FRAMES, 0 },
+  { LATENCY_CLASSES, ECU_LATENCY_PERIOD_MS, NULL, buildLatencyFrame, LATENCY_CLASSES, 0 },
+  { LTCDEF_CELL_MONITOR_COUNT, ECU_BALANCE_PERIOD_MS, NULL, buildBalanceFrame, LTCDEF_CELL_MONITOR_COUNT, 0 },
+};
+
+// send order of the current pass: frames with out of limit or extreme cells first, the rest round robin
+uint8_t voltFrameOrder[ECU_VOLT_FRAMES];
+uint8_t tempFrameOrder[ECU_TEMP_FRAMES];
+uint16_t voltFrameRotation = 0;
+uint16_t tempFrameRotation = 0;
+
+const float canTxCreditMax = (float)ECU_CAN_BAUDRATE * ECU_CAN_BUSLOAD_PERCENT / 100 * ECU_CAN_BURST_MS / 1000;
+float canTxCredit = 0;
+uint32_t canTxLastService = 0;
+uint32_t canTxFrameCount = 0;
+uint32_t canTxFullCount = 0;
+
+//SERIAL OUTPUT SECTION
+
+// All diagnostic output is written into this ring buffer instead of Serial directly.
+// serialTxDrain() hands it to Serial only as far as Serial.availableForWrite() allows,
+// so a slow or disconnected host can never block the loop.
+// Drop policy: a write that does not fit completely is dropped as a whole (newest data is lost,
+// already queued lines stay intact) and accounted in droppedBytes / droppedWrites.
+// Single producer (loop) / single consumer (drain): head is only written by write(), tail only by drain()
+class SerialTxQueue : public Print
+{
+  public:
+    virtual size_t write(uint8_t c);
+    virtual size_t write(const uint8_t * data, size_t len);
+    using Print::write;
+    uint32_t used(void) { return head - tail; }
+
+    volatile uint32_t head = 0;
+    volatile uint32_t tail = 0;
+    uint32_t droppedBytes = 0;
+    uint32_t droppedWrites = 0;
+    uint32_t highWater = 0;
+    uint8_t buf[SERIAL_TX_QUEUE_SIZE];
+};
+
+SerialTxQueue SerialTx;
+uint32_t reportedDroppedBytes = 0;
+
+double cellVoltages[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_CELLS_PER_SLAVE];     // cell voltages data
+int8_t voltageErrorLoc[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_CELLS_PER_SLAVE];  // gives location of voltage error (-1 in case of error / 0 in case of no error)
+int8_t voltageNormalize[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_CELLS_PER_SLAVE];
+int8_t voltageSplit[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_CELLS_PER_SLAVE];
+double cellTemperatures[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_TEMPS_PER_SLAVE]; // cell temp data
+int8_t tempErrorLoc[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_TEMPS_PER_SLAVE];  // gives location of voltage error (-1 in case of error / 0 in case of no error)
+int8_t tempNormalize[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_TEMPS_PER_SLAVE];
 float batVoltage_num;
 float batCurrPower_num[1];
 String batVoltage;                                  // TS voltage
@@ -414,16 +844,16 @@ String CellData_GUI="";
 // circular daisy chain 
 bool loopcount = true;
 float tolerance = 1;
-double cells[LTCDEF_CELL_MONITOR_COUNT][18];
-double cells1[LTCDEF_CELL_MONITOR_COUNT][18];
-double cells2[LTCDEF_CELL_MONITOR_COUNT][18];
+double cells[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_CELLS_PER_CELL_MONITOR_COUNT];
+double cells1[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_CELLS_PER_CELL_MONITOR_COUNT];
+double cells2[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_CELLS_PER_CELL_MONITOR_COUNT];
 
-double auxHigh1[LTCDEF_CELL_MONITOR_COUNT][12];
-double auxLow1[LTCDEF_CELL_MONITOR_COUNT][12];
-double auxHigh2[LTCDEF_CELL_MONITOR_COUNT][12];
-double auxLow2[LTCDEF_CELL_MONITOR_COUNT][12];
-double auxHigh[LTCDEF_CELL_MONITOR_COUNT][12];
-double auxLow[LTCDEF_CELL_MONITOR_COUNT][12];
+double auxHigh1[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_AUX_PER_CELL_MONITOR_COUNT];
+double auxLow1[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_AUX_PER_CELL_MONITOR_COUNT];
+double auxHigh2[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_AUX_PER_CELL_MONITOR_COUNT];
+double auxLow2[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_AUX_PER_CELL_MONITOR_COUNT];
+double auxHigh[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_AUX_PER_CELL_MONITOR_COUNT];
+double auxLow[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_AUX_PER_CELL_MONITOR_COUNT];
 
 struct maxMinParameters
 {
@@ -436,58 +866,608 @@ struct maxMinParameters maxVoltage;
 struct maxMinParameters minVoltage;
 struct maxMinParameters maxTemp;
 
+// Per-cell SOC / capacity, one entry per cell of cellVoltages[][].
+// Every cycle soc is coulomb counted from the shared pack charge (ChargeAccumulated), which costs one
+// divide-add per cell, so the loop time grows only linearly with LTCDEF_CELL_MONITOR_COUNT.
+// The OCV lookup is only done while the pack rests: soc is pulled towards the cell OCV and the capacity
+// is re-estimated from the charge that passed between two rest points.
+// Every cell starts from the OCV of its first plausible reading, a cell that reads 0 V or the >6 V error
+// class is not seeded (and not counted as weakest cell) before it reads inside CELL_V_PLAUSIBLE_MIN..MAX.
+#define CELL_SOC_REST_CURRENT 1.0f   // A, below this the pack counts as resting
+#define CELL_SOC_REST_MS 30000       // rest time before the cell voltage is taken as OCV
+#define CELL_SOC_OCV_GAIN 0.02f      // share of the OCV error corrected per cycle at rest
+#define CELL_CAP_MIN_DQ 5.0f         // Ah between two rest points for a capacity update (~20 % swing)
+#define CELL_CAP_GAIN 0.25f          // share of a new capacity estimate taken per update
+
+struct cellSocState
+{
+  float soc;          // 0..1
+  float capacityAh;
+  float socRest;      // OCV soc at the last rest point
+  bool init;          // seeded from a plausible cell voltage, until then the cell is left out
+};
+
+struct cellSocState cellSoc[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_CELLS_PER_SLAVE];
+float cellSocChargeRef = 0;     // ChargeAccumulated at the last update
+float cellSocChargeRest = 0;    // ChargeAccumulated at the last rest point
+uint32_t cellSocRestStart = 0;
+bool cellSocResting = false;
+bool cellSocInit = false;
+struct maxMinParameters weakestCell;   // val: soc of the cell with the least remaining charge
+float weakestCellAh = 0;
+
+// Per-cell internal resistance, scalar recursive least squares on dV = R * dI between two cell voltage frames
+// with a synchronous current (fast single shot). Frames without one (backward chain with circular) are skipped,
+// the last synchronous frame stays the reference as long as it is not older than CELL_RES_MAX_AGE_MS.
+// Only load steps of at least CELL_RES_MIN_DI are used, so OCV drift and polarisation between the two frames
+// stay small against R * dI.
+#define CELL_RES_MIN_DI 5.0f        // A
+#define CELL_RES_MAX_AGE_MS (3 * LOOP_DEADLINE_MS)  // two loops per synchronous frame with circular
+#define CELL_RES_LAMBDA 0.98f       // forgetting factor, ~50 load steps memory
+#define CELL_RES_P0 1.0e-5f         // initial / max. covariance in Ohm^2
+#define CELL_RES_NOISE_V2 4.0e-6f   // V^2, variance of dV not explained by R * dI (2mV: noise, OCV drift, polarisation)
+#define CELL_RES_MAX 0.05f          // Ohm, estimates are clamped to 0..CELL_RES_MAX
+
+struct cellResState
+{
+  float r;        // Ohm
+  float p;        // covariance of r
+  float vPrev;    // cell voltage of the previous frame
+};
+
+struct cellResState cellRes[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_CELLS_PER_SLAVE];
+float cellResIPrev = 0;
+uint32_t cellResPrevMs = 0;
+bool cellResPrevValid = false;
+bool cellResInit = false;
+uint32_t cellResUpdates = 0;
+
+// State of power: current limits the pack can deliver / take for a window of t seconds without any cell
+// leaving underVoltageThreshold..overVoltageThreshold. Per cell, with its own resistance estimate r:
+//   I = (Vocv - Vlimit) / Reff(t),  Vocv = V - r * I_now
+//   Reff(t) = r * (1 + EKF_R1 / EKF_R0 * (1 - exp(-t / (EKF_R1 * EKF_C1)))) + t * dOCV/dsoc / (3600 * capacity)
+// the smallest cell limit wins, then pack limits and temperature derating are applied
+#define SOP_WINDOWS 3
+#define SOP_MAX_DISCHARGE_A 200.0f      // pack / fuse limit
+#define SOP_MAX_CHARGE_A 50.0f          // regen / charge limit of the cells
+#define SOP_HOT_DERATE_START 35.0       // degC, linear derating to 0 at overTempThreshold
+#define SOP_COLD_CHARGE_FULL 10.0       // degC, linear charge derating to 0 at 0 degC
+
+const float sopWindowS[SOP_WINDOWS] = { 2, 10, 30 };
+
+struct sopLimits
+{
+  float discharge[SOP_WINDOWS];   // A, positive
+  float charge[SOP_WINDOWS];      // A, positive
+  float derate;                   // 0..1, temperature derating applied to both
+  bool fault;
+};
+
+struct sopLimits sop;
+
+// Temperature trends, updated once per temperature frame in fixed point (Q8, 1/256 degC):
+//   ema  += (T - ema) / 2^TREND_TEMP_SHIFT                         smoothed temperature
+//   rate += ((ema - ref) / span - rate) / 2^TREND_RATE_SHIFT       smoothed rise rate in degC/min
+// where ref is the ema snapshot taken every TREND_RATE_HORIZON_MS and span the time since it. Differencing the ema
+// over one frame would scale the quantisation noise by the loop rate (one 0.1degC step at 100 ms is 60degC/min),
+// over the fixed horizon the noise is the same at any loop rate.
+// and the outlier score of every thermistor is its ema minus the mean ema of its slave.
+// A warning is raised for a fast rise, an outlier or when ema + rate * TREND_PREDICT_MIN reaches overTempThreshold,
+// so the fan and the ECU react long before the absolute limit trips BMS_FLT_3V3.
+// Cell voltages get the same filters once per cell voltage frame (Q4, 1/16 of 100uV, TREND_VRATE_HORIZON_MS). The pack current moves all
+// cells of a slave alike, so only a cell whose dV/dt is more than TREND_VDROP_WARN below the mean dV/dt of its
+// slave (self discharge through an internal short) raises TREND_WARN_VDROP in voltTrendWarn. It is reported to the ECU
+// with the temperature bits but does not drive the fans or hold off balancing, tempTrendWarn does.
+// A channel is (re)seeded from its first valid reading after it was skipped, its rate starts one full horizon later
+// and only channels with a rate enter the slave mean dV/dt.
+// The divisions round to nearest, symmetric around 0 (trendShift), a plain >> would drift the averages down.
+#define TREND_Q 8
+#define TREND_TEMP_SHIFT 2              // alpha 1/4
+#define TREND_RATE_SHIFT 3              // alpha 1/8
+#define TREND_RATE_HORIZON_MS 10000     // ema snapshot interval for the rise rate
+#define TREND_RATE_WARN 2.0             // degC/min
+#define TREND_OUTLIER_WARN 5.0          // degC above the slave mean
+#define TREND_PREDICT_MIN 2.0           // min, prediction horizon for the over temperature warning
+#define TREND_V_Q 4
+#define TREND_VOLT_SHIFT 2              // alpha 1/4
+#define TREND_VRATE_SHIFT 3             // alpha 1/8
+#define TREND_VRATE_HORIZON_MS 30000    // ema snapshot interval for dV/dt, a self discharge is slow
+#define TREND_VDROP_WARN 5.0            // mV/min below the mean dV/dt of the slave
+#define TREND_WARN_HOLD_MS 10000        // a warning is held this long after its cause is gone
+#define TREND_WARN_RATE 0x01
+#define TREND_WARN_OUTLIER 0x02
+#define TREND_WARN_PREDICT 0x04
+#define TREND_WARN_VDROP 0x08
+
+struct trendFilter
+{
+  int32_t ema;      // Q8 degC / Q4 100uV
+  int32_t rate;     // same unit per minute
+  int32_t ref;      // ema at the last horizon boundary
+  bool init;        // ema seeded, cleared while the channel is skipped
+  bool refValid;    // ref was taken on a boundary, the next one yields a rate
+  bool rateValid;   // rate holds at least one horizon
+};
+
+struct trendFilter tempTrends[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_TEMPS_PER_SLAVE];
+bool tempTrendInit = false;
+uint32_t tempTrendRefMs = 0;            // last horizon boundary
+uint8_t tempTrendWarn = 0;              // TREND_WARN_RATE / _OUTLIER / _PREDICT bits, held for TREND_WARN_HOLD_MS
+uint32_t tempTrendWarnMs[8];            // per TREND_WARN_* bit: last time its cause was present
+struct maxMinParameters maxTempRate;    // val in degC/min
+struct maxMinParameters maxTempOutlier; // val in degC above the slave mean
+
+struct trendFilter voltTrends[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_CELLS_PER_SLAVE];
+bool voltTrendInit = false;
+uint32_t voltTrendRefMs = 0;
+uint8_t voltTrendWarn = 0;              // TREND_WARN_VDROP, held for TREND_WARN_HOLD_MS, CAN / serial report only
+uint32_t voltTrendWarnMs[8];
+struct maxMinParameters maxVoltDrop;    // val in mV/min below the mean dV/dt of the slave
+
+// Passive balancing: every cell more than BALANCE_DELTA_V above the pack minimum gets its discharge switch (DCC bit),
+// with BALANCE_HYST_V hysteresis so a cell does not toggle every cycle.
+// Measurement and balancing windows alternate in every loop: all DCC bits are cleared before ADCV / ADAX
+// (CellMonitorCFGA/CFGB on the forward chain, balanceWriteDcc(false) on the backward chain) and set again by
+// balanceService() once the frame is evaluated, so no voltage is read with the balance current flowing.
+#define BALANCE_DELTA_V 0.010           // V above the pack minimum to start discharging a cell
+#define BALANCE_HYST_V 0.003            // V, a discharged cell is released at BALANCE_DELTA_V - BALANCE_HYST_V
+#define BALANCE_MIN_CELL_V 3.60         // V, no balancing while the lowest cell is below this
+#define BALANCE_MAX_DISCHARGE_A 10.0    // A, no balancing under a drive load, the pack minimum is not meaningful then
+#define BALANCE_ST_ACTIVE 0x01          // at least one DCC bit set
+#define BALANCE_ST_FAULT 0x02           // held off, voltFlag / tempFlag
+#define BALANCE_ST_LOW 0x04             // held off, lowest cell below BALANCE_MIN_CELL_V
+#define BALANCE_ST_LOAD 0x08            // held off, discharge current above BALANCE_MAX_DISCHARGE_A
+#define BALANCE_ST_THERMAL 0x10         // cells waiting, the dissipation budget of the slave is used up
+#define BALANCE_ST_TREND 0x20           // held off, temperature trend warning (tempTrendWarn)
+#define BALANCE_ST_HOLD (BALANCE_ST_FAULT | BALANCE_ST_LOW | BALANCE_ST_LOAD | BALANCE_ST_TREND)
+
+// Thermal budget per slave: the discharge resistors of one board may dissipate
+//   budget = min(BALANCE_SLAVE_MAX_W, (BALANCE_BOARD_MAX_T - Thot) / BALANCE_BOARD_RTH)
+// with Thot the hottest thermistor of the slave, derated linearly to 0 between BALANCE_CELL_T_START and
+// BALANCE_CELL_T_STOP so balancing never adds heat to a warm pack. A first order model of the board
+// (BALANCE_BOARD_RTH, BALANCE_BOARD_TAU_S) driven by the switched V^2 / R gives the hot spot estimate Thot + rise
+// and stops balancing on that board when it reaches BALANCE_BOARD_MAX_T.
+// The budget is filled in balanceOrder() (every other cell first, to spread the heat over the board) starting at a
+// rotation point that moves on every BALANCE_ROTATE_MS, so all waiting cells get the same share.
+#define BALANCE_RESISTOR_OHM 33.0       // discharge resistor per cell on the slave board
+#define BALANCE_SLAVE_MAX_W 2.0         // W, continuous dissipation one slave board may take
+#define BALANCE_BOARD_RTH 12.0          // degC/W, resistor hot spot above the thermistors
+#define BALANCE_BOARD_TAU_S 120.0       // s, thermal time constant of the board
+#define BALANCE_BOARD_MAX_T 65.0        // degC, hot spot limit
+#define BALANCE_CELL_T_START 40.0       // degC, budget derating starts
+#define BALANCE_CELL_T_STOP 50.0        // degC, no balancing
+#define BALANCE_ROTATE_MS 10000
+
+struct balanceSlave
+{
+  uint32_t wanted;      // cells above the threshold, bit i = cell i
+  uint8_t rotation;     // balanceOrder() position the budget is filled from
+  bool limited;         // not all wanted cells fit into the budget
+  float budgetW;
+  float powerW;         // dissipation of the current balancing window
+  float boardRise;      // degC, modelled hot spot rise above the hottest thermistor
+  float boardTemp;      // degC, hottest thermistor + boardRise, -100 without a valid thermistor
+};
+
+struct balanceSlave balanceSlaves[LTCDEF_CELL_MONITOR_COUNT];
+uint32_t balanceMask[LTCDEF_CELL_MONITOR_COUNT];   // bit i set while cell i is discharged
+uint32_t balanceLastMs = 0;
+uint32_t balanceRotateMs = 0;
+uint16_t balanceCellCount = 0;
+uint8_t balanceStatus = 0;              // BALANCE_ST_* bits
+float balanceThreshold = 0;             // V, start threshold of the latest selection
+bool balanceDccActive = false;          // DCC bits may be set in the cell monitors
+
+// SIMULATION SECTION
+#ifdef simulatedChain
+/*
+  Simulation backend of the HAL: LTCDEF_CELL_MONITOR_COUNT LTC681x, the LTC2949 and the isoSPI links between them,
+  so the acquisition and evaluation path runs on a bare Teensy off the car.
+  - every cell input follows OCV_CURVE at its own SOC plus pack current * SIM_CELL_R plus the voltage over a
+    SIM_CELL_R1 || C1 polarisation with SIM_CELL_TAU_S, a closed DCC switch drains
+    the cell through BALANCE_RESISTOR_OHM and pulls its reading down by SIM_DCC_DROP_V
+  - the thermistors are routed by the GPIO9 mux bit of CFGB like on the slave boards (inverse of voltToTemp())
+  - a conversion takes simConvUs, result registers read before that are still cleared (0xFFFF)
+  - simPecPercent of the register reads return 0xFFFF with a PEC error for one slave
+  - with simLinkBreak set, commands only reach the slaves in front of the broken link on the selected chain,
+    the others read 0xFFFF with a PEC error, which circularVoltdef() has to sort out
+  The LTC2949 sits on the forward chain only, its slow channel updates every LTC2949_TIMING_CONT_CYCLE.
+  The host build (CMakeLists.txt, host/) runs this backend on a PC, console on stdin / stdout.
+*/
+#define SIM_START_SOC 0.60f
+#define SIM_CELL_R 0.0015f              // Ohm per series element
+#define SIM_CELL_R1 0.002f              // Ohm, polarisation per series element (the EKF assumes EKF_R1)
+#define SIM_CELL_TAU_S 20.0f            // s, R1 * C1 of the polarisation (the EKF assumes EKF_R1 * EKF_C1)
+#define SIM_DCC_DROP_V 0.015f           // V, IR drop in the sense lines while a DCC switch is closed
+#define SIM_NOISE_LSB 5                 // +- 100uV LSBs on every conversion
+#define SIM_AUX_REF 3.0f                // V, second reference (aux register 5)
+#define SIM_TEMP_AMBIENT 25.0f
+#define SIM_TEMP_RISE_PER_A2 0.0004f    // degC per A^2, steady state self heating of the cells
+#define SIM_TEMP_TAU_S 300.0f
+#define SIM_PEC_ERROR 0x01              // one PEC error, see err_detected()
+#define SIM_FAST_HS_DONE 0x0F0F         // HS bytes of a completed fast single shot (LTC2949_FASTSSHT_HS_OK)
+
+struct simMonitor
+{
+  float soc[LTCDEF_CELLS_PER_CELL_MONITOR_COUNT];       // per cell input
+  float v1[LTCDEF_CELLS_PER_CELL_MONITOR_COUNT];        // V over the polarisation R1 || C1, per cell input
+  float tempBase[LTCDEF_TEMPS_PER_SLAVE];   // degC without self heating, index as cellTemperatures[]
+  float tempRise;       // degC, self heating
+  byte cfga[6];
+  byte cfgb[6];
+  uint16_t cv[LTCDEF_CELLS_PER_CELL_MONITOR_COUNT];    // cell voltage result registers, 100uV
+  uint16_t aux[LTCDEF_AUX_PER_CELL_MONITOR_COUNT];     // aux result registers, 100uV
+};
+
+struct simMonitor simChain[LTCDEF_CELL_MONITOR_COUNT];   // physical order, 0 = first slave of the forward chain
+bool simForward = true;                 // LTCDEF__CS selected, else the backward chain (register buffers reversed)
+uint8_t simLinkBreak = 0;               // link in front of physical slave simLinkBreak broken (1..count-1), 0 = intact
+uint8_t simPecPercent = 0;
+uint32_t simConvUs = LTC2949_68XX_T6C_27KHZ_US;
+float simCurrentA = 0;                  // positive while charging
+float simPackV = 0;
+double simChargeAs = 0;                 // LTC2949 C1 / E1 accumulators
+double simEnergyJ = 0;
+uint32_t simStepUs = 0;
+uint32_t simCvStartUs = 0, simAuxStartUs = 0;
+uint32_t simSlowMs = 0;
+bool simFastFresh = false;              // fast single shot result not read yet
+#endif
+
 int8_t errorFlag[9] = {0};
 bool bmsFlag;
 bool voltFlag;
 bool tempFlag;
+
+// per-channel fault debounce state
+#define FAULT_CH_OK 0
+#define FAULT_CH_SETTING 1      // out of limits, set time running
+#define FAULT_CH_ACTIVE 2       // qualified fault
+#define FAULT_CH_CLEARING 3     // back inside the limits, clear time running (fault still asserted)
+
+struct faultChannel
+{
+  uint8_t state;
+  int8_t type;          // errorFlag[] index of the last out of limit condition
+  uint32_t since;       // millis() of the last state change
+  uint32_t convUs;      // conversion start of the frame that first saw the channel out of limits
+};
+
+struct faultChannel voltFault[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_CELLS_PER_SLAVE];
+struct faultChannel tempFault[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_TEMPS_PER_SLAVE];
+
+// Fault latency, per fault class (errorFlag[] index) from the conversion start (ADCV / ADAX) of the first
+// out of limit frame to BMS_FLT_3V3 low in Interrupt(). Includes the debounce set time on purpose,
+// that is the number the rules ask for. Histogram with LATENCY_BUCKET_MS buckets for the p99.
+
+struct latencyStats
+{
+  uint32_t count;
+  uint32_t minUs;
+  uint32_t maxUs;
+  uint64_t sumUs;
+  uint32_t lastDecisionToPinUs;
+  uint16_t bucket[LATENCY_BUCKETS];
+  bool pending;                         // qualified, waiting for the pin
+  uint32_t pendingConvUs;
+  uint32_t pendingDecisionUs;
+};
+
+struct latencyStats latency[LATENCY_CLASSES];
+uint32_t voltConvUs = 0, voltReadUs = 0;    // conversion start / results read of the latest voltage frame
+uint32_t tempConvUs = 0, tempReadUs = 0;    // same for the temperature frame (both mux passes)
+uint32_t voltAcqMaxUs = 0, tempAcqMaxUs = 0;
+
+#ifdef faultInjection
+int8_t injectType = -1;                     // errorFlag[] index to simulate, -1 off
+uint8_t injectSlave = 0, injectCell = 0;
+#endif
+
+// Fault journal: every qualified fault and its release is recorded with time, cycle, location and value.
+// The newest FAULT_JOURNAL_SIZE events are kept in RAM. faultJournalAdd() only writes RAM, it runs inside the fault
+// debounce before BMS_FLT_3V3 is driven. faultJournalPersist() runs after triggerInterrupt() and appends the new
+// events to AMSFaults<n>.txt on the SD card and to a ring of FAULT_JOURNAL_EEPROM_ENTRIES at the end of the EEPROM
+// (byte 0 holds the log file number), from which the RAM journal is restored at start-up. It writes at most
+// FAULT_JOURNAL_PERSIST_MAX events, one EEPROM header and one SD flush every FAULT_JOURNAL_PERSIST_MS, so a
+// chattering fault does not wear the EEPROM. Query with the 'j' console command or over Can2.
+#define FAULT_JOURNAL_SIZE 64
+#define FAULT_JOURNAL_EEPROM_ENTRIES 32
+#define FAULT_JOURNAL_PERSIST_MAX 8
+#define FAULT_JOURNAL_PERSIST_MS 1000
+#define FAULT_JOURNAL_REQ_QUEUE 8             // pending ECU journal requests, must be a power of 2
+#define FAULT_JOURNAL_MAGIC 0x4A4C4146UL       // "FALJ"
+#define FAULT_EVENT_CLEARED 0x80
+
+struct faultEvent
+{
+  uint32_t timeMs;      // millis() since that boot
+  uint32_t cycle;       // measurement cycle
+  float value;          // V or degC
+  int8_t type;          // errorFlag[] index
+  uint8_t slave;        // 1..LTCDEF_CELL_MONITOR_COUNT
+  uint8_t cell;         // 1..LTCDEF_CELLS_PER_SLAVE
+  uint8_t flags;        // FAULT_EVENT_CLEARED, bit 0-6: boot number (log file number)
+};
+
+struct faultJournalHeader
+{
+  uint32_t magic;
+  uint32_t count;       // events written to the EEPROM in total
+};
+
+#define FAULT_JOURNAL_EEPROM_BASE (EEPROM.length() - sizeof(struct faultJournalHeader) - FAULT_JOURNAL_EEPROM_ENTRIES * sizeof(struct faultEvent))
+
+struct faultEvent faultJournal[FAULT_JOURNAL_SIZE];
+uint32_t faultJournalCount = 0;     // events added in total, newest at (faultJournalCount - 1) % FAULT_JOURNAL_SIZE
+uint32_t faultJournalEepromCount = 0;
+uint32_t faultJournalPersisted = 0;  // events of faultJournal[] already on the EEPROM and the SD card
+uint32_t faultJournalPersistMs = 0;
+uint32_t faultJournalLost = 0;       // events overwritten in RAM before they were persisted
+
+// ECU journal requests, answered by the journal stream of canTxService()
+uint8_t journalReqQueue[FAULT_JOURNAL_REQ_QUEUE];
+uint8_t journalReqHead = 0;
+uint8_t journalReqTail = 0;
+uint32_t journalReqDropped = 0;
+bool journalTxActive = false;        // the current pass of the journal stream answers journalTxIndex
+uint8_t journalTxIndex = 0;
+uint8_t journalTxStored = 0;
+struct faultEvent journalTxEvent;
+uint32_t cycleCount = 0;
+#define FAULT_TYPE_WATCHDOG 8                 // journal type of a watchdog reset (errorFlag[8] is unused)
+
+//DEADLINE SECTION
+
+#define STAGE_INIT 0        // circular re-init and LTC2949 slow channel
+#define STAGE_VOLT 1        // cell voltages + current, SOC and resistance update
+#define STAGE_TEMP 2        // cell temperatures
+#define STAGE_EVAL 3        // max / min, cooling, fault debounce, state of power
+#define STAGE_LOG 4         // battery values and SD logging
+#define STAGE_CAN 5         // ECU broadcast and charger
+#define STAGE_OUTPUT 6      // BMS_FLT_3V3, serial output, console
+#define STAGE_COUNT 7
+
+const char * const stageName[STAGE_COUNT] = { "init", "volt", "temp", "eval", "log", "can", "output" };
+
+// budget of every stage in us, the sum must stay below LOOP_DEADLINE_MS
+const uint32_t stageBudgetUs[STAGE_COUNT] =
+{
+  250000,             // circular: Init() waits LTC2949_TIMING_BOOTUP and a CONT cycle every loop
+  60000,
+  120000,
+  10000,
+  50000,
+  20000,
+  20000,
+};
+
+struct stageStats
+{
+  uint32_t lastUs;
+  uint32_t maxUs;
+  uint32_t overruns;
+};
+
+struct stageStats stageStat[STAGE_COUNT];
+uint32_t deadlineLoopStart = 0;
+uint32_t deadlineStageStart = 0;
+uint32_t deadlineLoopMaxUs = 0;
+uint32_t deadlineLoopOverruns = 0;
+uint8_t deadlineLastOverrunStage = 0xFF;      // stage of the last overrun, 0xFF none yet
+uint32_t deadlineLastOverrunCycle = 0;
+
+//PROFILING SECTION
+
+// Cycle count probes (DWT CYCCNT) around the single steps of the loop stages, finer than the deadline
+// stages above. PROFILE_SCOPE(probe) measures up to the end of the enclosing block, PROFILE_START /
+// PROFILE_STOP for spans that do not fit a block. Without profiling the macros expand to nothing.
+
+#define PROFILE_ADCV 0              // ADCV broadcast
+#define PROFILE_RDCVA 1             // RDCVA, on the forward chain with the LTC2949 fast data poll
+#define PROFILE_RDCVB 2             // RDCVB..RDCVF must stay in a row, see cellVoltageLoop()
+#define PROFILE_RDCVC 3
+#define PROFILE_RDCVD 4
+#define PROFILE_RDCVE 5
+#define PROFILE_RDCVF 6
+#define PROFILE_ADAX_MUX1 7         // one mux phase: CFGB, ADAX, RDAUXA..D and the transfer
+#define PROFILE_ADAX_MUX0 8
+#define PROFILE_TRANSFER 9          // one register group into the cell arrays (transferV / transferT)
+#define PROFILE_SORT 10             // circular merge, sort and normalize of a voltage frame / temperature mux phase
+#define PROFILE_FAULT 11            // checkError() and faultDebounceUpdate()
+#define PROFILE_SD 12               // SDcardLogging()
+#define PROFILE_CAN 13              // canTxService()
+#define PROFILE_CHARGER 14          // chargerService()
+#define PROFILE_SERIAL 15           // serialTxDrain()
+#define PROFILE_LOOP 16             // whole loop()
+#define PROFILE_COUNT 17
+#define PROFILE_SUB_BITS 2          // histogram: 4 buckets per power of two, upper edge at most 25 % above the value
+#define PROFILE_BUCKETS (32 << PROFILE_SUB_BITS)
+
+#ifdef profiling
+const char * const profileName[PROFILE_COUNT] =
+{
+  "adcv", "rdcva", "rdcvb", "rdcvc", "rdcvd", "rdcve", "rdcvf", "adax mux1", "adax mux0",
+  "transfer", "sort", "fault", "sd", "can", "charger", "serial", "loop",
+};
+
+struct profileStats
+{
+  uint32_t count;
+  uint32_t minCyc;
+  uint32_t maxCyc;
+  uint64_t sumCyc;
+  uint16_t bucket[PROFILE_BUCKETS];
+};
+
+struct profileStats profile[PROFILE_COUNT];
+
+void profileRecord(uint8_t probe, uint32_t cycles);
+
+struct profileProbe
+{
+  uint8_t probe;
+  uint32_t start;
+  profileProbe(uint8_t id) : probe(id), start(ARM_DWT_CYCCNT) {}
+  ~profileProbe() { profileRecord(probe, ARM_DWT_CYCCNT - start); }
+};
+
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#define PROFILE_SCOPE(probe) profileProbe PROFILE_CONCAT(profileProbe_, __LINE__)(probe)
+#define PROFILE_START(var) uint32_t var = ARM_DWT_CYCCNT
+#define PROFILE_STOP(probe, var) profileRecord(probe, ARM_DWT_CYCCNT - (var))
+#else
+#define PROFILE_SCOPE(probe)
+#define PROFILE_START(var)
+#define PROFILE_STOP(probe, var)
+#endif
+
+//BENCHMARK SECTION
+
+// 'k' runs every processing function BENCH_ITERATIONS times on a synthetic full pack (inputs refilled before
+// every call, outside the measurement) and prints min / avg / max. The live measurement arrays are saved before
+// and restored after, the loop of that cycle overruns its deadline though. Every run is appended to
+// BENCH_FILE_NAME with the build date, so results of different firmware versions can be compared.
+
+#define BENCH_ITERATIONS 100
+#define BENCH_FRAME_BUDGET_US 2000    // processing of one measurement cycle (perFrame below), excluding the chain
+#define BENCH_FILE_NAME "AMSBench.txt"
+
+#ifdef kernelBenchmark
+struct benchKernel
+{
+  const char * name;
+  void (*prepare)(void);      // refills the inputs, not measured
+  void (*run)(void);
+  uint8_t perFrame;           // calls per measurement cycle, 0 = not part of the cycle
+};
+
+struct benchSaved
+{
+  double cells[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_CELLS_PER_CELL_MONITOR_COUNT];
+  double cells1[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_CELLS_PER_CELL_MONITOR_COUNT];
+  double cells2[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_CELLS_PER_CELL_MONITOR_COUNT];
+  double auxHigh1[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_AUX_PER_CELL_MONITOR_COUNT];
+  double auxLow1[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_AUX_PER_CELL_MONITOR_COUNT];
+  double auxHigh2[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_AUX_PER_CELL_MONITOR_COUNT];
+  double auxLow2[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_AUX_PER_CELL_MONITOR_COUNT];
+  double auxHigh[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_AUX_PER_CELL_MONITOR_COUNT];
+  double auxLow[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_AUX_PER_CELL_MONITOR_COUNT];
+  double cellVoltages[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_CELLS_PER_SLAVE];
+  double cellTemperatures[LTCDEF_CELL_MONITOR_COUNT][LTCDEF_TEMPS_PER_SLAVE];
+  struct maxMinParameters maxVoltage;
+  struct maxMinParameters minVoltage;
+  struct maxMinParameters maxTemp;
+  bool loopcount;
+  bool BPM_ready;
+};
+
+struct benchSaved benchState;
+volatile double benchSink;          // keeps the results of pure functions alive
+#endif
+bool watchdogRunning = false;
 bool chargerFlag;
 char ui_buffer[UI_BUFFER_SIZE];
+uint8_t ui_index = 0;               // fill level of ui_buffer while a console line is being received
+bool ui_lastWasCR = false;
 
-void sendAllDataToECU(void);
-void sendDataToECU(float voltage, float temperature);
+// console debug mode: a fault latches BMS_FLT_3V3 low until 'r' is received,
+// measurements keep running meanwhile (replaces the blocking Interrupt_for_Debug loop)
+#ifdef Interrupt_Debug
+bool debugHoldMode = true;
+#else
+bool debugHoldMode = false;
+#endif
+bool debugHoldActive = false;
+
+void canTxService(void);
+uint16_t orderFrames(uint8_t * order, uint16_t frameCount, const bool * urgent, uint16_t rotation);
 void cellVoltageLoop(unsigned long timeBuffer);    
 void cellsVoltSort(void);  
 void printCells(void);
-void voltagePlausibilityCheck(void);
 void cellTempLoop(unsigned long timeBuffer);  
 void printAux(void);
-void tempPlausibilityCheck(void);
 void tempConvertSort(bool muxSelect);
+uint8_t tempAuxReg(uint8_t t);
 void batLoop(bool slowChannelReady);
 void checkError(void); 
 void pull_3V3_high(void);             
 void clearFlags(void);   
-void clearFlagsV(void);
-void clearFlagsT(void);
 void transferT(uint16_t * data, uint8_t nic, bool muxSelect, uint8_t auxReg);            
 void transferV(uint16_t * data, uint8_t nic, uint8_t cellReg);                       
 void circularVoltdef(void);
 void circularTempdef(bool muxSelect);
-void chechVoltageFlag(void);
+void checkVoltageFlag(void);
 void checkTempFlag(void);
-void errorCheckingMode(void);
-void triggerError(void);
+double voltToTemp(double auxVal, double auxRef);
+float avg(float a, float b);
+void Interrupt_for_Debug(void);
+void Interrupt(void);
+void initialiseFlags(void);
+void initialiseCAN(void);
+void initCAN(void);
+uint8_t read_data(void);
+byte WakeUpReportStatus(void);
+byte Cont(boolean enable);
+byte ChkDeviceStatCfg(void);
+byte CellMonitorInit(void);
+byte CellMonitorCFGA(byte * cellMonDat, bool verbose);
+byte CellMonitorCFGB(byte * cellMonDat, bool verbose, bool muxSelect);
+void NtcCfgWrite(int ntc1or2, float rref, float a, float b, float c);
+void faultDebounceUpdate(void);
+bool faultChannelUpdate(struct faultChannel &ch, int8_t rawType, bool healthy, uint32_t now, uint32_t setMs, uint32_t clearMs);
+void faultJournalTransition(const struct faultChannel &ch, uint8_t prevState, uint8_t c_ic, uint8_t i, float value);
+void faultJournalAdd(int8_t type, uint8_t slave, uint8_t cell, float value, bool cleared);
+void faultJournalPersist(void);
+void faultJournalRestore(void);
+void faultFileAppend(const struct faultEvent &ev);
+void faultJournalClear(void);
+void printFaultJournal(void);
+void printFaultEvent(const struct faultEvent &ev);
+void faultJournalCanService(void);
+void latencyQualified(int8_t type, uint32_t convUs);
+void latencyPinAsserted(void);
+uint32_t latencyP99Us(const struct latencyStats &st);
+void printLatencyStats(void);
+void clearLatencyStats(void);
+void applyFaultInjection(uint8_t type);
+void deadlineLoopBegin(void);
+void deadlineStageEnd(uint8_t stage);
+void deadlineLoopEnd(void);
+void printDeadlineStats(void);
+void profileInit(void);
+uint32_t profileP99Cyc(const struct profileStats &st);
+void printProfileStats(void);
+void clearProfileStats(void);
+void benchRun(void);
+void watchdogInit(void);
+void watchdogFeed(void);
+void watchdogIsr(void);
 void triggerInterrupt(void);
 void printErrLocV(void);
 void printErrLocT(void);
 void Initialisation(void);
 void switchErrorLed(void);
 void initialiseNormalizeChannel(void);
-void setNormalizeChannels(uint8_t ic, uint16_t * vChannels, uint16_t * tChannels );
-void setNormalizeFlag(uint8_t nic, uint16_t voltChannels, uint16_t tempChannels);
+void setNormalizeChannels(uint32_t ic, const uint32_t * vChannels, const uint32_t * tChannels );
+void setNormalizeFlag(uint8_t nic, uint32_t voltChannels, uint32_t tempChannels);
 void checkVoltNormalize(void);
 void checkTempNormalize(void);
 void initialiseSplitChannel(void);
-void setVoltSplitChannels(uint8_t ic, uint16_t * channels );
-void setVoltSplitFlag(uint8_t nic, uint16_t channels );
+void setVoltSplitChannels(uint32_t ic, const uint32_t * channels );
+void setVoltSplitFlag(uint8_t nic, uint32_t channels );
 void checkVoltSplit(void);
 void checkACUsignalStatus(void);
-void findMax(double array[LTCDEF_CELL_MONITOR_COUNT][15], uint8_t type );
-void findMin(double array[LTCDEF_CELL_MONITOR_COUNT][15]);
+void findMax(uint8_t type);
+void findMin(void);
 void printMaxMinParameters(void);
 void performDynamicCooling(void);
-void chargerLoop(void);
-void triggerchargerError(void);
+void chargerService(void);
+void chargerSetState(uint8_t state);
+void chargerSendCommand(bool start, int current);
+int chargeControl(void);
+void chargerReceive(const CAN_message_t &msg);
+bool chargerStatusSnapshot(void);
 void printchargerError(void);
 void cellsLogging(void);
 void auxLogging(void);
@@ -495,8 +1475,68 @@ void maxMinLogging(void);
 void SDcardLogging(void);
 void initialiseSDcard(void);
 float InitialiseEnergy(float min_voltage, float thr_voltage);
-float CalculateEnergy(float TS_voltage, float TS_current, float &Energy_available, float time_previous);
+byte readAccumulators(void);
+void accuCheckUpdate(float dEnergyE1, float dEnergyP1);
+int64_t bytesToInt64(byte * data, uint8_t len);
 float linear_interpolate(float x0, float y0, float x1, float y1, float x);
+float ocvCapacityLookup(const struct ocvCurve &curve, float v);
+float ocvVoltageLookup(const struct ocvCurve &curve, float soc, float * slope);
+float socFromOcv(const struct ocvCurve &curve, float v);
+float meanCellVoltage(void);
+void socEkfUpdate(float vCell, float current);
+void cellSocUpdate(void);
+void cellResistanceUpdate(void);
+float cellResMean(void);
+void sopUpdate(void);
+void tempTrendUpdate(void);
+void voltTrendUpdate(void);
+void trendStep(struct trendFilter &tr, int32_t x, uint8_t emaShift, uint8_t rateShift, bool boundary, uint32_t spanMs);
+void trendWarnUpdate(uint8_t &held, uint32_t * heldMs, uint8_t warn, uint32_t now);
+int32_t trendShift(int32_t x, uint8_t shift);
+void balanceService(void);
+byte balanceWriteDcc(bool enable);
+uint32_t balanceChannels(uint8_t c_ic);
+uint8_t balanceOrder(uint8_t pos, uint8_t count);
+void printBalance(void);
+uint8_t cellsPerSection(uint8_t c_ic);
+uint8_t cellInput(uint8_t c_ic, uint8_t i);
+void initPackLayout(void);
+#ifdef simulatedChain
+void simInit(void);
+void simSelectChain(uint8_t selCS);
+void simStep(void);
+byte simRdCells(uint16_t rdcv, uint16_t * data);
+byte simRdAux(uint16_t rdaux, uint16_t * data);
+byte simRdCfgReg(byte * data, bool cfgb);
+byte simWrCfgReg(byte * data, bool cfgb);
+byte simClr(bool aux);
+byte simADxx(byte md, byte ch, byte dcp, uint8_t pollTimeout);
+byte simADAX(byte md, byte ch, byte dcp, uint8_t pollTimeout);
+byte simRdFastData(int16_t * fastData, uint16_t * cellMonDat = NULL, uint16_t rdcv = 0, uint16_t pollTimeout = 0);
+byte simREAD(uint16_t addr, uint16_t len, byte * data);
+bool simChkUpdate(byte * error);
+uint32_t simGetLastTBxInt(void);
+void simConsoleCommand(char * arg);
+void printSimulation(void);
+void printSimResistanceCheck(void);
+#endif
+#ifdef AMS_HOST
+void hostReplayBegin(void);
+uint16_t hostCellCount(void);
+uint16_t hostTempCount(void);
+void hostReplayFrame(const float * volts, float current);
+float hostEkfSoc(void);
+float hostCapacityAh(void);
+bool hostBench(void);
+#endif
+void serialTxDrain(void);
+void serialTxComma(void);
+void serialTxOkErr(byte error);
+void serialTxByteArrayHex(byte * data, int len, bool withPrefix);
+void serviceConsole(void);
+void executeConsoleCommand(char * line);
+void printConsoleHelp(void);
+void printSerialTxStats(void);
 
 // define to do a reset every xxx milliseconds
 //#define LTCDEF_DO_RESET_TEST 1000
@@ -511,7 +1551,7 @@ byte  error = 0;
 
 #ifndef LTCDEF_LTC681X_ONLY
 	// store the last TBx value that was read (to be able to calc time difference later...)
-	uint32_t deltaT = LTC2949_GetLastTBxInt();
+	uint32_t deltaT = HAL_GetLastTBxInt();
 #endif
 
 unsigned long mcuTime;
@@ -530,27 +1570,27 @@ void PrintCSVHeader()
 	//Serial.println(F("V,fI2,fBAT,OK/ERR"));
 #ifndef LTCDEF_LTC681X_ONLY
 if(loopcount){
-	Serial.print(F("tDut,I1,P1,BAT,Tntc,TIC,"));
+	SerialTx.print(F("tDut,I1,P1,BAT,Tntc,TIC,"));
 } 
 #else
 
-	Serial.print(F("tDut,"));
+	SerialTx.print(F("tDut,"));
 #endif
 	for (uint8_t j = 0; j < LTCDEF_CELL_MONITOR_COUNT; j++) // number of cell monitors
 	{
 		for (uint8_t n = 0; n < LTCDEF_CELLS_PER_CELL_MONITOR_COUNT; n++)// += 3) // 3 per RDCV
 		{
-			Serial.print((char)('a' + j));
-			Serial.print('C');
-			Serial.print(n);
-			PrintComma();
+			SerialTx.print((char)('a' + j));
+			SerialTx.print('C');
+			SerialTx.print(n);
+			serialTxComma();
 		}
 	}
 #ifdef LTCDEF_LTC681X_ONLY
-	Serial.println(F("eErr,OK/ERR"));
+	SerialTx.println(F("eErr,OK/ERR"));
 #else
 if(loopcount){
-	Serial.println(F("eErr,fI2,fBAT,fT,OK/ERR"));
+	SerialTx.println(F("eErr,fI2,fBAT,fT,OK/ERR"));
 }
 #endif
 
@@ -647,6 +1687,12 @@ if(loopcount){
 
 void setup()
 {
+  // the WDOG1 power-down counter would reset the MCU 16 s after boot, the delays below are close to that
+  WDOG1_WMCR = 0;
+  initPackLayout();
+  #ifdef profiling
+  profileInit();
+  #endif
 	//Initialize serial and wait for port to open:
 	Serial.begin(LTCDEF_BAUDRATE);
 	// wait for serial port to connect. Needed for native USB port only
@@ -669,10 +1715,17 @@ void setup()
   pinMode( TEMP_ERR_PIN , OUTPUT );
   pinMode( BMS_FLT_3V3 , OUTPUT );     // Bpin defined for sending signal to ACU for BMS error
   pinMode( FAN_MBED , OUTPUT );
+  analogWriteFrequency( FAN_MBED , FAN_PWM_FREQ );
   pinMode( CH_EN_MBED , OUTPUT );
 
   
   initialiseSDcard();
+  faultJournalRestore();
+  if ( SRC_SRSR & SRC_SRSR_WDOG_RST_B )
+  {
+    faultJournalAdd(FAULT_TYPE_WATCHDOG, 0, 0, 0, false);
+    SRC_SRSR = SRC_SRSR_WDOG_RST_B;   // write 1 to clear
+  }
 
   initialiseNormalizeChannel();
   setNormalizeChannels(slavesToNormalize, voltChannelToNormalize, tempChannelToNormalize );
@@ -687,6 +1740,9 @@ void setup()
 	// also used for LTC681x
 	// LTC2949_SPISettings = SPISettings(LTC2949_MAX_SPIFREQU, MSBFIRST, LTC2949_DEFAULT_SPIMODE);
   LTC2949_SPISettings = SPISettings(1000000, MSBFIRST, LTC2949_DEFAULT_SPIMODE);
+  #ifdef simulatedChain
+  simInit();
+  #endif
   #ifndef circular
 	Init(LTCDEF__CS, false);
   #endif
@@ -696,11 +1752,12 @@ void setup()
   initCAN();//enables CAN communication for ECU
 
   for (int i = 0 ; i < LTCDEF_CELL_MONITOR_COUNT ; i++){
-    for (int j = 0 ; j<18 ; j++){
+    for (int j = 0 ; j<LTCDEF_CELLS_PER_CELL_MONITOR_COUNT ; j++){
       cells2[i][j]=6;
     }
   }
-  
+
+  watchdogInit();
 }
 
 
@@ -711,6 +1768,9 @@ void Init(uint8_t selCS, boolean ltc2949onTopOfDaisychain)
 #endif
 
 	LTC2949_CS = selCS;
+#ifdef simulatedChain
+	simSelectChain(selCS);
+#endif
 	//Initialize LTC2949 library
 	LTC2949_init_lib(
 		/*byte cellMonitorCount,			*/LTCDEF_CELL_MONITOR_COUNT,
@@ -719,18 +1779,18 @@ void Init(uint8_t selCS, boolean ltc2949onTopOfDaisychain)
 	);
 	LTC2949_init_device_state();
 	// 
-	Serial.print(F("INIT,"));
+	SerialTx.print(F("INIT,"));
 #ifndef LTCDEF_LTC681X_ONLY
 	if (LTC2949_onTopOfDaisychain)
-		Serial.print(F("ON TOP OF"));
+		SerialTx.print(F("ON TOP OF"));
 	else
-		Serial.print(F("PARALLEL TO"));
-	Serial.print(F(" DAISYCHAIN,"));
+		SerialTx.print(F("PARALLEL TO"));
+	SerialTx.print(F(" DAISYCHAIN,"));
 #endif
 
-	Serial.print(F("CS:"));
-	Serial.print(LTC2949_CS);
-	PrintComma();
+	SerialTx.print(F("CS:"));
+	SerialTx.print(LTC2949_CS);
+	serialTxComma();
 	//
 	delay(LTC2949_TIMING_BOOTUP);
 	byte error = 0;
@@ -801,27 +1861,28 @@ String CellVoltagesToString(uint16_t * cellMonDat, uint8_t nic)
 
 void loop()
 {
+  PROFILE_SCOPE(PROFILE_LOOP);
+  deadlineLoopBegin();
   #ifdef circular
    if(loopcount){
     Init(LTCDEF__CS,false);
-    Serial.println("");
-    Serial.println("Entered normal daisy chain");
+    SerialTx.println("");
+    SerialTx.println("Entered normal daisy chain");
   }
   else{
     Init(LTCDEF__CS2,false);
-    Serial.println("");
-    Serial.println("Entered backward daisy chain");
+    SerialTx.println("");
+    SerialTx.println("Entered backward daisy chain");
   }
   #endif
 
   #ifndef GUI_Enabled
-	Serial.print("Start of the code ");
+	SerialTx.print("Start of the code ");
   #endif
   float ti = millis();
   String str = "";
 
 	unsigned long timeBuffer = millis();
-	unsigned long timerus = micros();
 
 
 #ifdef LTCDEF_DO_RESET_TEST
@@ -841,7 +1902,7 @@ void loop()
 #else
   boolean slowChannelReady = true;
   if(loopcount){
-	boolean slowChannelReady = LTC2949_ChkUpdate(&error);
+	boolean slowChannelReady = HAL_ChkUpdate(&error);
 	if (slowChannelReady || LTC_TIMEOUT_CHECK(timeBuffer, mcuTime + LTC2949_TIMING_CONT_CYCLE))
 	{
 		// in case of any error below we will also enter here! (see last delay(LTC2949_TIMING_IDLE2CONT2UPDATE))
@@ -856,7 +1917,7 @@ void loop()
 #ifndef LTCDEF_LTC681X_ONLY
 if(loopcount){
 	if (slowChannelReady){
-		str += String((unsigned int)((LTC2949_GetLastTBxInt() - deltaT) * (1.0e3 * LTC2949_LSB_TB1))); }//Serial.print((unsigned int)((LTC2949_GetLastTBxInt() - deltaT) * (1.0e3 * LTC2949_LSB_TB1)));
+		str += String((unsigned int)((HAL_GetLastTBxInt() - deltaT) * (1.0e3 * LTC2949_LSB_TB1))); }//Serial.print((unsigned int)((LTC2949_GetLastTBxInt() - deltaT) * (1.0e3 * LTC2949_LSB_TB1)));
 	else{}
 }
 #endif
@@ -869,7 +1930,7 @@ if(loopcount){
 	// read high precision current I1
 	if (slowChannelReady)
 	{
-		error |= LTC2949_READ(LTC2949_VAL_I1, 3, buffer);
+		error |= HAL_READ(LTC2949_VAL_I1, 3, buffer);
 		str += String(LTC_3BytesToInt32(buffer) * LTC2949_LSB_I1 / LTCDEF_SENSE_RESISTOR, LTCDEF_DIGITS_I1SLOW); //Serial.print(LTC_3BytesToInt32(buffer) * LTC2949_LSB_I1 / LTCDEF_SENSE_RESISTOR, LTCDEF_DIGITS_I1SLOW);
     batCurrPower_num[0] = LTC_3BytesToInt32(buffer) * LTC2949_LSB_I1 / LTCDEF_SENSE_RESISTOR, LTCDEF_DIGITS_I1SLOW;
     batCurrPower[0] = String(batCurrPower_num[0]);
@@ -884,16 +1945,17 @@ if(loopcount){
 	// read high precision power P1
 	if (slowChannelReady)
 	{
-		error |= LTC2949_READ(LTC2949_VAL_P1, 3, buffer);
+		error |= HAL_READ(LTC2949_VAL_P1, 3, buffer);
 		str += String(LTC_3BytesToInt32(buffer) * LTC2949_LSB_P1 / LTCDEF_SENSE_RESISTOR, LTCDEF_DIGITS_P1SLOW); //Serial.print(LTC_3BytesToInt32(buffer) * LTC2949_LSB_P1 / LTCDEF_SENSE_RESISTOR, LTCDEF_DIGITS_P1SLOW);
-	  batCurrPower[1] = String(LTC_3BytesToInt32(buffer) * LTC2949_LSB_P1 / LTCDEF_SENSE_RESISTOR * 13.75786, LTCDEF_DIGITS_P1SLOW);
+	  packPowerP1 = LTC_3BytesToInt32(buffer) * LTC2949_LSB_P1 / LTCDEF_SENSE_RESISTOR * POT_DIV_POWER;
+	  batCurrPower[1] = String(packPowerP1, LTCDEF_DIGITS_P1SLOW);
   }
 	str += ',';//PrintComma();
 
 	// read voltage BAT
 	if (slowChannelReady)
 	{
-		error |= LTC2949_READ(LTC2949_VAL_BAT, 2, buffer);
+		error |= HAL_READ(LTC2949_VAL_BAT, 2, buffer);
     str += " BATV ";
 		str += String(LTC_2BytesToInt16(buffer) * LTC2949_LSB_BAT * POT_DIV_BPM, LTCDEF_DIGITS_BATSLOW); //Serial.print(LTC_2BytesToInt16(buffer) * LTC2949_LSB_BAT, LTCDEF_DIGITS_BATSLOW);
 	  batVoltage_num = LTC_2BytesToInt16(buffer) * LTC2949_LSB_BAT * POT_DIV_BPM, LTCDEF_DIGITS_BATSLOW;
@@ -905,7 +1967,7 @@ if(loopcount){
 	// read temperature via SLOT1
 	if (slowChannelReady)
 	{
-		error |= LTC2949_READ(LTC2949_VAL_SLOT1, 2, buffer);
+		error |= HAL_READ(LTC2949_VAL_SLOT1, 2, buffer);
 		str += String(LTC_2BytesToInt16(buffer) * LTC2949_LSB_TEMP, LTCDEF_DIGITS_TEMPSLOW); //Serial.print(LTC_2BytesToInt16(buffer) * LTC2949_LSB_TEMP, LTCDEF_DIGITS_TEMPSLOW);
 	}
 	str += ',';//PrintComma();
@@ -913,16 +1975,17 @@ if(loopcount){
 	// read internal temperature
 	if (slowChannelReady)
 	{
-		error |= LTC2949_READ(LTC2949_VAL_TEMP, 2, buffer);
+		error |= HAL_READ(LTC2949_VAL_TEMP, 2, buffer);
 		str += String(LTC_2BytesToInt16(buffer) * LTC2949_LSB_TEMP, LTCDEF_DIGITS_TEMPSLOW); //Serial.print(LTC_2BytesToInt16(buffer) * LTC2949_LSB_TEMP, LTCDEF_DIGITS_TEMPSLOW);
 	}
 	str += ',';//PrintComma();
-}
-#endif
 
-#ifdef LTCDEF_TIMING_DEBUG
-	str += String(micros() - timerus);
-	str += ',';
+	// read charge and energy accumulators
+	if (slowChannelReady)
+	{
+		error |= readAccumulators();
+	}
+}
 #endif
 
 	////////////////////////////////////////////////////////////////////
@@ -930,9 +1993,15 @@ if(loopcount){
 	////////////////////////////////////////////////////////////////////
 	// clear old cell voltage conversion results
   
+  #ifdef balancing
+  // measurement window: the forward chain clears the DCC bits in CellMonitorCFGA/CFGB below
+  if ( !loopcount )
+    error |= balanceWriteDcc(false);
+  #endif
+
   if(loopcount){
-	error |= LTC2949_68XX_ClrCells();
-  error |= LTC2949_68XX_ClrAux();
+	error |= HAL_ClrCells();
+  error |= HAL_ClrAux();
 
 	error |= CellMonitorCFGA((byte*)cellMonDat, false);
   error |= CellMonitorCFGB((byte*)cellMonDat, false , false);
@@ -941,7 +2010,7 @@ if(loopcount){
 	{
 		str = "";
 		// not yet initialized or communication error or.... (e.g. ON TOP OF instead of PARALLEL TO DAISYCHAIN)
-		PrintOkErr(error);
+		serialTxOkErr(error);
 		delay(100); // we wait 0.1 second, just avoid too many trials in case of error.
 
 		if (retries--)
@@ -972,6 +2041,8 @@ if(loopcount){
 			}
 			retries = LTCDEF_ERR_RETRIES;
 		}
+		deadlineStageEnd(STAGE_INIT);
+		deadlineLoopEnd();   // the loop is alive, BMS_FLT_3V3 stays low until the chain answers again
 		return;
 	}
   }
@@ -984,19 +2055,41 @@ if(loopcount){
   pull_3V3_high();
   switchErrorLed();
   clearFlags();
+  cycleCount++;
+  deadlineStageEnd(STAGE_INIT);
   cellVoltageLoop(timeBuffer);
+  #ifdef faultInjection
+  applyFaultInjection(voltage);
+  #endif
   #ifndef GUI_Enabled
-  Serial.println();
+  SerialTx.println();
   #endif
-  
+  serialTxDrain();
+  #ifdef ecuBroadcast
+  canTxService();
+  #endif
+  cellResistanceUpdate();   // before the EKF, so a load step frame is predicted with the updated R0
+  #ifdef startSOC
+  socEkfUpdate(meanCellVoltage(), cellFrameCurrent);
+  cellSocUpdate();
+  #endif
+  voltTrendUpdate();
+  deadlineStageEnd(STAGE_VOLT);
  
   cellTempLoop(timeBuffer);
+  #ifdef faultInjection
+  applyFaultInjection(temp);
+  #endif
+  tempTrendUpdate();
+  serviceConsole();
+  serialTxDrain();
+  deadlineStageEnd(STAGE_TEMP);
 
   
 
-  findMax(cellVoltages, voltage);
-  findMax(cellTemperatures, temp);
-  findMin(cellVoltages);
+  findMax(voltage);
+  findMax(temp);
+  findMin();
    #ifndef GUI_Enabled
    printMaxMinParameters();
    #endif
@@ -1005,16 +2098,20 @@ if(loopcount){
   performDynamicCooling();
   #endif
 
-  checkError();
-  #ifndef GUI_Enabled
-  triggerError();
-  #endif
-  #ifdef GUI_Enabled
-  triggerError_GUI();
+  {
+    PROFILE_SCOPE(PROFILE_FAULT);
+    checkError();
+    faultDebounceUpdate();
+  }
+  sopUpdate();
+  #ifdef balancing
+  balanceService();
   #endif
+  deadlineStageEnd(STAGE_EVAL);
 
   
   batLoop(slowChannelReady);
+  deadlineStageEnd(STAGE_LOG);
 
   // #ifdef GUI_Enabled
   // Serial.print(CellData);
@@ -1023,19 +2120,15 @@ if(loopcount){
 
   
 
-  #ifdef charger_active
-  sendAlldatatoecu();
+  #ifdef ecuBroadcast
+  canTxService();
   #endif
 
 
   #ifdef charger_active
-  if (!(voltFlag || tempFlag))
-  {
-
-  chargerLoop();
-  triggerchargerError();
-  }
+  chargerService();
   #endif
+  deadlineStageEnd(STAGE_CAN);
 
 
   #ifndef GUI_Enabled
@@ -1045,6 +2138,7 @@ if(loopcount){
   #ifdef GUI_Enabled
   triggerInterrupt_GUI();
   #endif
+  faultJournalPersist();   // after BMS_FLT_3V3, EEPROM / SD writes block
 
 
   // #ifdef GUI_Enabled
@@ -1056,12 +2150,6 @@ if(loopcount){
 
   
 
-#ifdef LTCDEF_TIMING_DEBUG
-	str += String(micros() - timerus);
-	str += ',';
-#endif
-
-
 #ifndef LTCDEF_LTC681X_ONLY
 if(loopcount){
 	// print fast I2
@@ -1071,7 +2159,7 @@ if(loopcount){
 	str += String(fastData2949[LTC2949_RDFASTDATA_BAT] * LTC2949_LSB_FIFOBAT, LTCDEF_DIGITS_BATFAST); //Serial.print(fastData2949[LTC2949_RDFASTDATA_BAT] * LTC2949_LSB_FIFOBAT, LTCDEF_DIGITS_BATFAST);
 	// clear the EOC by reading again if necessary:
 	if (!LTC2949_FASTSSHT_HS_CLR(fastData2949))
-		error |= LTC2949_RdFastData(fastData2949);
+		error |= HAL_RdFastData(fastData2949);
 	if (!LTC2949_FASTSSHT_HS_CLR(fastData2949)) // for sure HS bytes must be cleared now
 		error |= LTC2949_ERRCODE_OTHER;
 	str += ',';//PrintComma();
@@ -1091,21 +2179,21 @@ if(loopcount){
 
   #ifdef GUI_Enabled
   
-  Serial.println();
+  SerialTx.println();
   
   float tf = millis() - ti;
   
   CellData_GUI = "";
   CellData_GUI += String(tf,2);
   CellData_GUI += ",";
-  Serial.print(CellData_GUI);
+  SerialTx.print(CellData_GUI);
   
 
   
 
   CellData_GUI = "";
   
-  Serial.println();
+  SerialTx.println();
   
   #endif
 
@@ -1114,37 +2202,49 @@ if(loopcount){
   if (SOC_init_flag==false)
   {
     EnergyAvailable = InitialiseEnergy(minVoltage.val, underVoltageThreshold);
-    Serial.print("Energy Available :");
-    Serial.print(EnergyAvailable);
-    Serial.print("Kwh");
+    SerialTx.print("Energy Available :");
+    SerialTx.print(EnergyAvailable);
+    SerialTx.print("Kwh");
     SOC_init_flag=true;
   }
   else
   {
-
-    EnergyAvailable = CalculateEnergy(batVoltage_num, batCurrPower_num[0], EnergyAvailable, tf, chgrDelay);
-    Serial.print("Energy Available in Kwh:");
-    Serial.print(EnergyAvailable);
-    Serial.print("Kwh");
+    // EnergyAvailable is updated from the LTC2949 energy accumulator, see readAccumulators()
+    SerialTx.print("Energy Available in Kwh:");
+    SerialTx.print(EnergyAvailable);
+    SerialTx.print("Kwh");
   }
 
-  Serial.println();
-  Serial.print("SoC: ");
-  Serial.print(EnergyAvailable*1000*1000*100/(4200*5.5*3.7*90));
-  Serial.print("%");
+  SerialTx.println();
+  SerialTx.print("SoC: ");
+  SerialTx.print(EnergyAvailable*1000*1000*100/(4200*5.5*3.7*LTCDEF_PACK_CELLS));
+  SerialTx.print("%");
+  SerialTx.print("  EKF SoC: ");
+  SerialTx.print(socEkf.soc * 100, 2);
+  SerialTx.print("%");
+  SerialTx.print("  Weakest cell: ");
+  SerialTx.print(weakestCell.val * 100, 2);
+  SerialTx.print("% (");
+  SerialTx.print(weakestCellAh, 2);
+  SerialTx.print("Ah) at Slave ");
+  SerialTx.print(weakestCell.slaveLoc);
+  SerialTx.print(" Cell ");
+  SerialTx.print(weakestCell.cellLoc);
   #endif
   
   #ifndef GUI_Enabled
-  Serial.println();
+  SerialTx.println();
   tf = millis() - ti;
-  Serial.print("LOOP TIME : ");
-  Serial.print(tf);
-  Serial.println("ms");
+  SerialTx.print("LOOP TIME : ");
+  SerialTx.print(tf);
+  SerialTx.println("ms");
+  printSerialTxStats();
   #endif
+  serviceConsole();
+  serialTxDrain();
 
-  #ifdef charger_active
-  delay(chgrDelay);
-  #endif
+  deadlineStageEnd(STAGE_OUTPUT);
+  deadlineLoopEnd();
 
   #ifdef circular
   loopcount=!loopcount ;
@@ -1154,33 +2254,27 @@ if(loopcount){
 void cellVoltageLoop (unsigned long timeBuffer)
 {
   	byte  error = 0;
-    error |= LTC2949_ADxx(
+    voltConvUs = micros();
+  {
+    PROFILE_SCOPE(PROFILE_ADCV);
+    error |= HAL_ADxx(
 		/*byte md = MD_NORMAL     : */MD_FAST,
 		/*byte ch = CELL_CH_ALL   : */CELL_CH_ALL,
 		/*byte dcp = DCP_DISABLED : */DCP_DISABLED,
 		/*uint8_t pollTimeout = 0 : */LTCDEF_POLL_EOC ? LTC2949_68XX_GETADCVTIMEOUT16US(LTC2949_68XX_T6C_27KHZ_US) : 0
 	);
-
-
-#ifdef LTCDEF_TIMING_DEBUG
-	str += String(micros() - timerus);
-	str += ',';
-#endif
+  }
 
 
 	cellMonDat[0] = 0xFFFFU; // will be used later
+  PROFILE_START(rdcvaCyc);
 
 #ifdef LTCDEF_LTC681X_ONLY
 	timeBuffer = micros() + LTC2949_68XX_T6C_27KHZ_US;
 	// for sure we poll for HS of LTC2949's rdcv later, so we do not have to wait here!
 	while (!LTC_TIMEOUT_CHECK(micros(), timeBuffer))
 		; // wait for all cell voltage measurements to be completed.
-	error |= LTC2949_68XX_RdCells(LTC2949_68XX_CMD_RDCVA, cellMonDat);
-
-#ifdef LTCDEF_TIMING_DEBUG
-	str += String(micros() - timerus);
-	str += ',';
-#endif
+	error |= HAL_RdCells(LTC2949_68XX_CMD_RDCVA, cellMonDat);
 
 #else
 if(loopcount){
@@ -1193,7 +2287,7 @@ if(loopcount){
 	// }
 	fastData2949[LTC2949_RDFASTDATA_HS] = 0; // clear the HS bytes
 	// poll LTC2949 for conversion done
-	error |= LTC2949_RdFastData(
+	error |= HAL_RdFastData(
 		fastData2949,
 		cellMonDat,
 		LTC2949_68XX_CMD_RDCVA,
@@ -1216,7 +2310,7 @@ if(loopcount){
 		// we have to read data from LTC2949 again, as only the next RDCVx will report the final conversion results
 		// also cell voltages have to be read again, as also those most probably were not updated
 		// note: here we must not poll HS! (it must be zero now!)
-		error |= LTC2949_RdFastData(
+		error |= HAL_RdFastData(
 			fastData2949,
 			cellMonDat,
 			LTC2949_68XX_CMD_RDCVA);
@@ -1230,7 +2324,16 @@ if(loopcount){
 		// Unexpected HS bytes, something went wrong
 		error |= LTC2949_ERRCODE_OTHER;
 	}
+  // current measured synchronously with this cell voltage frame
+  cellFrameCurrent = fastData2949[LTC2949_RDFASTDATA_I2] * LTC2949_LSB_FIFOI2 / LTCDEF_SENSE_RESISTOR;
+  cellFrameCurrentSync = !err_detected(error);
 } 
+else
+{
+  // backward daisy chain: no fast single shot, use the latest slow channel current
+  cellFrameCurrent = batCurrPower_num[0];
+  cellFrameCurrentSync = false;
+}
 #endif
 
 	char errorExt = error > 1 ? 'X' : '_';
@@ -1240,8 +2343,9 @@ if(loopcount){
 
 		// we have to read cell voltages group A (again)
 		// for sure we have to read in case LTC2949 is not on top of daisychain!
-		error |= LTC2949_68XX_RdCells(LTC2949_68XX_CMD_RDCVA, cellMonDat);
+		error |= HAL_RdCells(LTC2949_68XX_CMD_RDCVA, cellMonDat);
 	}
+  PROFILE_STOP(PROFILE_RDCVA, rdcvaCyc);
 
 		String cvs[LTCDEF_CELL_MONITOR_COUNT];
 
@@ -1250,35 +2354,39 @@ if(loopcount){
 
 		for (uint8_t rdcvi = 0; ; rdcvi++)
 		{
+      {
+        PROFILE_SCOPE(PROFILE_TRANSFER);
 			for (uint8_t i = 0; i < LTCDEF_CELL_MONITOR_COUNT; i++)
 			{
         cvs[i] += CellVoltagesToString(cellMonDat, i);
         transferV(cellMonDat,i,rdcvi);
+      }
       }
 
 			if ((rdcvi > 4) || (rdcvi >= (LTCDEF_CELLS_PER_CELL_MONITOR_COUNT / 3 - 1)))
 				break;
 
+      PROFILE_SCOPE(PROFILE_RDCVB + rdcvi);   // up to the end of this pass, i.e. the read below
 			switch (rdcvi)
 			{
 			case 0:
-				error |= LTC2949_68XX_RdCells(LTC2949_68XX_CMD_RDCVB, cellMonDat);
+				error |= HAL_RdCells(LTC2949_68XX_CMD_RDCVB, cellMonDat);
 				if (error > 1 && errorExt == '_') errorExt = 'b';
 				break;
 			case 1:
-				error |= LTC2949_68XX_RdCells(LTC2949_68XX_CMD_RDCVC, cellMonDat);
+				error |= HAL_RdCells(LTC2949_68XX_CMD_RDCVC, cellMonDat);
 				if (error > 1 && errorExt == '_') errorExt = 'c';
 				break;
 			case 2:
-				error |= LTC2949_68XX_RdCells(LTC2949_68XX_CMD_RDCVD, cellMonDat);
+				error |= HAL_RdCells(LTC2949_68XX_CMD_RDCVD, cellMonDat);
 				if (error > 1 && errorExt == '_') errorExt = 'd';
 				break;
 			case 3:
-				error |= LTC2949_68XX_RdCells(LTC2949_68XX_CMD_RDCVE, cellMonDat);
+				error |= HAL_RdCells(LTC2949_68XX_CMD_RDCVE, cellMonDat);
 				if (error > 1 && errorExt == '_') errorExt = 'e';
 				break;
 			case 4:
-				error |= LTC2949_68XX_RdCells(LTC2949_68XX_CMD_RDCVF, cellMonDat);
+				error |= HAL_RdCells(LTC2949_68XX_CMD_RDCVF, cellMonDat);
 				if (error > 1 && errorExt == '_') errorExt = 'f';
 				break;
 			
@@ -1291,10 +2399,16 @@ if(loopcount){
 		// str += errorExt; //Serial.print(errorExt);
 		// str += ',';//PrintComma();
 	  }
-  circularVoltdef();
-  cellsVoltSort();
-  checkVoltNormalize();
-  checkVoltSplit();
+  {
+    PROFILE_SCOPE(PROFILE_SORT);
+    circularVoltdef();
+    cellsVoltSort();
+    checkVoltNormalize();
+    checkVoltSplit();
+  }
+  voltReadUs = micros();
+  if ( voltReadUs - voltConvUs > voltAcqMaxUs )
+    voltAcqMaxUs = voltReadUs - voltConvUs;
   cellsLogging();
   #ifndef GUI_Enabled
   printCells();
@@ -1306,12 +2420,14 @@ if(loopcount){
 
 void cellTempLoop(unsigned long timeBuffer)
 {
+  tempConvUs = micros();
   for ( int muxSelect = 1; muxSelect >= 0; muxSelect--)
   {
+     PROFILE_SCOPE(muxSelect ? PROFILE_ADAX_MUX1 : PROFILE_ADAX_MUX0);
      byte  error = 0;
      error |= CellMonitorCFGB((byte*)cellMonDat, false , muxSelect); 	
         
-        error |= LTC2949_ADAX(
+        error |= HAL_ADAX(
 		/*byte md = MD_NORMAL     : */MD_FAST,
 		/*byte ch = CELL_CH_ALL   : */CELL_CH_ALL,
 		/*byte dcp = DCP_DISABLED : */DCP_DISABLED,
@@ -1319,12 +2435,6 @@ void cellTempLoop(unsigned long timeBuffer)
 	);
 
 
-#ifdef LTCDEF_TIMING_DEBUG
-	str += String(micros() - timerus);
-	str += ',';
-#endif
-
-
 	cellMonDat[0] = 0xFFFFU; // will be used later
 
 #ifdef LTCDEF_LTC681X_ONLY
@@ -1332,12 +2442,7 @@ void cellTempLoop(unsigned long timeBuffer)
 	// for sure we poll for HS of LTC2949's rdcv later, so we do not have to wait here!
 	while (!LTC_TIMEOUT_CHECK(micros(), timeBuffer))
 		; // wait for all cell voltage measurements to be completed.
-	error |= LTC2949_68XX_RdAux(LTC2949_68XX_CMD_RDAUXA, cellMonDat);
-
-#ifdef LTCDEF_TIMING_DEBUG
-	str += String(micros() - timerus);
-	str += ',';
-#endif
+	error |= HAL_RdAux(LTC2949_68XX_CMD_RDAUXA, cellMonDat);
 
 #else
 if(loopcount){
@@ -1350,7 +2455,7 @@ if(loopcount){
 	}
 	fastData2949[LTC2949_RDFASTDATA_HS] = 0; // clear the HS bytes
 	// poll LTC2949 for conversion done
-	error |= LTC2949_RdFastData(
+	error |= HAL_RdFastData(
 		fastData2949,
 		cellMonDat,
 		// LTC2949_68XX_CMD_RDCVA,
@@ -1373,7 +2478,7 @@ if(loopcount){
 		// we have to read data from LTC2949 again, as only the next RDCVx will report the final conversion results
 		// also cell voltages have to be read again, as also those most probably were not updated
 		// note: here we must not poll HS! (it must be zero now!)
-		error |= LTC2949_RdFastData(
+		error |= HAL_RdFastData(
 			fastData2949,
 			cellMonDat,
 			// LTC2949_68XX_CMD_RDCVA);
@@ -1397,7 +2502,7 @@ if(loopcount){
 
 		// we have to read cell voltages group A (again)
 		// for sure we have to read in case LTC2949 is not on top of daisychain!
-		error |= LTC2949_68XX_RdAux(LTC2949_68XX_CMD_RDAUXA, cellMonDat);
+		error |= HAL_RdAux(LTC2949_68XX_CMD_RDAUXA, cellMonDat);
 	}
 	
 		String cvs[LTCDEF_CELL_MONITOR_COUNT];
@@ -1407,10 +2512,13 @@ if(loopcount){
 
 		for (uint8_t rdcvi = 0; rdcvi < 3; rdcvi++)
 		{
+      {
+        PROFILE_SCOPE(PROFILE_TRANSFER);
 			for (uint8_t i = 0; i < LTCDEF_CELL_MONITOR_COUNT; i++)
       {
 				cvs[i] += CellVoltagesToString(cellMonDat, i);
         transferT(cellMonDat,i,muxSelect,rdcvi);
+      }
       }
 			// if ((rdcvi > 4) || (rdcvi >= (LTCDEF_CELLS_PER_CELL_MONITOR_COUNT / 3 - 1)))
 			// 	break;
@@ -1418,15 +2526,15 @@ if(loopcount){
 			switch (rdcvi)
 			{
 			case 0:
-				error |= LTC2949_68XX_RdAux(LTC2949_68XX_CMD_RDAUXB, cellMonDat);
+				error |= HAL_RdAux(LTC2949_68XX_CMD_RDAUXB, cellMonDat);
 				if (error > 1 && errorExt == '_') errorExt = 'b';
 				break;
 			case 1:
-				error |= LTC2949_68XX_RdAux(LTC2949_68XX_CMD_RDAUXC, cellMonDat);
+				error |= HAL_RdAux(LTC2949_68XX_CMD_RDAUXC, cellMonDat);
 				if (error > 1 && errorExt == '_') errorExt = 'c';
 				break;
 			case 2:
-				error |= LTC2949_68XX_RdAux(LTC2949_68XX_CMD_RDAUXD, cellMonDat);
+				error |= HAL_RdAux(LTC2949_68XX_CMD_RDAUXD, cellMonDat);
 				if (error > 1 && errorExt == '_') errorExt = 'd';
 				break;
 			}
@@ -1439,12 +2547,18 @@ if(loopcount){
 		// str += errorExt; //Serial.print(errorExt);
 		// str += ',';//PrintComma();
 
+  {
+    PROFILE_SCOPE(PROFILE_SORT);
 	circularTempdef(muxSelect);
   tempConvertSort(muxSelect);
+  }
 
   }
   
   checkTempNormalize();
+  tempReadUs = micros();
+  if ( tempReadUs - tempConvUs > tempAcqMaxUs )
+    tempAcqMaxUs = tempReadUs - tempConvUs;
   #ifndef GUI_Enabled
   printAux();
   #endif
@@ -1459,16 +2573,16 @@ void batLoop(bool slowChannelReady )
   if (slowChannelReady)
   {
   #ifndef GUI_Enabled
-  Serial.println();
-  Serial.print("BATTERY VOLTAGE : ");
-  Serial.print( batVoltage );
-  Serial.println();
-  Serial.print("TS CURRENT : ");
-  Serial.print( batCurrPower[0] );
-  Serial.println();
-  Serial.print("TS POWER : ");
-  Serial.print( batCurrPower[1] );
-  Serial.println();
+  SerialTx.println();
+  SerialTx.print("BATTERY VOLTAGE : ");
+  SerialTx.print( batVoltage );
+  SerialTx.println();
+  SerialTx.print("TS CURRENT : ");
+  SerialTx.print( batCurrPower[0] );
+  SerialTx.println();
+  SerialTx.print("TS POWER : ");
+  SerialTx.print( batCurrPower[1] );
+  SerialTx.println();
   #endif
 
   CellData += batVoltage;
@@ -1477,6 +2591,33 @@ void batLoop(bool slowChannelReady )
   CellData += ",";
   CellData += batCurrPower[1];
   CellData += ",";
+  #ifdef startSOC
+  CellData += String(socEkf.soc * 100, 3);
+  CellData += ",";
+  CellData += String(socEkf.innovation * 1000, 2);   // mV
+  CellData += ",";
+  CellData += String(weakestCell.val * 100, 3);
+  CellData += ",";
+  #endif
+  // resistance of every cell in uOhm
+  for ( uint8_t c_ic = 0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+  {
+    for ( uint8_t i = 0; i < cellsPerStack[c_ic]; i++ )
+    {
+      CellData += (uint32_t)(cellRes[c_ic][i].r * 1.0e6f);
+      CellData += ",";
+    }
+  }
+  // balancing cells of every slave, bit i = cell i + 1
+  for ( uint8_t c_ic = 0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+  {
+    CellData += String(balanceMask[c_ic], HEX);
+    CellData += ",";
+  }
+  #ifdef dynamicCooling
+  CellData += String(fanDuty * 100, 0);
+  CellData += ",";
+  #endif
   
   #ifdef GUI_Enabled
   CellData_GUI += batVoltage;
@@ -1486,7 +2627,7 @@ void batLoop(bool slowChannelReady )
   CellData_GUI += batCurrPower[1];
   CellData_GUI += ",";
 
-  Serial.println(CellData_GUI);
+  SerialTx.println(CellData_GUI);
   CellData_GUI="";
   #endif
 
@@ -1498,223 +2639,470 @@ void batLoop(bool slowChannelReady )
   #endif
 }
 
-void sendDataToECU(float voltage, float temperature) {
-    CAN_message_t msg;
-
-    // Use unions to convert float to byte arrays
-    union {
-        float f;
-        uint8_t bytes[4];
-    } voltageData, tempData;
+// Frames are handed to the FlexCAN_T4 mailboxes / TX queue of Can2 without ever waiting:
+// if mailboxes and queue are full the stream simply continues at the next service.
+// The bandwidth credit (in bits) limits the BMS to ECU_CAN_BUSLOAD_PERCENT of the bus,
+// the period limits how often every frame of a stream is repeated.
+void canTxService(void)
+{
+  PROFILE_SCOPE(PROFILE_CAN);
+  uint32_t now = micros();
+  uint32_t elapsed = now - canTxLastService;
+  canTxLastService = now;
 
-    voltageData.f = voltage;
-    tempData.f = temperature;
+  canTxCredit += (float)elapsed * (ECU_CAN_BAUDRATE * ECU_CAN_BUSLOAD_PERCENT / 100) / 1.0e6;
+  if ( canTxCredit > canTxCreditMax )
+    canTxCredit = canTxCreditMax;
 
-    // Prepare CAN message (8 bytes: 4 for voltage, 4 for temperature)
-    msg.id = 0x100;  // Example message ID (change as needed)
-    msg.len = 8;     // Data length is 8 bytes
+  Can2.events();
+  faultJournalCanService();
 
-    // Pack the voltage and temperature into the CAN message
-    for (int i = 0; i < 4; i++) {
-        msg.buf[i] = voltageData.bytes[i];
-        msg.buf[i + 4] = tempData.bytes[i];
+  for ( uint8_t s = 0; s < sizeof(canTxStreams) / sizeof(canTxStreams[0]); s++ )
+  {
+    struct canTxStream &stream = canTxStreams[s];
+    if ( stream.cursor >= stream.frameCount )
+    {
+      if ( (millis() - stream.passStart) < stream.periodMs )
+        continue;                                   // this pass is done, wait for the next period
+      stream.cursor = 0;
+      stream.passStart = millis();
+      if ( stream.plan != NULL )
+        stream.plan();
     }
 
-    // Send the CAN message
-    Can2.write(msg);
-}
-
+    while ( stream.cursor < stream.frameCount )
+    {
+      if ( canTxCredit < ECU_CAN_FRAME_BITS )
+        return;                                     // bus load budget used up
 
-void sendAllDataToECU() {
-    for (int i = 0; i < 15; i++) {
-        sendDataToECU(voltageDataArray[i], temperatureDataArray[i]);  // Send each pair
-        delay(10);  // Small delay between messages to avoid bus overload
+      CAN_message_t msg;
+      if ( stream.build(stream.cursor, msg) )
+      {
+        if ( Can2.write(msg) != 1 )
+        {
+          canTxFullCount++;
+          return;                                   // mailboxes and TX queue are full, retry this frame next time
+        }
+        canTxCredit -= ECU_CAN_FRAME_BITS;
+        canTxFrameCount++;
+      }
+      stream.cursor++;
     }
+  }
+}
 
+// urgent frames keep their natural order, the others start at "rotation" so no frame is always last
+uint16_t orderFrames(uint8_t * order, uint16_t frameCount, const bool * urgent, uint16_t rotation)
+{
+  uint16_t n = 0;
+  for ( uint16_t f = 0; f < frameCount; f++ )
+  {
+    if ( urgent[f] )
+      order[n++] = f;
+  }
+  uint16_t urgentCount = n;
+  for ( uint16_t k = 0; k < frameCount; k++ )
+  {
+    uint16_t f = (k + rotation) % frameCount;
+    if ( !urgent[f] )
+      order[n++] = f;
+  }
+  return urgentCount;
+}
 
-void chargerLoop(void)
+void planVoltFrames(void)
 {
-     send_msg.flags.extended = 1;
-     receive_msg.flags.extended = 1;
-     send_msg.id=send_id;
-    if(chargerFlag == false)
+  bool urgent[ECU_VOLT_FRAMES];
+  for ( uint8_t c_ic = 0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+  {
+    for ( uint8_t group = 0; group < ECU_VOLT_FRAMES_PER_SLAVE; group++ )
     {
-    send_msg.buf[0]= (max_voltage)>>8;
-    send_msg.buf[1]= (max_voltage)%256;
-    send_msg.buf[2]= (max_current_without_decimal)>>8;
-    send_msg.buf[3]= (max_current_without_decimal)%256;
-    send_msg.buf[4]= 0;
-    Serial.println("Set control bit to 0: Charger OK");
-    }
-    else{
-    send_msg.buf[0]= (max_voltage)>>8;
-    send_msg.buf[1]= (max_voltage)%256;
-    send_msg.buf[2]= (max_current_without_decimal)>>8;
-    send_msg.buf[3]= (max_current_without_decimal)%256;
-    send_msg.buf[4]= 1;
-    Serial.println("Set control bit to 1: Do not charge");
+      bool u = false;
+      for ( uint8_t i = group * 4; (i < group * 4 + 4) && (i < cellsPerStack[c_ic]); i++ )
+      {
+        if ( (cellVoltages[c_ic][i] > overVoltageThreshold) || (cellVoltages[c_ic][i] < underVoltageThreshold) )
+          u = true;
+        if ( (maxVoltage.slaveLoc == c_ic + 1) && (maxVoltage.cellLoc == i + 1) )
+          u = true;
+        if ( (minVoltage.slaveLoc == c_ic + 1) && (minVoltage.cellLoc == i + 1) )
+          u = true;
+      }
+      urgent[c_ic * ECU_VOLT_FRAMES_PER_SLAVE + group] = u;
     }
+  }
+  orderFrames(voltFrameOrder, ECU_VOLT_FRAMES, urgent, voltFrameRotation);
+  voltFrameRotation = (voltFrameRotation + 1) % ECU_VOLT_FRAMES;
+}
 
-    output_voltage = (receive_msg.buf[0]*256 + receive_msg.buf[1] + 1.5)/10;
-    output_current = (receive_msg.buf[2]*256 + receive_msg.buf[3])/10;
-    //need to add the fifth control byte also
-    //Serial.println(send_msg.buf[2]);
-    //Serial.println(send_msg.buf[3]);
-  #ifndef GUI_Enabled
-  Serial.println("Entered Charger loop");
-  #endif
-  // #ifdef charger_softEnabled
+void planTempFrames(void)
+{
+  bool urgent[ECU_TEMP_FRAMES];
+  for ( uint8_t c_ic = 0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+  {
+    for ( uint8_t group = 0; group < ECU_TEMP_FRAMES_PER_SLAVE; group++ )
+    {
+      bool u = false;
+      for ( uint8_t i = group * 8; (i < group * 8 + 8) && (i < tempsPerStack[c_ic]); i++ )
+      {
+        if ( (cellTemperatures[c_ic][i] > overTempThreshold) || (cellTemperatures[c_ic][i] <= 0.0) )
+          u = true;
+        if ( (maxTemp.slaveLoc == c_ic + 1) && (maxTemp.cellLoc == i + 1) )
+          u = true;
+      }
+      urgent[c_ic * ECU_TEMP_FRAMES_PER_SLAVE + group] = u;
+    }
+  }
+  orderFrames(tempFrameOrder, ECU_TEMP_FRAMES, urgent, tempFrameRotation);
+  tempFrameRotation = (tempFrameRotation + 1) % ECU_TEMP_FRAMES;
+}
 
-  //  if ((max_voltage<100))
-  //  {
-  //if ((can3.write(send_msg)!=1))
+bool buildVoltFrame(uint16_t cursor, CAN_message_t &msg)
+{
+  uint8_t frame = voltFrameOrder[cursor];
+  uint8_t c_ic = frame / ECU_VOLT_FRAMES_PER_SLAVE;
+  uint8_t group = frame % ECU_VOLT_FRAMES_PER_SLAVE;
 
-  //{
-  // double ti = millis(),delT = 0.0;
-  // char input='0';
-  // #ifndef GUI_Enabled
-  // while( delT < chargeTimer )
-  // {
-    
-  //   delT = millis() - ti ;
-  //   if (input=='c')
-  //   { 
-  //     send_msg.flags.extended = 1;
-  //    receive_msg.flags.extended = 1;
-  //    send_msg.id=send_id;
- 
-  //     max_voltage=3950;
-  //     max_current_without_decimal=100;
-  //     send_msg.buf[0]= (max_voltage)>>8;
-  //   send_msg.buf[1]= (max_voltage)%256;
-  //   send_msg.buf[2]= (max_current_without_decimal)>>8;
-  //   send_msg.buf[3]= (max_current_without_decimal)%256;
-
-  //     Serial.println("Charger Enable Received");
-  //     can3.write(send_msg);
-  //     Serial.println(can3.write(send_msg));
-  //     break;
-
-  //   }
-  //   else
-  //   { max_voltage=0;
-  //     max_current_without_decimal=0;
-  //     send_msg.buf[0]= (max_voltage)>>8;
-  //   send_msg.buf[1]= (max_voltage)%256;
-  //   send_msg.buf[2]= (max_current_without_decimal)>>8;
-  //   send_msg.buf[3]= (max_current_without_decimal)%256;
-  //     Serial.println("BMS OK....Waiting for charger Enable");
-  //     can3.write(send_msg);
-  //     Serial.println(can3.write(send_msg));
-  //   }
-  //   if (Serial.available() > 0)
-  //   {
-  //     input = read_char();
-  //   } 
-  //   delay(100); 
-  // }
-  // #endif
-  // #ifdef GUI_Enabled
-  // while( delT < chargeTimer )
-  // {
-    
-  //   delT = millis() - ti ;
-  //   if (input=='c')
-  //   {
-  //     send_msg.flags.extended = 1;
-  //    receive_msg.flags.extended = 1;
-  //    send_msg.id=send_id;
- 
-  //     max_voltage=3950;
-  //     max_current_without_decimal=100;
-  //     send_msg.buf[0]= (max_voltage)>>8;
-  //   send_msg.buf[1]= (max_voltage)%256;
-  //   send_msg.buf[2]= (max_current_without_decimal)>>8;
-  //   send_msg.buf[3]= (max_current_without_decimal)%256;
+  msg.id = ECU_VOLT_BASE_ID + frame;
+  msg.len = 8;
+  for ( uint8_t k = 0; k < 4; k++ )
+  {
+    uint8_t i = group * 4 + k;
+    uint16_t raw = 0xFFFFU;
+    if ( i < cellsPerStack[c_ic] )
+    {
+      double v = cellVoltages[c_ic][i] / 100e-6 + 0.5;
+      raw = v <= 0 ? 0 : (v >= 0xFFFEU ? 0xFFFEU : (uint16_t)v);
+    }
+    msg.buf[2 * k] = raw & 0xFF;
+    msg.buf[2 * k + 1] = raw >> 8;
+  }
+  return true;
+}
 
-      
-  //     can3.write(send_msg);
-      
-  //     break;
+bool buildTempFrame(uint16_t cursor, CAN_message_t &msg)
+{
+  uint8_t frame = tempFrameOrder[cursor];
+  uint8_t c_ic = frame / ECU_TEMP_FRAMES_PER_SLAVE;
+  uint8_t group = frame % ECU_TEMP_FRAMES_PER_SLAVE;
 
-  //   }
-  //   else
-  //   {  max_voltage=0;
-  //     max_current_without_decimal=0;
-  //     send_msg.buf[0]= (max_voltage)>>8;
-  //   send_msg.buf[1]= (max_voltage)%256;
-  //   send_msg.buf[2]= (max_current_without_decimal)>>8;
-  //   send_msg.buf[3]= (max_current_without_decimal)%256;
-  //   can3.write(send_msg);
-
-  //     Serial.println("0,0,0,0,0,0,0,0,0,");
-      
-  //   }
-  //   if (Serial.available() > 0)
-  //   {
-  //     input = read_char();
-  //   } 
-  //   delay(100); 
-  // }
-  //     Serial.println("1,1,1,1,1,1,1,1,1,1,1,");
-  //     Serial.println("1,1,1,1,1,1,1,1,1,1,1,");
-  //     Serial.println("1,1,1,1,1,1,1,1,1,1,1,");
-  // #endif
-  
-  
-  
-  
-  // }
-  // #endif
-  //can3.write(send_msg);
-  #ifndef GUI_Enabled
-  //if(chargerFlag == false){
-    if(can3.write(send_msg) == 1){
-      Serial.println("CAN Message sent successfully");
+  msg.id = ECU_TEMP_BASE_ID + frame;
+  msg.len = 8;
+  for ( uint8_t k = 0; k < 8; k++ )
+  {
+    uint8_t i = group * 8 + k;
+    uint8_t raw = 0xFF;
+    if ( i < tempsPerStack[c_ic] )
+    {
+      double t = cellTemperatures[c_ic][i] + 40.0 + 0.5;
+      raw = t <= 0 ? 0 : (t >= 0xFE ? 0xFE : (uint8_t)t);
     }
-    else{
-      Serial.println("Failed to send CAN message");
-     //Interrupt();
+    msg.buf[k] = raw;
+  }
+  return true;
+}
+
+bool buildResFrame(uint16_t cursor, CAN_message_t &msg)
+{
+  uint8_t c_ic = cursor / ECU_VOLT_FRAMES_PER_SLAVE;
+  uint8_t group = cursor % ECU_VOLT_FRAMES_PER_SLAVE;
+
+  msg.id = ECU_RES_BASE_ID + cursor;
+  msg.len = 8;
+  for ( uint8_t k = 0; k < 4; k++ )
+  {
+    uint8_t i = group * 4 + k;
+    uint16_t raw = 0xFFFFU;
+    if ( i < cellsPerStack[c_ic] )
+    {
+      float r = cellRes[c_ic][i].r / 1.0e-6f + 0.5f;
+      raw = r <= 0 ? 0 : (r >= 0xFFFEU ? 0xFFFEU : (uint16_t)r);
     }
-  //}
-  #endif
-  #ifdef GUI_Enabled
-  
-    output_voltage = (receive_msg.buf[0]*256 + receive_msg.buf[1] + 1.5)/10;
-    output_current = (receive_msg.buf[2]*256 + receive_msg.buf[3])/10;
-    Serial.print(output_voltage);
-    Serial.print(",");
-    Serial.print(output_current);
-    Serial.println(",");
-    for (int i = 4; i >= 0; i--) {
-            int bit = (receive_msg.buf[4] >> i) & 1;
-            Serial.print(bit);
-            Serial.print(",");
-        }
+    msg.buf[2 * k] = raw & 0xFF;
+    msg.buf[2 * k + 1] = raw >> 8;
+  }
+  return true;
+}
 
-    Serial.println("");
-  #endif
+bool buildSopFrame(uint16_t cursor, CAN_message_t &msg)
+{
+  float * limit = cursor == 0 ? sop.discharge : sop.charge;
 
- 
-  //Serial.println(msg.id);
-  #ifndef GUI_Enabled
-  if(can3.read(receive_msg)){
-    //Serial.print("ID: 0x"); Serial.print(msg.id, HEX );
-    //Serial.println(receive_msg.id, HEX);
-    //Serial.print("LEN: "); Serial.println(receive_msg.len);
-    Serial.println("CAN communication with charger successful");
+  msg.id = cursor == 0 ? ECU_SOP_DISCHARGE_ID : ECU_SOP_CHARGE_ID;
+  msg.len = 8;
+  for ( uint8_t w = 0; w < SOP_WINDOWS; w++ )
+  {
+    float a = limit[w] * 10 + 0.5f;
+    uint16_t raw = a <= 0 ? 0 : (a >= 0xFFFEU ? 0xFFFEU : (uint16_t)a);
+    msg.buf[2 * w] = raw & 0xFF;
+    msg.buf[2 * w + 1] = raw >> 8;
+  }
+  msg.buf[6] = (uint8_t)(sop.derate * 100 + 0.5f);
+  msg.buf[7] = sop.fault ? 0x01 : 0x00;
+  return true;
+}
+
+bool buildTempWarnFrame(uint16_t cursor, CAN_message_t &msg)
+{
+  msg.id = ECU_TEMP_WARN_ID;
+  msg.len = 8;
+  float r = maxTempRate.val * 100;
+  int16_t rate = r > 32767 ? 32767 : (r < -32768 ? -32768 : (int16_t)r);
+  float o = maxTempOutlier.val * 4 + 0.5f;
+  msg.buf[0] = tempTrendWarn | voltTrendWarn;
+  msg.buf[1] = maxTempRate.slaveLoc;
+  msg.buf[2] = maxTempRate.cellLoc;
+  msg.buf[3] = rate & 0xFF;
+  msg.buf[4] = (rate >> 8) & 0xFF;
+  msg.buf[5] = maxTempOutlier.slaveLoc;
+  msg.buf[6] = maxTempOutlier.cellLoc;
+  msg.buf[7] = o <= 0 ? 0 : (o >= 255 ? 255 : (uint8_t)o);
+  return true;
+}
+
+bool buildLatencyFrame(uint16_t cursor, CAN_message_t &msg)
+{
+  const struct latencyStats &st = latency[cursor];
+  uint32_t val[4] = { 0xFFFFU, 0xFFFFU, 0xFFFFU, 0xFFFFU };
+  if ( st.count )
+  {
+    val[0] = st.minUs / 1000;
+    val[1] = (uint32_t)(st.sumUs / st.count) / 1000;
+    val[2] = latencyP99Us(st) / 1000;
+    val[3] = st.maxUs / 1000;
+  }
+
+  msg.id = ECU_LATENCY_BASE_ID + cursor;
+  msg.len = 8;
+  for ( uint8_t k = 0; k < 4; k++ )
+  {
+    uint16_t raw = val[k] > 0xFFFEU ? 0xFFFEU : val[k];
+    if ( !st.count ) raw = 0xFFFFU;
+    msg.buf[2 * k] = raw & 0xFF;
+    msg.buf[2 * k + 1] = raw >> 8;
+  }
+  return true;
+}
+
+bool buildBalanceFrame(uint16_t cursor, CAN_message_t &msg)
+{
+  float t = balanceThreshold / 100e-6f + 0.5f;
+  uint16_t raw = (balanceStatus & BALANCE_ST_HOLD) || (t <= 0) ? 0xFFFFU : (t >= 0xFFFEU ? 0xFFFEU : (uint16_t)t);
+  const struct balanceSlave &sl = balanceSlaves[cursor];
+  float w = sl.powerW / 0.02f + 0.5f;
+  float b = sl.boardTemp + 40.5f;
+  uint8_t n = 0;
+  for ( uint8_t i = 0; i < cellsPerStack[cursor]; i++ )
+  {
+    if ( balanceMask[cursor] & (1U << i) ) n++;
+  }
+
+  msg.id = ECU_BALANCE_BASE_ID + cursor;
+  msg.len = 8;
+  msg.buf[0] = balanceMask[cursor] & 0xFF;
+  msg.buf[1] = balanceMask[cursor] >> 8;
+  msg.buf[2] = n | ((balanceMask[cursor] >> 16) << 6);
+  msg.buf[3] = raw & 0xFF;
+  msg.buf[4] = raw >> 8;
+  msg.buf[5] = (balanceStatus & ~BALANCE_ST_THERMAL) | (sl.limited ? BALANCE_ST_THERMAL : 0);
+  msg.buf[6] = w >= 255 ? 255 : (uint8_t)w;
+  msg.buf[7] = (sl.boardTemp < -40) ? 0xFF : (b <= 0 ? 0 : (b >= 254 ? 254 : (uint8_t)b));
+  return true;
+}
+
+// Non-blocking charger control, once per loop: the command frame goes out every CHARGER_TX_PERIOD_MS,
+// the status comes from the can3 FIFO interrupt, so cell monitoring keeps its full rate while charging.
+void chargerService(void)
+{
+  PROFILE_SCOPE(PROFILE_CHARGER);
+  bool chargerRxValid = chargerStatusSnapshot();
+  uint32_t now = millis();
+  uint8_t status = receive_msg.buf[4];
+  if ( chargerRxValid )
+  {
     output_voltage = (receive_msg.buf[0]*256 + receive_msg.buf[1] + 1.5)/10;
     output_current = (receive_msg.buf[2]*256 + receive_msg.buf[3])/10;
-    //Serial.print("Output Voltage [CHARGER] : "); Serial.println(output_voltage);
-    //Serial.print("Output Current [CHARGER] : "); Serial.println(output_current);
-    //Serial.print("Error Byte :");
-    //Serial.println(receive_msg.buf[4]);
+  }
+
+  // faults first, from every active state
+  if ( (chargerState != CHARGER_FAULT) && (chargerState != CHARGER_IDLE) && (chargerState != CHARGER_COMPLETE) )
+  {
+    if ( voltFlag || tempFlag )
+    {
+      #ifndef GUI_Enabled
+      SerialTx.println("Charging stopped due to BMS fault");
+      #endif
+      chargerSetState(CHARGER_FAULT);
+    }
+    else if ( !chargerRxValid )
+    {
+      #ifndef GUI_Enabled
+      SerialTx.print("Received no message from charger since ");
+      SerialTx.print(chargerRxAge);
+      SerialTx.println(" ms");
+      #endif
+      chargerSetState(CHARGER_FAULT);
     }
-    else{
-      Serial.println("Received no message from charger");
-      chargerFlag = true;
+    else if ( status & CHARGER_ST_ERRORS )
+    {
+      #ifndef GUI_Enabled
+      SerialTx.println("Charging stopped due to charger error");
+      printchargerError();
+      #endif
+      chargerSetState(CHARGER_FAULT);
     }
+  }
+
+  switch ( chargerState )
+  {
+    case CHARGER_IDLE:
+      if ( chargerRxValid && !(voltFlag || tempFlag) && !(status & CHARGER_ST_ERRORS) )
+        chargerSetState(CHARGER_HANDSHAKE);
+      break;
+    case CHARGER_HANDSHAKE:
+      if ( (output_voltage > 250) && (output_current > 1) )
+        chargerSetState(CHARGER_CC);
+      else if ( now - chargerStateMs > CHARGER_HANDSHAKE_MS )
+      {
+        #ifndef GUI_Enabled
+        if ( status & CHARGER_ST_NO_BATTERY )
+          SerialTx.println("Connect battery");
+        else
+          SerialTx.println("Charger is ready | No current detected");
+        printchargerError();
+        #endif
+        chargerSetState(CHARGER_FAULT);
+      }
+      break;
+    case CHARGER_CC:
+      if ( maxVoltage.val >= CHARGER_CV_CELL_V )
+        chargerSetState(CHARGER_CV);
+      break;
+    case CHARGER_CV:
+      if ( (output_current < CHARGER_TAPER_A) && (chargeRequest < CHARGER_TAPER_A * 10) )
+        chargerSetState(CHARGER_TAPER);
+      break;
+    case CHARGER_TAPER:
+      if ( output_current >= CHARGER_END_A )
+        chargerEndMs = now;
+      else if ( now - chargerEndMs >= CHARGER_END_MS )
+        chargerSetState(CHARGER_COMPLETE);
+      break;
+    case CHARGER_FAULT:
+    case CHARGER_COMPLETE:
+      break;
+  }
+  chargerFlag = (chargerState == CHARGER_FAULT);
+
+  bool start = (chargerState >= CHARGER_HANDSHAKE) && (chargerState <= CHARGER_TAPER);
+  chargeRequest = start ? chargeControl() : 0;
+
+  if ( (now - chargerTxMs >= CHARGER_TX_PERIOD_MS) || (chargeRequest <= chargeRequestSent - CHARGE_RESEND_DROP) )
+  {
+    chargerTxMs = now;
+    chargeRequestSent = chargeRequest;
+    chargerSendCommand(start, chargeRequest);
+
+    #ifndef GUI_Enabled
+    SerialTx.print("CHARGER : ");
+    SerialTx.print(chargerStateName[chargerState]);
+    SerialTx.print(" Request : ");
+    SerialTx.print(chargeRequest / 10.0, 1);
+    SerialTx.print(" Output Voltage : ");
+    SerialTx.print(output_voltage);
+    SerialTx.print(" Output Current : ");
+    SerialTx.print(output_current);
+    SerialTx.print(" Error Byte : ");
+    SerialTx.println(status);
+    #endif
+    #ifdef GUI_Enabled
+    SerialTx.print(output_voltage);
+    SerialTx.print(",");
+    SerialTx.print(output_current);
+    SerialTx.println(",");
+    for (int i = 4; i >= 0; i--) {
+            int bit = (status >> i) & 1;
+            SerialTx.print(bit);
+            SerialTx.print(",");
+        }
+    SerialTx.println("");
+    #endif
+  }
+}
+
+void chargerSetState(uint8_t state)
+{
+  #ifndef GUI_Enabled
+  SerialTx.print("CHARGER : ");
+  SerialTx.print(chargerStateName[chargerState]);
+  SerialTx.print(" -> ");
+  SerialTx.println(chargerStateName[state]);
   #endif
+  if ( state == CHARGER_HANDSHAKE )
+  {
+    chargeIntegral = max_current_without_decimal / 10.0f;   // start at full current, the PI pulls it down near the target
+    chargeControlMs = millis();
+  }
+  chargerState = state;
+  chargerStateMs = millis();
+  chargerEndMs = chargerStateMs;
+  chargerTxMs = chargerStateMs - CHARGER_TX_PERIOD_MS;   // tell the charger right away
+}
+
+// CC-CV controller, once per loop while charging, returns the current request in 0.1A.
+// Far below the target the PI saturates at the current limit (CC), near the target it holds the highest
+// cell at CHARGE_V_TARGET with a falling current (CV). Conditional integration: the integral is frozen while the
+// output is clamped in the direction of the error, so it does not wind up during CC.
+int chargeControl(void)
+{
+  uint32_t now = millis();
+  float dt = (now - chargeControlMs) * 1.0e-3f;
+  chargeControlMs = now;
+
+  float limit = max_current_without_decimal / 10.0f;
+  if ( sop.charge[SOP_WINDOWS - 1] < limit )
+    limit = sop.charge[SOP_WINDOWS - 1];
+  if ( maxVoltage.val >= CHARGE_V_GUARD )
+  {
+    chargeIntegral = 0;
+    return 0;
+  }
+
+  float e = CHARGE_V_TARGET - maxVoltage.val;
+  float p = CHARGE_KP * e;
+  float out = p + chargeIntegral;
+  bool clampedHigh = (out >= limit) && (e > 0);
+  bool clampedLow = (out <= 0) && (e < 0);
+  if ( !clampedHigh && !clampedLow )
+    chargeIntegral += CHARGE_KI * e * dt;
+  if ( chargeIntegral > limit ) chargeIntegral = limit;
+  if ( chargeIntegral < 0 ) chargeIntegral = 0;
+
+  out = p + chargeIntegral;
+  if ( out > limit ) out = limit;
+  if ( out < 0 ) out = 0;
+  return (int)(out * 10);
+}
+
+// control byte 0: start charging, 1: stop; current in 0.1A
+void chargerSendCommand(bool start, int current)
+{
+  send_msg.flags.extended = 1;
+  send_msg.id = send_id;
+  send_msg.len = 8;
+  send_msg.buf[0] = (max_voltage)>>8;
+  send_msg.buf[1] = (max_voltage)%256;
+  send_msg.buf[2] = (current)>>8;
+  send_msg.buf[3] = (current)%256;
+  send_msg.buf[4] = start ? 0 : 1;
+  send_msg.buf[5] = 0;
+  send_msg.buf[6] = 0;
+  send_msg.buf[7] = 0;
+  if ( can3.write(send_msg) != 1 )
+  {
+    #ifndef GUI_Enabled
+    SerialTx.println("Failed to send CAN message");
+    #endif
+  }
 }
 
 void transferV( uint16_t * data, uint8_t nic, uint8_t cellReg)
@@ -1737,7 +3125,7 @@ void transferV( uint16_t * data, uint8_t nic, uint8_t cellReg)
 void circularVoltdef(void){
 
   for (int c_ic = 0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++) {
-    for (int i = 0; i < 18; i++) {
+    for (int i = 0; i < LTCDEF_CELLS_PER_CELL_MONITOR_COUNT; i++) {
       if( abs( cells1[c_ic][i]-cells2[LTCDEF_CELL_MONITOR_COUNT- c_ic -1][i]) < tolerance){
         cells[c_ic][i]=cells1[c_ic][i];
 
@@ -1762,83 +3150,13 @@ void circularVoltdef(void){
 
 void cellsVoltSort(void)
 {
-  for ( int c_ic = 0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+  for ( uint8_t c_ic = 0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
   {
-    #ifndef seventhSlave
-      for ( int i=0; i < 18; i++ )
-      {
-        if ( (i != 5) && (i != 11) && (i != 17) )       // these pins are GNDed in the brd file 
-        {
-          if ( i < 5 )
-          {
-            cellVoltages[c_ic][i] = cells[c_ic][i];
-          }
-          else if ( (i < 11) && (i > 5) )
-          {
-            cellVoltages[c_ic][i-1] = cells[c_ic][i];
-          }
-          else 
-          {
-            cellVoltages[c_ic][i-2] = cells[c_ic][i];
-          }
-        }
-      }
-    #else
-      if ( c_ic < 6 )
-      {
-        for ( int i=0; i < 18; i++ )
-        {
-        if ( (i != 5) && (i != 11) && (i != 17) )       // these pins are GNDed in the brd file 
-          {
-            if ( i < 5 )
-            {
-              cellVoltages[c_ic][i] = cells[c_ic][i];
-            }
-            else if ( (i < 11) && (i > 5) )
-            {
-              cellVoltages[c_ic][i-1] = cells[c_ic][i];
-            }
-            else 
-            {
-              cellVoltages[c_ic][i-2] = cells[c_ic][i];
-            }
-          }
-        }
-      }
-
-      else if ( c_ic == 6 )
-      {
-        for ( uint8_t i=0; i<18; i++ )
-        {
-          if ( (i==0) || (i==1) || (i==6) || (i==7) || (i==12) || (i==13) )
-          {
-            if ( i < 2 )
-            {
-              cellVoltages[c_ic][i] = cells[c_ic][i];
-            }
-            else if ( (i < 8) && ( i > 5) )
-            {
-              cellVoltages[c_ic][i-4] = cells[c_ic][i];
-            }
-            else
-            {
-              cellVoltages[c_ic][i-8] = cells[c_ic][i];
-            }
-          }
-          // else
-          // {
-          //   if ( i < 15 )
-          //   {
-          //     cellVoltages[c_ic][i] = 3.5000;
-          //   }
-          // }
-        }
-        for ( uint8_t i=6; i<15; i++ )
-        {
-          cellVoltages[c_ic][i] = 3.5000;
-        }
-      }
-    #endif
+    for ( uint8_t i = 0; i < LTCDEF_CELLS_PER_SLAVE; i++ )
+    {
+      // channels a short slave does not have read as a healthy cell for the checks over all channels
+      cellVoltages[c_ic][i] = i < cellsPerStack[c_ic] ? cells[c_ic][cellInput(c_ic, i)] : 3.5000;
+    }
   }
 }
 
@@ -1846,154 +3164,61 @@ void printCells(void)
 {
   for (uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
   {
-    #ifndef seventhSlave
-      Serial.println();
-      Serial.print("IC : ");
-      Serial.print(c_ic+1);
-
-      for (uint8_t i=0; i < 15; i++ )
-      {
-        Serial.print(" C");
-        Serial.print(i+1);
-        Serial.print(":");
-        Serial.print(cellVoltages[c_ic][i], 4);
-        Serial.print(",");
-      }
-    #else
-      if ( c_ic < 6 )
-      {
-        Serial.println();
-        Serial.print("IC : ");
-        Serial.print(c_ic+1);
-
-        for (uint8_t i=0; i < 15; i++ )
-        {
-          Serial.print(" C");
-          Serial.print(i+1);
-          Serial.print(":");
-          Serial.print(cellVoltages[c_ic][i], 4);
-          Serial.print(",");
-        }
-      }
-
-      else if ( c_ic == 6 )
-      {
-        Serial.println();
-        Serial.print("IC : ");
-        Serial.print(c_ic+1);
+    SerialTx.println();
+    SerialTx.print("IC : ");
+    SerialTx.print(c_ic+1);
 
-        for (uint8_t i=0; i < 6; i++ )
-        {
-          Serial.print(" C");
-          Serial.print(i+1);
-          Serial.print(":");
-          Serial.print(cellVoltages[c_ic][i], 4);
-          Serial.print(",");
-        }
-      }
-    #endif
+    for (uint8_t i=0; i < cellsPerStack[c_ic]; i++ )
+    {
+      SerialTx.print(" C");
+      SerialTx.print(i+1);
+      SerialTx.print(":");
+      SerialTx.print(cellVoltages[c_ic][i], 4);
+      SerialTx.print(",");
+    }
   }
 }
 
 void cellsLogging(void)
 {
+  // every SD row starts with its time, a replay of the log needs the time between the frames
+  CellData += millis();
+  CellData += ",";
   
   if(BPM_ready)
   {
     for (uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
     {
-      #ifndef seventhSlave
-        for (uint8_t i=0; i < 15; i++ )
-        {
-          CellData += String(cellVoltages[c_ic][i], 4);
-          CellData += ",";
-        }
-      #else
-        if ( c_ic < 6 )
-        {
-          for (uint8_t i=0; i < 15; i++ )
-          {
-            CellData += String(cellVoltages[c_ic][i], 4);
-            CellData += ",";
-          }
-        }
-
-        else if ( c_ic == 6 )
-        {
-          for (uint8_t i=0; i < 6; i++ )
-          {
-            CellData += String(cellVoltages[c_ic][i], 4);
-            CellData += ",";
-          }
-        }
-      #endif
+      for (uint8_t i=0; i < cellsPerStack[c_ic]; i++ )
+      {
+        CellData += String(cellVoltages[c_ic][i], 4);
+        CellData += ",";
+      }
     }
   }
   #ifdef LTCDEF_LTC681X_ONLY
   {
     for (uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
     {
-      #ifndef seventhSlave
-        for (uint8_t i=0; i < 15; i++ )
-        {
-          CellData += String(cellVoltages[c_ic][i], 4);
-          CellData += ",";
-        }
-      #else
-        if ( c_ic < 6 )
-        {
-          for (uint8_t i=0; i < 15; i++ )
-          {
-            CellData += String(cellVoltages[c_ic][i], 4);
-            CellData += ",";
-          }
-        }
-
-        else if ( c_ic == 6 )
-        {
-          for (uint8_t i=0; i < 6; i++ )
-          {
-            CellData += String(cellVoltages[c_ic][i], 4);
-            CellData += ",";
-          }
-        }
-      #endif
+      for (uint8_t i=0; i < cellsPerStack[c_ic]; i++ )
+      {
+        CellData += String(cellVoltages[c_ic][i], 4);
+        CellData += ",";
+      }
     }
   }
   #endif
     for (uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
     {
-      #ifndef seventhSlave
-        for (uint8_t i=0; i < 15; i++ )
-        {
-          
-          CellData_GUI += String(cellVoltages[c_ic][i], 4);
-          CellData_GUI += ",";
-        }
-      #else
-        if ( c_ic < 6 )
-        {
-          for (uint8_t i=0; i < 15; i++ )
-          {
-            CellData_GUI += String(cellVoltages[c_ic][i], 4);
-            CellData_GUI += ",";
-            
-          }
-        }
-
-        else if ( c_ic == 6 )
-        {
-          for (uint8_t i=0; i < 6; i++ )
-          {
-            
-            CellData_GUI += String(cellVoltages[c_ic][i], 4);
-            CellData_GUI += ",";
-          }
-        }
-      #endif
+      for (uint8_t i=0; i < cellsPerStack[c_ic]; i++ )
+      {
+        
+        CellData_GUI += String(cellVoltages[c_ic][i], 4);
+        CellData_GUI += ",";
+      }
     }
      #ifdef GUI_Enabled
-     Serial.println(CellData_GUI);
+     SerialTx.println(CellData_GUI);
       // Serial.println();
      CellData_GUI = "";
      #endif
@@ -2006,125 +3231,931 @@ float linear_interpolate(float x0, float y0, float x1, float y1, float x) {
     return y;
 }
 
-float InitialiseEnergy(float min_voltage, float thr_voltage) {
-    float cap_mapped = 0.0;
-    float cap_mapped_thr = 0.0;
-    float SOC_VoltApprox = -1;
-    float SOC_ThrVoltApprox = -1;
-
-    float cell_capacity_lookup[87] = 
-    {
-        10.0, 78.54084795, 121.7597832, 171.4230513, 225.0389946, 280.0221137, 
-        338.1715796, 387.3510778, 441.212951, 492.8865338, 548.4655855, 
-        602.2419923, 656.0061216, 717.2497924, 770.9822287, 824.5884643, 
-        879.4615621, 934.3346599, 992.9889292, 1046.572513, 1101.468263, 
-        1156.364012, 1209.934652, 1268.689235, 1323.633523, 1375.96966, 
-        1427.093946, 1483.288917, 1540.724863, 1598.141393, 1654.412408, 
-        1707.971722, 1761.587666, 1813.946454, 1866.350546, 1919.943838, 
-        1973.569489, 2025.952547, 2080.820791, 2131.893302, 2184.274742, 
-        2237.890685, 2295.284564, 2348.939338, 2403.88039, 2454.744185, 
-        2509.961908, 2563.500189, 2618.457421, 2667.135351, 2724.483927, 
-        2782.746003, 2829.330942, 2885.525912, 2946.781861, 3008.07664, 
-        3061.731414, 3117.887554, 3171.5488, 3230.199833, 3283.796361, 
-        3337.392889, 3391.008832, 3443.377329, 3498.318381, 3551.934324, 
-        3613.180565, 3666.767385, 3716.474338, 3766.009787, 3813.381701, 
-        3852.360288, 3900.213706, 3944.288866, 3988.391207, 4022.84064, 
-        4056.234516, 4100.31194, 4142.094775, 4164.440414, 4190.76138, 
-        4213.12967, 4222.824484, 4238.782419, 4254.672399, 4260.459841, 
-        4260.154046
-    };
-    float cell_voltage_lookup[87] = {
-        
-        4.20, 4.142899317, 4.114316039, 4.090057769, 4.076679267, 4.07170303, 
-        4.051197819, 4.05428974, 4.064581985, 4.0490339, 4.03982197, 
-        4.04188808, 4.042772486, 4.024432319, 4.022266276, 4.007953401, 
-        3.992387619, 3.976821837, 3.95562859, 3.939135515, 3.925749933, 
-        3.912364352, 3.894625448, 3.883087374, 3.87437365, 3.861002226, 
-        3.854178482, 3.842654565, 3.827386083, 3.810248858, 3.806044185, 
-        3.787215181, 3.773836678, 3.762645454, 3.755814631, 3.740255928, 
-        3.727811797, 3.718956502, 3.702923534, 3.691116474, 3.682105451, 
-        3.668726948, 3.649409522, 3.639768506, 3.630743325, 3.623484956, 
-        3.616451686, 3.59559821, 3.588130316, 3.592221731, 3.568543904, 
-        3.558877405, 3.558619745, 3.547095828, 3.529937367, 3.516516393, 
-        3.506875376, 3.491613973, 3.482595871, 3.461091166, 3.44584392, 
-        3.430596674, 3.417218171, 3.406961319, 3.397936138, 3.384557635, 
-        3.366464802, 3.350283185, 3.330229587, 3.293668758, 3.270606767, 
-        3.228092858, 3.202100338, 3.157377913, 3.11527173, 3.067986154, 
-        3.017653961, 2.948511876, 2.904892293, 2.838268764, 2.784705202, 
-        2.720261874, 2.667880434, 2.602382398, 2.53034376, 2.471442955, 
-        2.442010248
-    };
-
-    int SOC_lookup_index=0;
-    do{
-      SOC_lookup_index++;
-      SOC_VoltApprox = min_voltage - cell_voltage_lookup[SOC_lookup_index];
-    }
-    while(SOC_VoltApprox<0 || SOC_lookup_index>86);
-  
-    cap_mapped = linear_interpolate(cell_voltage_lookup[SOC_lookup_index],cell_capacity_lookup[SOC_lookup_index] , cell_voltage_lookup[SOC_lookup_index-1], cell_capacity_lookup[SOC_lookup_index-1], min_voltage);
-
-    SOC_lookup_index=0;
-    do{
-      SOC_lookup_index++;
-      SOC_ThrVoltApprox = thr_voltage - cell_voltage_lookup[SOC_lookup_index];
-    }
-    while(SOC_ThrVoltApprox<0 || SOC_lookup_index>86);
-
-    cap_mapped_thr = linear_interpolate(cell_voltage_lookup[SOC_lookup_index],cell_capacity_lookup[SOC_lookup_index] , cell_voltage_lookup[SOC_lookup_index-1], cell_capacity_lookup[SOC_lookup_index-1], thr_voltage);
-
-
-    // Calculate Energy Available
-    float Energy_available = (cap_mapped_thr - cap_mapped) * 5.5 * min_voltage * 1.05 * 90 / 1000000.0;
-  return Energy_available;
+float ocvCapacityLookup(const struct ocvCurve &curve, float v)
+{
+  // direct index into the uniform grid, no search and bounded at both ends
+  float x = (v - curve.vMin) / curve.vStep;
+  if ( !(x > 0) )   // also catches NaN
+    return curve.capacity[0];
+  if ( x >= curve.points - 1 )
+    return curve.capacity[curve.points - 1];
+  uint16_t k = (uint16_t)x;
+  return curve.capacity[k] + (x - k) * (curve.capacity[k + 1] - curve.capacity[k]);
 }
-// Function to update Energy Available
-float CalculateEnergy(float TS_voltage, float TS_current, float EnergyAvailable, float time_previous, float chargerDelay) {
-    
-    float Power = abs(TS_current * TS_voltage / 1000.0);
-    // If TS_current is positive, return Energy_available and Power as 0
-    #ifdef charger_active
-    if (TS_current < 1) {
-        Power = 0.0;
-        return;
-    }
-    #else
-    if (TS_current > -1) {
-        Power = 0.0;
-        return;
-    }
-    #endif
-    // Calculate Power and make it positive
-    // Power in KW
-    #ifndef charger_active
-      chargerDelay=0;
-    #endif
-    // Calculate Energy Consumed
-    float Energy_consumed = (Power * (time_previous + chargerDelay)) / (1000.0 * 3600.0); // Energy consumed in kWh
-
-    // Update Energy Available
-    EnergyAvailable += Energy_consumed;
-    return EnergyAvailable;
 
+// open circuit voltage at soc (0..1), slope gets dOCV/dsoc
+float ocvVoltageLookup(const struct ocvCurve &curve, float soc, float * slope)
+{
+  float step = 1.0f / (curve.socPoints - 1);
+  float x = soc / step;
+  uint16_t k;
+  if ( !(x > 0) )
+    k = 0;
+  else if ( x >= curve.socPoints - 1 )
+    k = curve.socPoints - 2;
+  else
+    k = (uint16_t)x;
+  float dv = curve.ocv[k + 1] - curve.ocv[k];
+  *slope = dv / step;
+  float frac = x - k;
+  if ( frac < 0 ) frac = 0;
+  if ( frac > 1 ) frac = 1;
+  return curve.ocv[k] + frac * dv;
 }
 
+float socFromOcv(const struct ocvCurve &curve, float v)
+{
+  float capFull = curve.capacity[curve.points - 1];
+  float capEmpty = curve.capacity[0];
+  return (capEmpty - ocvCapacityLookup(curve, v)) / (capEmpty - capFull);
+}
 
-void transferT( uint16_t * data, uint8_t nic, bool muxSelect , uint8_t auxReg)
+float meanCellVoltage(void)
 {
-   if (loopcount)
+  double sum = 0;
+  uint16_t n = 0;
+  for ( uint8_t c_ic = 0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
   {
-      uint8_t counter = 0;
-    if (muxSelect)
+    for ( uint8_t i = 0; i < cellsPerStack[c_ic]; i++ )
     {
-      for (uint8_t i = 3 * nic; i < 3 * (nic + 1); i++) 
+      if ( voltageNormalize[c_ic][i] != -1 )
       {
-        auxHigh1[nic][counter + 3 * auxReg] = data[i] * 100e-6;
-        counter++;
+        sum += cellVoltages[c_ic][i];
+        n++;
       }
-   } 
-   else 
-   {
-      for (uint8_t i = 3 * nic; i < 3 * (nic + 1); i++) 
+    }
+  }
+  return n ? sum / n : 0;
+}
+
+// one predict / correct step per cell voltage frame, single precision only
+void socEkfUpdate(float vCell, float current)
+{
+  uint32_t now = micros();
+  if ( (vCell < CELL_V_PLAUSIBLE_MIN) || (vCell > CELL_V_PLAUSIBLE_MAX) )
+    return;     // no valid cell voltages (yet)
+
+  if ( !socEkf.init )
+  {
+    // start from the OCV of the present voltage
+    socEkf.soc = socFromOcv(OCV_CURVE, vCell);
+    socEkf.v1 = 0;
+    socEkf.P[0][0] = 0.01f;
+    socEkf.P[0][1] = 0;
+    socEkf.P[1][0] = 0;
+    socEkf.P[1][1] = 1.0e-4f;
+    socEkf.lastMicros = now;
+    socEkf.init = true;
+    return;
+  }
+
+  float dt = (now - socEkf.lastMicros) * 1.0e-6f;
+  socEkf.lastMicros = now;
+
+  // predict
+  float a = expf(-dt / (EKF_R1 * EKF_C1));
+  socEkf.soc += current * dt / (3600.0f * (float)CELL_BLOCK_CAPACITY_AH);
+  socEkf.v1 = a * socEkf.v1 + EKF_R1 * (1.0f - a) * current;
+  // P = F P F' + Q with F = diag(1, a)
+  socEkf.P[0][0] += EKF_Q_SOC;
+  socEkf.P[0][1] *= a;
+  socEkf.P[1][0] *= a;
+  socEkf.P[1][1] = a * a * socEkf.P[1][1] + EKF_Q_V1;
+
+  // correct with H = [dOCV/dsoc, 1]
+  float h0;
+  float vPred = ocvVoltageLookup(OCV_CURVE, socEkf.soc, &h0) + socEkf.v1 + cellResMean() * current;
+  float ph0 = socEkf.P[0][0] * h0 + socEkf.P[0][1];
+  float ph1 = socEkf.P[1][0] * h0 + socEkf.P[1][1];
+  float S = h0 * ph0 + ph1 + EKF_R_MEAS;
+  float k0 = ph0 / S;
+  float k1 = ph1 / S;
+
+  socEkf.innovation = vCell - vPred;
+  socEkf.soc += k0 * socEkf.innovation;
+  socEkf.v1 += k1 * socEkf.innovation;
+
+  // P = (I - K H) P
+  float p00 = socEkf.P[0][0] - k0 * ph0;
+  float p01 = socEkf.P[0][1] - k0 * (h0 * socEkf.P[0][1] + socEkf.P[1][1]);
+  float p10 = socEkf.P[1][0] - k1 * ph0;
+  float p11 = socEkf.P[1][1] - k1 * (h0 * socEkf.P[0][1] + socEkf.P[1][1]);
+  socEkf.P[0][0] = p00;
+  socEkf.P[0][1] = p01;
+  socEkf.P[1][0] = p10;
+  socEkf.P[1][1] = p11;
+
+  if ( socEkf.soc < 0 ) socEkf.soc = 0;
+  if ( socEkf.soc > 1 ) socEkf.soc = 1;
+}
+
+// per-cell resistance update, once per cell voltage frame, O(1) per cell
+void cellResistanceUpdate(void)
+{
+  if ( !cellResInit )
+  {
+    for ( uint8_t c_ic = 0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+    {
+      for ( uint8_t i = 0; i < LTCDEF_CELLS_PER_SLAVE; i++ )
+      {
+        cellRes[c_ic][i].r = EKF_R0;
+        cellRes[c_ic][i].p = CELL_RES_P0;
+        cellRes[c_ic][i].vPrev = 0;
+      }
+    }
+    cellResInit = true;
+  }
+
+  // keep the last synchronous frame as reference, the current of this one is not from the same instant
+  if ( !cellFrameCurrentSync )
+    return;
+
+  uint32_t now = millis();
+  float dI = cellFrameCurrent - cellResIPrev;
+  bool step = cellResPrevValid && (now - cellResPrevMs <= CELL_RES_MAX_AGE_MS) && (fabsf(dI) >= CELL_RES_MIN_DI);
+  if ( step )
+    cellResUpdates++;
+
+  for ( uint8_t c_ic = 0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+  {
+    for ( uint8_t i = 0; i < cellsPerStack[c_ic]; i++ )
+    {
+      struct cellResState &cell = cellRes[c_ic][i];
+      float v = cellVoltages[c_ic][i];
+      if ( step && (voltageNormalize[c_ic][i] != -1) )
+      {
+        float dV = v - cell.vPrev;
+        float k = cell.p * dI / (CELL_RES_LAMBDA * CELL_RES_NOISE_V2 + dI * cell.p * dI);
+        cell.r += k * (dV - cell.r * dI);
+        cell.p = (cell.p - k * dI * cell.p) / CELL_RES_LAMBDA;
+        if ( cell.p > CELL_RES_P0 ) cell.p = CELL_RES_P0;
+        if ( cell.r < 0 ) cell.r = 0;
+        if ( cell.r > CELL_RES_MAX ) cell.r = CELL_RES_MAX;
+      }
+      cell.vPrev = v;
+    }
+  }
+  cellResIPrev = cellFrameCurrent;
+  cellResPrevMs = now;
+  cellResPrevValid = true;
+}
+
+// mean RLS resistance of the enabled cells, the R0 of the EKF (one series element of the mean cell)
+float cellResMean(void)
+{
+  if ( !cellResInit )
+    return EKF_R0;
+  float sum = 0;
+  uint16_t n = 0;
+  for ( uint8_t c_ic = 0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+  {
+    for ( uint8_t i = 0; i < cellsPerStack[c_ic]; i++ )
+    {
+      if ( voltageNormalize[c_ic][i] != -1 )
+      {
+        sum += cellRes[c_ic][i].r;
+        n++;
+      }
+    }
+  }
+  return n ? sum / n : EKF_R0;
+}
+
+// temperature trends and outlier scores, once per temperature frame, a few integer operations per thermistor
+void tempTrendUpdate(void)
+{
+  uint32_t now = millis();
+  uint32_t spanMs = now - tempTrendRefMs;
+  bool boundary = !tempTrendInit || (spanMs >= TREND_RATE_HORIZON_MS);
+  if ( boundary )
+  {
+    tempTrendRefMs = now;
+    tempTrendInit = true;
+  }
+
+  const int32_t rateWarn = (int32_t)(TREND_RATE_WARN * (1 << TREND_Q));
+  const int32_t outlierWarn = (int32_t)(TREND_OUTLIER_WARN * (1 << TREND_Q));
+  const int32_t limit = (int32_t)(overTempThreshold * (1 << TREND_Q));
+  int32_t maxRate = INT32_MIN, maxOutlier = INT32_MIN;
+  uint8_t warn = 0;
+
+  for ( uint8_t c_ic = 0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+  {
+    int32_t sum = 0;
+    uint8_t n = 0;
+    for ( uint8_t i = 0; i < tempsPerStack[c_ic]; i++ )
+    {
+      // skip disabled and open / shorted thermistors, checkTempFlag() reports those
+      struct trendFilter &tr = tempTrends[c_ic][i];
+      if ( (tempNormalize[c_ic][i] == -1) || (cellTemperatures[c_ic][i] <= 0.0) )
+      {
+        tr.init = false;
+        continue;
+      }
+      int32_t t = (int32_t)(cellTemperatures[c_ic][i] * (1 << TREND_Q));
+      trendStep(tr, t, TREND_TEMP_SHIFT, TREND_RATE_SHIFT, boundary, spanMs);
+      sum += tr.ema;
+      n++;
+
+      if ( tr.rate > maxRate )
+      {
+        maxRate = tr.rate;
+        maxTempRate.slaveLoc = c_ic + 1;
+        maxTempRate.cellLoc = i + 1;
+      }
+      if ( tr.rate > rateWarn )
+        warn |= TREND_WARN_RATE;
+      if ( (tr.rate > 0) && (tr.ema + (int32_t)(tr.rate * TREND_PREDICT_MIN) >= limit) )
+        warn |= TREND_WARN_PREDICT;
+    }
+    if ( n < 2 )
+      continue;
+
+    int32_t mean = sum / n;
+    for ( uint8_t i = 0; i < tempsPerStack[c_ic]; i++ )
+    {
+      if ( (tempNormalize[c_ic][i] == -1) || (cellTemperatures[c_ic][i] <= 0.0) )
+        continue;
+      int32_t outlier = tempTrends[c_ic][i].ema - mean;
+      if ( outlier > maxOutlier )
+      {
+        maxOutlier = outlier;
+        maxTempOutlier.slaveLoc = c_ic + 1;
+        maxTempOutlier.cellLoc = i + 1;
+      }
+      if ( outlier > outlierWarn )
+        warn |= TREND_WARN_OUTLIER;
+    }
+  }
+
+  maxTempRate.val = maxRate == INT32_MIN ? 0 : (double)maxRate / (1 << TREND_Q);
+  maxTempOutlier.val = maxOutlier == INT32_MIN ? 0 : (double)maxOutlier / (1 << TREND_Q);
+
+  if ( warn )
+  {
+    if ( (warn & ~tempTrendWarn) != 0 )
+    {
+      #ifndef GUI_Enabled
+      SerialTx.print("TEMP TREND WARNING : ");
+      SerialTx.print(warn, BIN);
+      SerialTx.print(" rate ");
+      SerialTx.print(maxTempRate.val, 2);
+      SerialTx.print("degC/min at S");
+      SerialTx.print(maxTempRate.slaveLoc);
+      SerialTx.print("C");
+      SerialTx.print(maxTempRate.cellLoc);
+      SerialTx.print(" outlier ");
+      SerialTx.print(maxTempOutlier.val, 2);
+      SerialTx.print("degC at S");
+      SerialTx.print(maxTempOutlier.slaveLoc);
+      SerialTx.print("C");
+      SerialTx.println(maxTempOutlier.cellLoc);
+      #endif
+    }
+  }
+  trendWarnUpdate(tempTrendWarn, tempTrendWarnMs, warn, now);
+}
+
+// cell voltage trends, once per cell voltage frame, a few integer operations per cell
+void voltTrendUpdate(void)
+{
+  uint32_t now = millis();
+  uint32_t spanMs = now - voltTrendRefMs;
+  bool boundary = !voltTrendInit || (spanMs >= TREND_VRATE_HORIZON_MS);
+  if ( boundary )
+  {
+    voltTrendRefMs = now;
+    voltTrendInit = true;
+  }
+
+  const int32_t dropWarn = (int32_t)(TREND_VDROP_WARN * 10 * (1 << TREND_V_Q));
+  int32_t maxDrop = INT32_MIN;
+  uint8_t warn = 0;
+
+  for ( uint8_t c_ic = 0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+  {
+    int32_t sum = 0;
+    uint8_t n = 0;
+    for ( uint8_t i = 0; i < cellsPerStack[c_ic]; i++ )
+    {
+      // skip disabled and implausible cells, checkVoltageFlag() reports those
+      struct trendFilter &tr = voltTrends[c_ic][i];
+      if ( (voltageNormalize[c_ic][i] == -1) || (cellVoltages[c_ic][i] <= 0.0) )
+      {
+        tr.init = false;
+        continue;
+      }
+      int32_t v = (int32_t)(cellVoltages[c_ic][i] / 100e-6 * (1 << TREND_V_Q));
+      trendStep(tr, v, TREND_VOLT_SHIFT, TREND_VRATE_SHIFT, boundary, spanMs);
+      if ( !tr.rateValid )
+        continue;
+      sum += tr.rate;
+      n++;
+    }
+    if ( n < 2 )
+      continue;
+
+    int32_t mean = sum / n;
+    for ( uint8_t i = 0; i < cellsPerStack[c_ic]; i++ )
+    {
+      if ( (voltageNormalize[c_ic][i] == -1) || (cellVoltages[c_ic][i] <= 0.0) || !voltTrends[c_ic][i].rateValid )
+        continue;
+      int32_t drop = mean - voltTrends[c_ic][i].rate;
+      if ( drop > maxDrop )
+      {
+        maxDrop = drop;
+        maxVoltDrop.slaveLoc = c_ic + 1;
+        maxVoltDrop.cellLoc = i + 1;
+      }
+      if ( drop > dropWarn )
+        warn |= TREND_WARN_VDROP;
+    }
+  }
+
+  maxVoltDrop.val = maxDrop == INT32_MIN ? 0 : (double)maxDrop / (1 << TREND_V_Q) / 10;
+
+  #ifndef GUI_Enabled
+  if ( warn & ~voltTrendWarn )
+  {
+    SerialTx.print("VOLT TREND WARNING : S");
+    SerialTx.print(maxVoltDrop.slaveLoc);
+    SerialTx.print("C");
+    SerialTx.print(maxVoltDrop.cellLoc);
+    SerialTx.print(" dV/dt ");
+    SerialTx.print(maxVoltDrop.val, 2);
+    SerialTx.println("mV/min below the slave mean");
+  }
+  #endif
+  trendWarnUpdate(voltTrendWarn, voltTrendWarnMs, warn, now);
+}
+
+// one trend filter step: x into the ema and, on a horizon boundary, the ema change over the last spanMs into the rate
+void trendStep(struct trendFilter &tr, int32_t x, uint8_t emaShift, uint8_t rateShift, bool boundary, uint32_t spanMs)
+{
+  if ( !tr.init )
+  {
+    tr.ema = x;
+    tr.rate = 0;
+    tr.ref = x;
+    tr.init = true;
+    tr.refValid = boundary;
+    tr.rateValid = false;
+    return;
+  }
+  tr.ema += trendShift(x - tr.ema, emaShift);
+  if ( !boundary )
+    return;
+  if ( tr.refValid && (spanMs > 0) )
+  {
+    int32_t rate = (int32_t)((int64_t)(tr.ema - tr.ref) * 60000 / spanMs);
+    tr.rate = tr.rateValid ? tr.rate + trendShift(rate - tr.rate, rateShift) : rate;
+    tr.rateValid = true;
+  }
+  tr.ref = tr.ema;
+  tr.refValid = true;
+}
+
+// sets the raised bits of "held", a bit is released TREND_WARN_HOLD_MS after its cause is gone
+void trendWarnUpdate(uint8_t &held, uint32_t * heldMs, uint8_t warn, uint32_t now)
+{
+  for ( uint8_t b = 0; b < 8; b++ )
+  {
+    uint8_t bit = 1 << b;
+    if ( warn & bit )
+    {
+      held |= bit;
+      heldMs[b] = now;
+    }
+    else if ( (held & bit) && (now - heldMs[b] >= TREND_WARN_HOLD_MS) )
+    {
+      held &= ~bit;
+    }
+  }
+}
+
+// x / 2^shift rounded to nearest, halves away from 0, so positive and negative deltas are treated alike
+int32_t trendShift(int32_t x, uint8_t shift)
+{
+  int32_t half = (1 << shift) >> 1;
+  return x >= 0 ? (x + half) >> shift : -((-x + half) >> shift);
+}
+
+// state of power, once per cycle after checkError()
+void sopUpdate(void)
+{
+  float tau = EKF_R1 * EKF_C1;
+  float polFactor[SOP_WINDOWS];
+  float ocvTerm[SOP_WINDOWS];
+  float ocvSlope = 0;
+  if ( socEkf.init )
+    ocvVoltageLookup(OCV_CURVE, socEkf.soc, &ocvSlope);
+  for ( uint8_t w = 0; w < SOP_WINDOWS; w++ )
+  {
+    polFactor[w] = 1.0f + EKF_R1 / EKF_R0 * (1.0f - expf(-sopWindowS[w] / tau));
+    ocvTerm[w] = sopWindowS[w] * ocvSlope / (3600.0f * (float)CELL_BLOCK_CAPACITY_AH);
+    sop.discharge[w] = SOP_MAX_DISCHARGE_A;
+    sop.charge[w] = SOP_MAX_CHARGE_A;
+  }
+
+  for ( uint8_t c_ic = 0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+  {
+    for ( uint8_t i = 0; i < cellsPerStack[c_ic]; i++ )
+    {
+      if ( voltageNormalize[c_ic][i] == -1 )
+        continue;
+      float r = cellRes[c_ic][i].r;
+      float vOcv = cellVoltages[c_ic][i] - r * cellFrameCurrent;
+      float dis = vOcv - underVoltageThreshold;
+      float chg = overVoltageThreshold - vOcv;
+      for ( uint8_t w = 0; w < SOP_WINDOWS; w++ )
+      {
+        float reff = r * polFactor[w] + ocvTerm[w];
+        if ( reff <= 0 )
+          continue;
+        if ( dis / reff < sop.discharge[w] ) sop.discharge[w] = dis / reff;
+        if ( chg / reff < sop.charge[w] ) sop.charge[w] = chg / reff;
+      }
+    }
+  }
+
+  double minTemp = 1000;
+  for ( uint8_t c_ic = 0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+  {
+    for ( uint8_t i = 0; i < tempsPerStack[c_ic]; i++ )
+    {
+      if ( (tempNormalize[c_ic][i] != -1) && (cellTemperatures[c_ic][i] < minTemp) )
+        minTemp = cellTemperatures[c_ic][i];
+    }
+  }
+
+  float derate = 1.0f;
+  if ( maxTemp.val > SOP_HOT_DERATE_START )
+    derate = (overTempThreshold - maxTemp.val) / (overTempThreshold - SOP_HOT_DERATE_START);
+  if ( derate < 0 ) derate = 0;
+  float chargeDerate = derate;
+  if ( minTemp < SOP_COLD_CHARGE_FULL )
+  {
+    float cold = minTemp / SOP_COLD_CHARGE_FULL;
+    if ( cold < 0 ) cold = 0;
+    if ( cold < chargeDerate ) chargeDerate = cold;
+  }
+  sop.derate = derate;
+  sop.fault = voltFlag || tempFlag;
+
+  for ( uint8_t w = 0; w < SOP_WINDOWS; w++ )
+  {
+    sop.discharge[w] = sop.fault || (sop.discharge[w] < 0) ? 0 : sop.discharge[w] * derate;
+    sop.charge[w] = sop.fault || (sop.charge[w] < 0) ? 0 : sop.charge[w] * chargeDerate;
+  }
+}
+
+// passive balancing, once per cycle after faultDebounceUpdate(): selects the cells from the DCC free frame,
+// fits them into the thermal budget of every slave and opens the balancing window until the next measurement
+void balanceService(void)
+{
+  uint32_t now = millis();
+  float dt = (now - balanceLastMs) / 1000.0f;
+  balanceLastMs = now;
+  bool rotate = now - balanceRotateMs >= BALANCE_ROTATE_MS;
+  if ( rotate )
+    balanceRotateMs = now;
+
+  balanceStatus = 0;
+  if ( voltFlag || tempFlag )
+    balanceStatus |= BALANCE_ST_FAULT;
+  if ( minVoltage.val < BALANCE_MIN_CELL_V )
+    balanceStatus |= BALANCE_ST_LOW;
+  // pack current is positive while charging
+  if ( cellFrameCurrent < -BALANCE_MAX_DISCHARGE_A )
+    balanceStatus |= BALANCE_ST_LOAD;
+  if ( tempTrendWarn )
+    balanceStatus |= BALANCE_ST_TREND;
+
+  float start = minVoltage.val + BALANCE_DELTA_V;
+  float stop = start - BALANCE_HYST_V;
+  float k = dt / BALANCE_BOARD_TAU_S;
+  if ( k > 1 ) k = 1;
+  balanceThreshold = start;
+  balanceCellCount = 0;
+  for ( uint8_t c_ic = 0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+  {
+    struct balanceSlave &sl = balanceSlaves[c_ic];
+
+    // board model, driven by the cells switched in the window that just ended
+    float p = 0;
+    for ( uint8_t i = 0; i < cellsPerStack[c_ic]; i++ )
+    {
+      if ( balanceMask[c_ic] & (1U << i) )
+        p += cellVoltages[c_ic][i] * cellVoltages[c_ic][i] / BALANCE_RESISTOR_OHM;
+    }
+    sl.boardRise += (p * BALANCE_BOARD_RTH - sl.boardRise) * k;
+
+    double hottest = -100;
+    for ( uint8_t i = 0; i < tempsPerStack[c_ic]; i++ )
+    {
+      if ( (tempNormalize[c_ic][i] != -1) && (cellTemperatures[c_ic][i] > 0.0) && (cellTemperatures[c_ic][i] > hottest) )
+        hottest = cellTemperatures[c_ic][i];
+    }
+    float budget = 0;
+    sl.boardTemp = -100;
+    if ( hottest > -100 )           // no thermistor, no balancing
+    {
+      sl.boardTemp = hottest + sl.boardRise;
+      budget = (BALANCE_BOARD_MAX_T - hottest) / BALANCE_BOARD_RTH;
+      if ( budget > BALANCE_SLAVE_MAX_W )
+        budget = BALANCE_SLAVE_MAX_W;
+      if ( hottest > BALANCE_CELL_T_START )
+        budget *= (BALANCE_CELL_T_STOP - hottest) / (BALANCE_CELL_T_STOP - BALANCE_CELL_T_START);
+      if ( (budget < 0) || (sl.boardTemp >= BALANCE_BOARD_MAX_T) )
+        budget = 0;
+    }
+    sl.budgetW = budget;
+
+    // candidates, with hysteresis
+    uint32_t wanted = 0;
+    for ( uint8_t i = 0; (i < cellsPerStack[c_ic]) && !(balanceStatus & BALANCE_ST_HOLD); i++ )
+    {
+      if ( voltageNormalize[c_ic][i] == -1 )
+        continue;
+      bool on = sl.wanted & (1U << i);
+      if ( cellVoltages[c_ic][i] > (on ? stop : start) )
+        wanted |= 1U << i;
+    }
+    sl.wanted = wanted;
+
+    // fill the budget from the rotation point
+    uint32_t mask = 0;
+    float used = 0;
+    uint8_t count = cellsPerStack[c_ic];
+    uint8_t first = sl.rotation % count;
+    uint8_t next = first;
+    for ( uint8_t n = 0; n < count; n++ )
+    {
+      uint8_t pos = (first + n) % count;
+      uint8_t i = balanceOrder(pos, count);
+      if ( !(wanted & (1U << i)) )
+        continue;
+      float pc = cellVoltages[c_ic][i] * cellVoltages[c_ic][i] / BALANCE_RESISTOR_OHM;
+      if ( used + pc > budget )
+        break;
+      used += pc;
+      mask |= 1U << i;
+      next = (pos + 1) % count;
+      balanceCellCount++;
+    }
+    sl.limited = mask != wanted;
+    if ( sl.limited )
+      balanceStatus |= BALANCE_ST_THERMAL;
+    if ( rotate )
+      sl.rotation = next;
+    sl.powerW = used;
+    balanceMask[c_ic] = mask;
+  }
+  if ( balanceCellCount )
+    balanceStatus |= BALANCE_ST_ACTIVE;
+
+  if ( balanceCellCount || balanceDccActive )
+    error |= balanceWriteDcc(balanceCellCount != 0);
+
+  #ifndef GUI_Enabled
+  SerialTx.print("BALANCING : ");
+  SerialTx.print(balanceCellCount);
+  SerialTx.print(" cells above ");
+  SerialTx.print(balanceThreshold, 4);
+  SerialTx.print("V");
+  if ( balanceStatus & BALANCE_ST_FAULT ) SerialTx.print(", held off by a fault");
+  if ( balanceStatus & BALANCE_ST_LOW ) SerialTx.print(", held off, lowest cell too low");
+  if ( balanceStatus & BALANCE_ST_LOAD ) SerialTx.print(", held off, discharge current");
+  if ( balanceStatus & BALANCE_ST_TREND ) SerialTx.print(", held off, temperature trend warning");
+  if ( balanceStatus & BALANCE_ST_THERMAL ) SerialTx.print(", cells waiting for the thermal budget");
+  SerialTx.println();
+  #endif
+}
+
+// cell at rotation position pos of a slave with count cells: every other cell first, 0, 2, 4, .. then 1, 3, ..
+uint8_t balanceOrder(uint8_t pos, uint8_t count)
+{
+  uint8_t half = (count + 1) / 2;
+  return pos < half ? 2 * pos : 2 * (pos - half) + 1;
+}
+
+// DCC bit of every balanced cell of slave c_ic, bit n = LTC681x cell input n + 1
+uint32_t balanceChannels(uint8_t c_ic)
+{
+  uint32_t dcc = 0;
+  for ( uint8_t i = 0; i < cellsPerStack[c_ic]; i++ )
+  {
+    if ( !(balanceMask[c_ic] & (1U << i)) )
+      continue;
+    dcc |= 1UL << cellInput(c_ic, i);
+  }
+  return dcc;
+}
+
+// cells of slave c_ic on each of the three 6 input sections of the LTC681x
+uint8_t cellsPerSection(uint8_t c_ic)
+{
+  return cellsPerStack[c_ic] / 3;
+}
+
+// LTC681x cell input of cell i of slave c_ic, every section is filled from its lowest input
+// (15 cells: inputs 5, 11 and 17 are GNDed, the 6 cell seventhSlave: inputs 0, 1, 6, 7, 12, 13)
+uint8_t cellInput(uint8_t c_ic, uint8_t i)
+{
+  uint8_t n = cellsPerSection(c_ic);
+  return (i / n) * 6 + i % n;
+}
+
+void initPackLayout(void)
+{
+  for ( uint8_t c_ic = 0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+  {
+    cellsPerStack[c_ic] = LTCDEF_CELLS_PER_SLAVE;
+    tempsPerStack[c_ic] = LTCDEF_TEMPS_PER_SLAVE;
+  }
+  #ifdef seventhSlave
+  cellsPerStack[LTCDEF_CELL_MONITOR_COUNT - 1] = LTCDEF_SHORT_SLAVE_CELLS;
+  tempsPerStack[LTCDEF_CELL_MONITOR_COUNT - 1] = LTCDEF_SHORT_SLAVE_CELLS;
+  #endif
+}
+
+/*
+  DCC bits: CFGAR4 DCC8..DCC1, CFGAR5 bit 3..0 DCC12..DCC9 (bit 7..4 DCTO stays 0, no discharge timer),
+            CFGBR0 bit 7..4 DCC16..DCC13, CFGBR1 bit 1..0 DCC18..DCC17
+  read-modify-write so GPIO / REFON keep what CellMonitorCFGA/CFGB set. The register buffers are in chain order,
+  which is reversed on the backward chain (see circularVoltdef()). enable = false clears all DCC bits.
+*/
+byte balanceWriteDcc(bool enable)
+{
+  byte * cfg = (byte *)cellMonDat;
+  byte err = HAL_RdCfg(cfg);
+  if ( err_detected(err) )
+    return err;
+  for ( uint8_t k = 0; k < LTCDEF_CELL_MONITOR_COUNT; k++ )
+  {
+    uint32_t dcc = enable ? balanceChannels(loopcount ? k : LTCDEF_CELL_MONITOR_COUNT - 1 - k) : 0;
+    cfg[k * 6 + 4] = dcc & 0xFF;
+    cfg[k * 6 + 5] = (cfg[k * 6 + 5] & 0xF0) | ((dcc >> 8) & 0x0F);
+  }
+  err |= HAL_WrCfg(cfg);
+
+  err |= HAL_RdCfgb(cfg);
+  if ( err_detected(err) )
+    return err;
+  for ( uint8_t k = 0; k < LTCDEF_CELL_MONITOR_COUNT; k++ )
+  {
+    uint32_t dcc = enable ? balanceChannels(loopcount ? k : LTCDEF_CELL_MONITOR_COUNT - 1 - k) : 0;
+    cfg[k * 6 + 0] = (cfg[k * 6 + 0] & 0x0F) | (((dcc >> 12) & 0x0F) << 4);
+    cfg[k * 6 + 1] = (cfg[k * 6 + 1] & 0xFC) | ((dcc >> 16) & 0x03);
+  }
+  err |= HAL_WrCfgb(cfg);
+
+  // on a failed write the state of the switches is unknown, clear them again with the next measurement window
+  balanceDccActive = enable || err_detected(err);
+  return err;
+}
+
+void printBalance(void)
+{
+  SerialTx.print("Balancing : ");
+  SerialTx.print(balanceCellCount);
+  SerialTx.print(" cells above ");
+  SerialTx.print(balanceThreshold, 4);
+  SerialTx.print("V (pack minimum + ");
+  SerialTx.print(BALANCE_DELTA_V * 1000, 0);
+  SerialTx.print("mV), status ");
+  SerialTx.println(balanceStatus, BIN);
+  for ( uint8_t c_ic = 0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+  {
+    SerialTx.print("S");
+    SerialTx.print(c_ic + 1);
+    SerialTx.print(" : ");
+    const struct balanceSlave &sl = balanceSlaves[c_ic];
+    for ( uint8_t i = 0; i < cellsPerStack[c_ic]; i++ )
+    {
+      if ( voltageNormalize[c_ic][i] == -1 )
+        SerialTx.print("- ");
+      else if ( balanceMask[c_ic] & (1U << i) )
+        SerialTx.print("B ");
+      else
+        SerialTx.print(sl.wanted & (1U << i) ? "w " : ". ");
+    }
+    SerialTx.print(" ");
+    SerialTx.print(sl.powerW, 2);
+    SerialTx.print("W of ");
+    SerialTx.print(sl.budgetW, 2);
+    SerialTx.print("W, board ");
+    if ( sl.boardTemp < -40 )
+      SerialTx.println("--");
+    else
+    {
+      SerialTx.print(sl.boardTemp, 1);
+      SerialTx.println("degC");
+    }
+  }
+}
+
+// per-cell SOC / capacity update, once per cell voltage frame after socEkfUpdate()
+void cellSocUpdate(void)
+{
+  uint32_t now = millis();
+
+  if ( !cellSocInit )
+  {
+    for ( uint8_t c_ic = 0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+    {
+      for ( uint8_t i = 0; i < cellsPerStack[c_ic]; i++ )
+        cellSoc[c_ic][i].init = false;
+    }
+    cellSocChargeRef = ChargeAccumulated;
+    cellSocChargeRest = ChargeAccumulated;
+    cellSocRestStart = now;
+    cellSocInit = true;
+  }
+
+  // the same charge passes through every series element
+  float dq = ChargeAccumulated - cellSocChargeRef;
+  cellSocChargeRef = ChargeAccumulated;
+
+  if ( fabsf(cellFrameCurrent) > CELL_SOC_REST_CURRENT )
+  {
+    cellSocRestStart = now;
+    cellSocResting = false;
+  }
+  bool rested = (now - cellSocRestStart) >= CELL_SOC_REST_MS;
+  // new rest point: capacity update for all cells if enough charge went through since the last one
+  bool restPoint = rested && !cellSocResting;
+  float dqRest = ChargeAccumulated - cellSocChargeRest;
+  bool capUpdate = restPoint && (fabsf(dqRest) >= CELL_CAP_MIN_DQ);
+  if ( restPoint )
+  {
+    cellSocResting = true;
+    cellSocChargeRest = ChargeAccumulated;
+  }
+
+  float minAh = 1.0e9f;
+  for ( uint8_t c_ic = 0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+  {
+    for ( uint8_t i = 0; i < cellsPerStack[c_ic]; i++ )
+    {
+      if ( voltageNormalize[c_ic][i] == -1 )
+        continue;
+      struct cellSocState &cell = cellSoc[c_ic][i];
+      if ( !cell.init )
+      {
+        float v = cellVoltages[c_ic][i];
+        if ( (v < CELL_V_PLAUSIBLE_MIN) || (v > CELL_V_PLAUSIBLE_MAX) )
+          continue;
+        cell.soc = socFromOcv(OCV_CURVE, v);
+        cell.capacityAh = CELL_BLOCK_CAPACITY_AH;
+        // referred back to the last rest point, a cell seeded late must not see the charge before as capacity
+        cell.socRest = cell.soc - dqRest / cell.capacityAh;
+        cell.init = true;
+      }
+      else
+        cell.soc += dq / cell.capacityAh;
+
+      if ( rested )
+      {
+        float socOcv = socFromOcv(OCV_CURVE, cellVoltages[c_ic][i]);
+        if ( capUpdate )
+        {
+          float dSoc = socOcv - cell.socRest;
+          // only plausible estimates: same sign as the charge and within 50 % of nominal
+          if ( dSoc * dqRest > 0 )
+          {
+            float cap = dqRest / dSoc;
+            if ( (cap > 0.5f * CELL_BLOCK_CAPACITY_AH) && (cap < 1.5f * CELL_BLOCK_CAPACITY_AH) )
+              cell.capacityAh += CELL_CAP_GAIN * (cap - cell.capacityAh);
+          }
+        }
+        if ( restPoint )
+          cell.socRest = socOcv;
+        cell.soc += CELL_SOC_OCV_GAIN * (socOcv - cell.soc);
+      }
+
+      if ( cell.soc < 0 ) cell.soc = 0;
+      if ( cell.soc > 1 ) cell.soc = 1;
+
+      float ah = cell.soc * cell.capacityAh;
+      if ( ah < minAh )
+      {
+        minAh = ah;
+        weakestCell.val = cell.soc;
+        weakestCell.slaveLoc = c_ic + 1;
+        weakestCell.cellLoc = i + 1;
+      }
+    }
+  }
+  if ( minAh < 1.0e9f )   // at least one cell seeded
+    weakestCellAh = minAh;
+}
+
+float InitialiseEnergy(float min_voltage, float thr_voltage) {
+    float cap_mapped = ocvCapacityLookup(OCV_CURVE, min_voltage);
+    float cap_mapped_thr = ocvCapacityLookup(OCV_CURVE, thr_voltage);
+
+    // Calculate Energy Available
+    float Energy_available = (cap_mapped_thr - cap_mapped) * 5.5 * min_voltage * 1.05 * LTCDEF_PACK_CELLS / 1000000.0;
+  return Energy_available;
+}
+
+// signed integer of len bytes as read from the LTC2949 (e.g. 6 bytes for C1 / E1)
+int64_t bytesToInt64(byte * data, uint8_t len)
+{
+  // LTC2949 registers are big endian: MSB first
+  int64_t val = (int8_t)data[0]; // sign extension
+  for ( uint8_t i = 1; i < len; i++ )
+  {
+    val = (val << 8) | data[i];
+  }
+  return val;
+}
+
+// Reads TB1, C1 and E1 and adds the charge / energy since the last slow channel update.
+// Replaces the former software integration of |I*V| over the loop time.
+byte readAccumulators(void)
+{
+  byte error = 0;
+  byte data[6];
+
+  error |= HAL_READ(LTC2949_VAL_TB1, 4, data);
+  uint32_t tb1 = (uint32_t)bytesToInt64(data, 4);
+  error |= HAL_READ(LTC2949_VAL_C1, 6, data);
+  int64_t c1 = bytesToInt64(data, 6);
+  error |= HAL_READ(LTC2949_VAL_E1, 6, data);
+  int64_t e1 = bytesToInt64(data, 6);
+
+  if ( err_detected(error) )
+  {
+    accuValid = false;   // rebase with the next valid read
+    return error;
+  }
+
+  // TB1 counts up while the accumulators are running, if it went back the device was reset / reinitialised
+  if ( accuValid && (tb1 >= lastTB1Raw) )
+  {
+    // E1 integrates P1, so it is scaled with the same POT_DIV_POWER as the P1 reading
+    float dCharge = (c1 - lastC1Raw) * LTC2949_LSB_C1 / LTCDEF_SENSE_RESISTOR / 3600.0;                  // Ah
+    float dEnergy = (e1 - lastE1Raw) * LTC2949_LSB_E1 / LTCDEF_SENSE_RESISTOR * POT_DIV_POWER / 3.6e6;    // kWh
+    ChargeAccumulated += dCharge;
+    EnergyAccumulated += dEnergy;
+    if ( SOC_init_flag )
+    {
+      EnergyAvailable += dEnergy;   // negative while discharging
+    }
+    accuCheckUpdate(dEnergy, packPowerP1 * (tb1 - lastTB1Raw) * LTC2949_LSB_TB1 / 3.6e6);
+  }
+
+  lastTB1Raw = tb1;
+  lastC1Raw = c1;
+  lastE1Raw = e1;
+  accuValid = true;
+  return error;
+}
+
+// Sums the E1 energy and P1 * dt over ACCU_CHECK_UPDATES slow channel updates and reports
+// when they differ by more than ACCU_CHECK_TOLERANCE. P1 is only sampled once per update,
+// so single updates are too noisy to compare.
+void accuCheckUpdate(float dEnergyE1, float dEnergyP1)
+{
+  accuCheckE1 += dEnergyE1;
+  accuCheckP1 += dEnergyP1;
+  if ( ++accuCheckUpdates < ACCU_CHECK_UPDATES )
+    return;
+
+  if ( (fabsf(accuCheckP1) >= ACCU_CHECK_MIN_KWH)
+       && (fabsf(accuCheckE1 - accuCheckP1) > ACCU_CHECK_TOLERANCE * fabsf(accuCheckP1)) )
+  {
+    accuCheckMismatches++;
+    SerialTx.print("ENERGY CHECK : E1 ");
+    SerialTx.print(accuCheckE1, 5);
+    SerialTx.print(" kWh , P1*dt ");
+    SerialTx.print(accuCheckP1, 5);
+    SerialTx.print(" kWh , mismatches ");
+    SerialTx.println(accuCheckMismatches);
+  }
+  accuCheckE1 = 0;
+  accuCheckP1 = 0;
+  accuCheckUpdates = 0;
+}
+
+void transferT( uint16_t * data, uint8_t nic, bool muxSelect , uint8_t auxReg)
+{
+   if (loopcount)
+  {
+      uint8_t counter = 0;
+    if (muxSelect)
+    {
+      for (uint8_t i = 3 * nic; i < 3 * (nic + 1); i++) 
+      {
+        auxHigh1[nic][counter + 3 * auxReg] = data[i] * 100e-6;
+        counter++;
+      }
+   } 
+   else 
+   {
+      for (uint8_t i = 3 * nic; i < 3 * (nic + 1); i++) 
       {
         auxLow1[nic][counter + 3 * auxReg] = data[i] * 100e-6;
         counter++;
@@ -2167,7 +4198,7 @@ void circularTempdef(bool muxSelect){
       {
         auxRefL = auxLow1[c_ic][5];
       }
-      for (uint8_t i = 0; i < 12; i++){
+      for (uint8_t i = 0; i < LTCDEF_AUX_PER_CELL_MONITOR_COUNT; i++){
         if (muxSelect) {
           auxHigh1[c_ic][i] = voltToTemp(auxHigh1[c_ic][i], auxRefH);
         } else {
@@ -2185,7 +4216,7 @@ void circularTempdef(bool muxSelect){
       } else {
         auxRefL = auxLow2[c_ic][5];
       }
-      for (uint8_t i = 0; i < 12; i++) 
+      for (uint8_t i = 0; i < LTCDEF_AUX_PER_CELL_MONITOR_COUNT; i++) 
       {
         if (muxSelect) 
         {
@@ -2199,199 +4230,75 @@ void circularTempdef(bool muxSelect){
     }
   }
   for (uint8_t c_ic = 0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++) {
-    for (uint8_t i = 0; i < 12; i++) {
+    for (uint8_t i = 0; i < LTCDEF_AUX_PER_CELL_MONITOR_COUNT; i++) {
         if (muxSelect) {
           if( abs(auxHigh1[c_ic][i]-auxHigh2[LTCDEF_CELL_MONITOR_COUNT- c_ic -1][i]) < tolerance){
             auxHigh[c_ic][i]=auxHigh1[c_ic][i];
           }else{
             auxHigh[c_ic][i]=auxHigh1[c_ic][i];
-          if(auxHigh[c_ic][i]<auxHigh2[LTCDEF_CELL_MONITOR_COUNT-c_ic-1][i]){
-            auxHigh[c_ic][i]=auxHigh2[LTCDEF_CELL_MONITOR_COUNT-c_ic-1][i];
-            }
-          } 
-        } else 
-        {
-          if( abs(auxLow1[c_ic][i]-auxLow2[LTCDEF_CELL_MONITOR_COUNT- c_ic -1][i]) < tolerance){
-            auxLow[c_ic][i]=auxLow1[c_ic][i];
-          }
-          else
-          {
-            auxLow[c_ic][i]=auxLow1[c_ic][i];
-          if(auxLow[c_ic][i]<auxLow2[LTCDEF_CELL_MONITOR_COUNT-c_ic-1][i])
-          {
-            auxLow[c_ic][i]=auxLow2[LTCDEF_CELL_MONITOR_COUNT-c_ic-1][i];
-          }
-        }
-      }
-    }
-  }
-}
-
-void tempConvertSort(bool muxSelect)
-{
-  #ifndef seventhSlave
-    if (muxSelect)
-    {
-      for ( uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
-      {
-        for ( uint8_t i=0; i < 8; i++ )
-        {
-          if ( i < 5 )
-          {
-            cellTemperatures[c_ic][i+8] = auxHigh[c_ic][i];
-          }
-          else if ( i > 5 )
-          {
-            cellTemperatures[c_ic][i+7] = auxHigh[c_ic][i];
-          }
-        }
-      }
-    }
-    else
-    {
-      for (uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
-      {
-        for ( uint8_t i=0; i < 9; i++ )
-        {
-          if ( i < 5)
-          {
-            cellTemperatures[c_ic][i] = auxLow[c_ic][i];
-          }
-          else if ( i > 5 )
-          {
-            cellTemperatures[c_ic][i-1] = auxLow[c_ic][i];
-          }
-        }
-      }
-    }
-  #else
-    if (muxSelect)
-    {
-      for ( uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
-      {
-        if ( c_ic < 6 )
-        {
-          for ( uint8_t i=0; i < 8; i++ )
-          {
-            if ( i < 5 )
-            {
-              cellTemperatures[c_ic][i+8] = auxHigh[c_ic][i];
-            }
-            else if ( i > 5 )
-            {
-              cellTemperatures[c_ic][i+7] = auxHigh[c_ic][i];
-            }
-          }
-        }
-
-        else if ( c_ic == 6 )
-        {
-          for ( uint8_t i=0; i < 8; i++ )
-          {
-            if ( i < 5 )
-            {
-              cellTemperatures[c_ic][i+8] = 30.000;
-            }
-            else if ( i > 5 )
-            {
-              cellTemperatures[c_ic][i+7] = 30.000;
-            }
-          }
-        }
-      }
-    }
-    else
-    {
-      for (uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
-      {
-        if ( c_ic < 6 )
-        {
-          for ( uint8_t i=0; i < 9; i++ )
-          {
-            if ( i < 5)
-            {
-              cellTemperatures[c_ic][i] = auxLow[c_ic][i];
-            }
-            else if ( i > 5 )
-            {
-              cellTemperatures[c_ic][i-1] = auxLow[c_ic][i];
+          if(auxHigh[c_ic][i]<auxHigh2[LTCDEF_CELL_MONITOR_COUNT-c_ic-1][i]){
+            auxHigh[c_ic][i]=auxHigh2[LTCDEF_CELL_MONITOR_COUNT-c_ic-1][i];
             }
-          }
-        }
-
-        else if ( c_ic == 6 )
+          } 
+        } else 
         {
-          for ( uint8_t i=0; i < 9; i++ )
+          if( abs(auxLow1[c_ic][i]-auxLow2[LTCDEF_CELL_MONITOR_COUNT- c_ic -1][i]) < tolerance){
+            auxLow[c_ic][i]=auxLow1[c_ic][i];
+          }
+          else
           {
-            if ( i < 5)
-            {
-              cellTemperatures[c_ic][i] = auxLow[c_ic][i];
-            }
-            else if ( i == 6 )
-            {
-              cellTemperatures[c_ic][i-1] = auxLow[c_ic][i];
-            }
-            else if ( i > 6 )
-            {
-              cellTemperatures[c_ic][i-1] = 30.000;  // dummy values to normalize error checks
-            }
+            auxLow[c_ic][i]=auxLow1[c_ic][i];
+          if(auxLow[c_ic][i]<auxLow2[LTCDEF_CELL_MONITOR_COUNT-c_ic-1][i])
+          {
+            auxLow[c_ic][i]=auxLow2[LTCDEF_CELL_MONITOR_COUNT-c_ic-1][i];
           }
         }
       }
     }
-  #endif
+  }
 }
 
-void printAux(void)
+void tempConvertSort(bool muxSelect)
 {
-  for (uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+  uint8_t first = muxSelect ? LTCDEF_TEMPS_LOW_BANK : 0;
+  uint8_t last = muxSelect ? LTCDEF_TEMPS_PER_SLAVE : LTCDEF_TEMPS_LOW_BANK;
+  if ( last > LTCDEF_TEMPS_PER_SLAVE )
+    last = LTCDEF_TEMPS_PER_SLAVE;
+  for ( uint8_t c_ic = 0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
   {
-    #ifndef seventhSlave
-      Serial.println();
-      Serial.print("IC : ");
-      Serial.print(c_ic+1);
-
-      for (uint8_t i=0; i < 15; i++ )
-      {
-        Serial.print(" T");
-        Serial.print(i+1);
-        Serial.print(":");
-        Serial.print(cellTemperatures[c_ic][i], 3);
-        Serial.print(",");
-      }
-    #else
-      if ( c_ic < 6 )
-      {
-        Serial.println();
-        Serial.print("IC : ");
-        Serial.print(c_ic+1);
+    for ( uint8_t t = first; t < last; t++ )
+    {
+      if ( t < tempsPerStack[c_ic] )
+        cellTemperatures[c_ic][t] = muxSelect ? auxHigh[c_ic][tempAuxReg(t)] : auxLow[c_ic][tempAuxReg(t)];
+      else
+        cellTemperatures[c_ic][t] = 30.000;  // dummy values to normalize error checks
+    }
+  }
+}
 
-        for (uint8_t i=0; i < 15; i++ )
-        {
-          Serial.print(" T");
-          Serial.print(i+1);
-          Serial.print(":");
-          Serial.print(cellTemperatures[c_ic][i], 3);
-          Serial.print(",");
-        } 
-      }
+// aux register of thermistor t on its mux bank: GPIO1..5, register 5 is the reference, then GPIO6..9
+uint8_t tempAuxReg(uint8_t t)
+{
+  uint8_t r = t % LTCDEF_TEMPS_LOW_BANK;
+  return r < 5 ? r : r + 1;
+}
 
-      else if ( c_ic == 6 )
-      {
-        Serial.println();
-        Serial.print("IC : ");
-        Serial.print(c_ic+1);
+void printAux(void)
+{
+  for (uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+  {
+    SerialTx.println();
+    SerialTx.print("IC : ");
+    SerialTx.print(c_ic+1);
 
-        for (uint8_t i=0; i < 6; i++ )
-        {
-          Serial.print(" T");
-          Serial.print(i+1);
-          Serial.print(":");
-          Serial.print(cellTemperatures[c_ic][i], 3);
-          Serial.print(",");
-        }
-      }
-    #endif  
+    for (uint8_t i=0; i < tempsPerStack[c_ic]; i++ )
+    {
+      SerialTx.print(" T");
+      SerialTx.print(i+1);
+      SerialTx.print(":");
+      SerialTx.print(cellTemperatures[c_ic][i], 3);
+      SerialTx.print(",");
+    }
   }
 }
 
@@ -2401,61 +4308,21 @@ void auxLogging(void)
   {
     for (uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
     {
-      #ifndef seventhSlave
-        for (uint8_t i=0; i < 15; i++ )
-        {
-          CellData += String(cellTemperatures[c_ic][i], 4);
-          CellData += ",";
-        }
-      #else
-        if ( c_ic < 6 )
-        {
-          for (uint8_t i=0; i < 15; i++ )
-          {
-            CellData += String(cellTemperatures[c_ic][i], 4);
-            CellData += ",";
-          }
-        }
-
-        else if ( c_ic == 6 )
-        {
-          for (uint8_t i=0; i < 6; i++ )
-          {
-            CellData += String(cellTemperatures[c_ic][i], 4);
-            CellData += ",";
-          }
-        }
-      #endif
+      for (uint8_t i=0; i < tempsPerStack[c_ic]; i++ )
+      {
+        CellData += String(cellTemperatures[c_ic][i], 4);
+        CellData += ",";
+      }
     }
   }
   #ifdef LTCDEF_LTC681X_ONLY
   for (uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
     {
-      #ifndef seventhSlave
-        for (uint8_t i=0; i < 15; i++ )
-        {
-          CellData += String(cellTemperatures[c_ic][i], 4);
-          CellData += ",";
-        }
-      #else
-        if ( c_ic < 6 )
-        {
-          for (uint8_t i=0; i < 15; i++ )
-          {
-            CellData += String(cellTemperatures[c_ic][i], 4);
-            CellData += ",";
-          }
-        }
-
-        else if ( c_ic == 6 )
-        {
-          for (uint8_t i=0; i < 6; i++ )
-          {
-            CellData += String(cellTemperatures[c_ic][i], 4);
-            CellData += ",";
-          }
-        }
-      #endif
+      for (uint8_t i=0; i < tempsPerStack[c_ic]; i++ )
+      {
+        CellData += String(cellTemperatures[c_ic][i], 4);
+        CellData += ",";
+      }
     }
     #endif
 
@@ -2463,39 +4330,16 @@ void auxLogging(void)
   
     for (uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
     {
-      #ifndef seventhSlave
-        for (uint8_t i=0; i < 15; i++ )
-        {
-          
-          CellData_GUI += String(cellTemperatures[c_ic][i], 4);
-          CellData_GUI += ",";
-        }
-      #else
-        if ( c_ic < 6 )
-        {
-          for (uint8_t i=0; i < 15; i++ )
-          {
-            
-            CellData_GUI += String(cellTemperatures[c_ic][i], 4);
-            CellData_GUI += ",";
-            
-          }
-        }
-
-        else if ( c_ic == 6 )
-        {
-          for (uint8_t i=0; i < 6; i++ )
-          {
-            
-            CellData_GUI += String(cellTemperatures[c_ic][i], 4);
-            CellData_GUI += ",";
-          }
-        }
-      #endif
+      for (uint8_t i=0; i < tempsPerStack[c_ic]; i++ )
+      {
+        
+        CellData_GUI += String(cellTemperatures[c_ic][i], 4);
+        CellData_GUI += ",";
+      }
     }
     #ifdef GUI_Enabled
     CellData_GUI += "0,0,0,";
-    Serial.println(CellData_GUI);
+    SerialTx.println(CellData_GUI);
     CellData_GUI="";
     #endif
   
@@ -2534,249 +4378,924 @@ double voltToTemp( double auxVal, double auxRef)
 
 void checkError (void)
 {
-  checkVoltageFlag();
-  checkTempFlag();
+  checkVoltageFlag();
+  checkTempFlag();
+}
+
+void checkVoltageFlag(void)
+{
+  for ( uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+  {
+    for ( uint8_t i=0; i < LTCDEF_CELLS_PER_SLAVE; i++ )
+    {
+      if ( cellVoltages[c_ic][i] < 0.5 )
+      {
+        errorFlag[0] = -1;
+        voltageErrorLoc[c_ic][i] = -1;
+      }
+
+      if ( cellVoltages[c_ic][i] > 6.0 )
+      {
+        errorFlag[1] = -1;
+        voltageErrorLoc[c_ic][i] = -1;
+      }
+
+      if ( (cellVoltages[c_ic][i] < underVoltageThreshold) && (cellVoltages[c_ic][i] > 0.5 ) )
+      {
+        errorFlag[2] = -1;
+        voltageErrorLoc[c_ic][i] = -1;
+      }
+
+      if ( (cellVoltages[c_ic][i] > overVoltageThreshold) && (cellVoltages[c_ic][i] < 6.0 ) )
+      {
+        errorFlag[3] = -1;
+        voltageErrorLoc[c_ic][i] = -1; 
+      }
+    }
+  }
+}
+
+void checkTempFlag(void)
+{
+  for ( uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+  {
+    for ( uint8_t i=0; i < LTCDEF_TEMPS_PER_SLAVE; i++ )
+    {
+      if ( cellTemperatures[c_ic][i] < 0.0 )
+      {
+        errorFlag[4] = -1;
+        tempErrorLoc[c_ic][i] = -1;
+      }
+
+      if ( cellTemperatures[c_ic][i] == 0.0 )
+      {
+        errorFlag[5] = -1;
+        tempErrorLoc[c_ic][i] = -1;
+      }
+
+      if ( (cellTemperatures[c_ic][i] > overTempThreshold) )
+      {
+        errorFlag[6] = -1;
+        tempErrorLoc[c_ic][i] = -1; 
+      }
+    }
+  }
+}
+
+// Runs the fault state machine of every voltage and temperature channel once per cycle and sets
+// voltFlag / tempFlag from the qualified faults; triggerInterrupt() then pulls BMS_FLT_3V3 low.
+// Replaces the former plausibility loops, so measurements, CAN and logging keep running while a fault qualifies.
+void faultDebounceUpdate(void)
+{
+  uint32_t now = millis();
+
+  for ( uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+  {
+    for ( uint8_t i=0; i < LTCDEF_CELLS_PER_SLAVE; i++ )
+    {
+      double v = cellVoltages[c_ic][i];
+      int8_t rawType = -1;
+      if ( v < 0.5 )
+        rawType = 0;
+      else if ( v > 6.0 )
+        rawType = 1;
+      else if ( v < underVoltageThreshold )
+        rawType = 2;
+      else if ( v > overVoltageThreshold )
+        rawType = 3;
+      bool healthy = (v >= underVoltageThreshold + VOLT_HYST) && (v <= overVoltageThreshold - VOLT_HYST);
+
+      uint8_t prevState = voltFault[c_ic][i].state;
+      if ( faultChannelUpdate(voltFault[c_ic][i], rawType, healthy, now, voltTimer, VOLT_CLEAR_MS) )
+      {
+        voltFlag = true;
+        voltageErrorLoc[c_ic][i] = -1;
+      }
+      if ( (prevState == FAULT_CH_OK) && (voltFault[c_ic][i].state == FAULT_CH_SETTING) )
+        voltFault[c_ic][i].convUs = voltConvUs;
+      else if ( (prevState == FAULT_CH_SETTING) && (voltFault[c_ic][i].state == FAULT_CH_ACTIVE) )
+        latencyQualified(voltFault[c_ic][i].type, voltFault[c_ic][i].convUs);
+      faultJournalTransition(voltFault[c_ic][i], prevState, c_ic, i, v);
+    }
+  }
+
+  for ( uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+  {
+    for ( uint8_t i=0; i < LTCDEF_TEMPS_PER_SLAVE; i++ )
+    {
+      double t = cellTemperatures[c_ic][i];
+      int8_t rawType = -1;
+      if ( t < 0.0 )
+        rawType = 4;
+      else if ( t == 0.0 )
+        rawType = 5;
+      else if ( t > overTempThreshold )
+        rawType = 6;
+      bool healthy = (t > 0.0) && (t <= overTempThreshold - TEMP_HYST);
+
+      uint8_t prevState = tempFault[c_ic][i].state;
+      if ( faultChannelUpdate(tempFault[c_ic][i], rawType, healthy, now, tempTimer, TEMP_CLEAR_MS) )
+      {
+        tempFlag = true;
+        tempErrorLoc[c_ic][i] = -1;
+      }
+      if ( (prevState == FAULT_CH_OK) && (tempFault[c_ic][i].state == FAULT_CH_SETTING) )
+        tempFault[c_ic][i].convUs = tempConvUs;
+      else if ( (prevState == FAULT_CH_SETTING) && (tempFault[c_ic][i].state == FAULT_CH_ACTIVE) )
+        latencyQualified(tempFault[c_ic][i].type, tempFault[c_ic][i].convUs);
+      faultJournalTransition(tempFault[c_ic][i], prevState, c_ic, i, t);
+    }
+  }
+}
+
+// one debounce step of a channel, returns true while the fault is asserted (ACTIVE or CLEARING)
+bool faultChannelUpdate(struct faultChannel &ch, int8_t rawType, bool healthy, uint32_t now, uint32_t setMs, uint32_t clearMs)
+{
+  switch ( ch.state )
+  {
+    case FAULT_CH_OK:
+      if ( rawType != -1 )
+      {
+        ch.state = FAULT_CH_SETTING;
+        ch.type = rawType;
+        ch.since = now;
+      }
+      break;
+    case FAULT_CH_SETTING:
+      if ( rawType == -1 )
+      {
+        ch.state = FAULT_CH_OK;
+        ch.type = -1;
+        break;
+      }
+      ch.type = rawType;
+      if ( now - ch.since >= setMs )
+      {
+        ch.state = FAULT_CH_ACTIVE;
+        ch.since = now;
+      }
+      break;
+    case FAULT_CH_ACTIVE:
+      if ( rawType != -1 )
+        ch.type = rawType;
+      if ( healthy )
+      {
+        ch.state = FAULT_CH_CLEARING;
+        ch.since = now;
+      }
+      break;
+    case FAULT_CH_CLEARING:
+      if ( !healthy )
+      {
+        ch.state = FAULT_CH_ACTIVE;
+        ch.since = now;
+      }
+      else if ( now - ch.since >= clearMs )
+      {
+        ch.state = FAULT_CH_OK;   // type is kept for the journal entry of the release
+      }
+      break;
+  }
+  return (ch.state == FAULT_CH_ACTIVE) || (ch.state == FAULT_CH_CLEARING);
+}
+
+// journal the qualification and the release of a fault
+void faultJournalTransition(const struct faultChannel &ch, uint8_t prevState, uint8_t c_ic, uint8_t i, float value)
+{
+  if ( (prevState == FAULT_CH_SETTING) && (ch.state == FAULT_CH_ACTIVE) )
+    faultJournalAdd(ch.type, c_ic + 1, i + 1, value, false);
+  else if ( (prevState == FAULT_CH_CLEARING) && (ch.state == FAULT_CH_OK) )
+    faultJournalAdd(ch.type, c_ic + 1, i + 1, value, true);
+}
+
+void faultJournalAdd(int8_t type, uint8_t slave, uint8_t cell, float value, bool cleared)
+{
+  struct faultEvent &ev = faultJournal[faultJournalCount % FAULT_JOURNAL_SIZE];
+  ev.timeMs = millis();
+  ev.cycle = cycleCount;
+  ev.value = value;
+  ev.type = type;
+  ev.slave = slave;
+  ev.cell = cell;
+  ev.flags = (bootNumber & 0x7F) | (cleared ? FAULT_EVENT_CLEARED : 0);
+  faultJournalCount++;
+}
+
+// Appends the events added since the last call to the EEPROM ring and the SD card. Called after
+// triggerInterrupt(), so the blocking EEPROM / SD writes never delay BMS_FLT_3V3.
+void faultJournalPersist(void)
+{
+  if ( faultJournalPersisted == faultJournalCount )
+    return;
+  uint32_t now = millis();
+  if ( (now - faultJournalPersistMs < FAULT_JOURNAL_PERSIST_MS) && (faultJournalPersistMs != 0) )
+    return;
+  faultJournalPersistMs = now;
+
+  if ( faultJournalCount - faultJournalPersisted > FAULT_JOURNAL_SIZE )
+  {
+    faultJournalLost += faultJournalCount - faultJournalPersisted - FAULT_JOURNAL_SIZE;
+    faultJournalPersisted = faultJournalCount - FAULT_JOURNAL_SIZE;
+  }
+
+  for ( uint8_t k = 0; (k < FAULT_JOURNAL_PERSIST_MAX) && (faultJournalPersisted != faultJournalCount); k++ )
+  {
+    const struct faultEvent &ev = faultJournal[faultJournalPersisted % FAULT_JOURNAL_SIZE];
+    uint32_t slot = faultJournalEepromCount % FAULT_JOURNAL_EEPROM_ENTRIES;
+    EEPROM.put(FAULT_JOURNAL_EEPROM_BASE + sizeof(struct faultJournalHeader) + slot * sizeof(struct faultEvent), ev);
+    faultJournalEepromCount++;
+    faultJournalPersisted++;
+    faultFileAppend(ev);
+  }
+
+  // the header is written last so a reset in between only loses these events
+  struct faultJournalHeader header = { FAULT_JOURNAL_MAGIC, faultJournalEepromCount };
+  EEPROM.put(FAULT_JOURNAL_EEPROM_BASE, header);
+  if ( faultFile )
+    faultFile.flush();
+}
+
+void faultFileAppend(const struct faultEvent &ev)
+{
+  if ( faultFile )
+  {
+    faultFile.print(ev.flags & 0x7F);
+    faultFile.print(",");
+    faultFile.print(ev.timeMs);
+    faultFile.print(",");
+    faultFile.print(ev.cycle);
+    faultFile.print(",");
+    faultFile.print((ev.flags & FAULT_EVENT_CLEARED) ? "CLEARED," : "RAISED,");
+    faultFile.print(ev.type);
+    faultFile.print(",");
+    faultFile.print(ev.slave);
+    faultFile.print(",");
+    faultFile.print(ev.cell);
+    faultFile.print(",");
+    faultFile.println(ev.value, 4);
+  }
+}
+
+// loads the EEPROM ring into the RAM journal, oldest first
+void faultJournalRestore(void)
+{
+  struct faultJournalHeader header;
+  EEPROM.get(FAULT_JOURNAL_EEPROM_BASE, header);
+  if ( header.magic != FAULT_JOURNAL_MAGIC )
+  {
+    faultJournalClear();
+    return;
+  }
+  faultJournalEepromCount = header.count;
+  uint32_t n = header.count < FAULT_JOURNAL_EEPROM_ENTRIES ? header.count : FAULT_JOURNAL_EEPROM_ENTRIES;
+  faultJournalCount = 0;
+  for ( uint32_t k = header.count - n; k < header.count; k++ )
+  {
+    uint32_t slot = k % FAULT_JOURNAL_EEPROM_ENTRIES;
+    EEPROM.get(FAULT_JOURNAL_EEPROM_BASE + sizeof(struct faultJournalHeader) + slot * sizeof(struct faultEvent),
+               faultJournal[faultJournalCount % FAULT_JOURNAL_SIZE]);
+    faultJournalCount++;
+  }
+  faultJournalPersisted = faultJournalCount;
+}
+
+void faultJournalClear(void)
+{
+  faultJournalCount = 0;
+  faultJournalPersisted = 0;
+  faultJournalEepromCount = 0;
+  struct faultJournalHeader header = { FAULT_JOURNAL_MAGIC, 0 };
+  EEPROM.put(FAULT_JOURNAL_EEPROM_BASE, header);
+}
+
+void printFaultJournal(void)
+{
+  uint32_t n = faultJournalCount < FAULT_JOURNAL_SIZE ? faultJournalCount : FAULT_JOURNAL_SIZE;
+  SerialTx.println();
+  SerialTx.print("FAULT JOURNAL : ");
+  SerialTx.print(n);
+  SerialTx.println(" events, newest first");
+  SerialTx.println("boot,time ms,cycle,event,errorFlag,slave,cell,value");
+  for ( uint32_t k = 0; k < n; k++ )
+  {
+    printFaultEvent(faultJournal[(faultJournalCount - 1 - k) % FAULT_JOURNAL_SIZE]);
+    serialTxDrain();
+  }
+}
+
+void printFaultEvent(const struct faultEvent &ev)
+{
+  SerialTx.print(ev.flags & 0x7F);
+  SerialTx.print(",");
+  SerialTx.print(ev.timeMs);
+  SerialTx.print(",");
+  SerialTx.print(ev.cycle);
+  SerialTx.print(",");
+  SerialTx.print((ev.flags & FAULT_EVENT_CLEARED) ? "CLEARED," : "RAISED,");
+  SerialTx.print(ev.type);
+  SerialTx.print(",");
+  SerialTx.print(ev.slave);
+  SerialTx.print(",");
+  SerialTx.print(ev.cell);
+  SerialTx.print(",");
+  SerialTx.println(ev.value, 4);
+}
+
+// queues journal requests of the ECU, called from canTxService(), the answers go out through the journal stream
+void faultJournalCanService(void)
+{
+  CAN_message_t rx;
+  while ( Can2.read(rx) )
+  {
+    if ( (rx.id != ECU_JOURNAL_REQ_ID) || (rx.len < 1) )
+      continue;
+    if ( (uint8_t)(journalReqHead - journalReqTail) >= FAULT_JOURNAL_REQ_QUEUE )
+    {
+      journalReqDropped++;
+      continue;
+    }
+    journalReqQueue[journalReqHead++ & (FAULT_JOURNAL_REQ_QUEUE - 1)] = rx.buf[0];
+  }
+}
+
+// one pass of the journal stream answers one request, the entry is copied so both frames describe the same event
+void planJournalFrames(void)
+{
+  journalTxActive = journalReqHead != journalReqTail;
+  if ( !journalTxActive )
+    return;
+  journalTxIndex = journalReqQueue[journalReqTail++ & (FAULT_JOURNAL_REQ_QUEUE - 1)];
+  journalTxStored = faultJournalCount < FAULT_JOURNAL_SIZE ? faultJournalCount : FAULT_JOURNAL_SIZE;
+  if ( journalTxIndex < journalTxStored )
+    journalTxEvent = faultJournal[(faultJournalCount - 1 - journalTxIndex) % FAULT_JOURNAL_SIZE];
+}
+
+bool buildJournalFrame(uint16_t cursor, CAN_message_t &msg)
+{
+  if ( !journalTxActive )
+    return false;
+  bool found = journalTxIndex < journalTxStored;
+  const struct faultEvent &ev = journalTxEvent;
+  msg.len = 8;
+  if ( cursor == 0 )
+  {
+    msg.id = ECU_JOURNAL_RSP_ID;
+    memset(msg.buf, 0, 8);
+    msg.buf[0] = journalTxIndex;
+    msg.buf[1] = 0xFF;
+    msg.buf[7] = journalTxStored;
+    if ( found )
+    {
+      float scaled = ev.type < 4 ? ev.value * 1000 : ev.value * 10;     // voltage: mV, temperature: 0.1degC
+      int16_t raw = scaled > 32767 ? 32767 : (scaled < -32768 ? -32768 : (int16_t)scaled);
+      msg.buf[1] = ev.type;
+      msg.buf[2] = ev.flags;
+      msg.buf[3] = ev.slave;
+      msg.buf[4] = ev.cell;
+      msg.buf[5] = raw & 0xFF;
+      msg.buf[6] = (raw >> 8) & 0xFF;
+    }
+    return true;
+  }
+
+  if ( !found )
+    return false;                               // no entry: only the first frame
+  msg.id = ECU_JOURNAL_RSP_ID + 1;
+  for ( uint8_t k = 0; k < 4; k++ )
+  {
+    msg.buf[k] = (ev.timeMs >> (8 * k)) & 0xFF;
+    msg.buf[4 + k] = (ev.cycle >> (8 * k)) & 0xFF;
+  }
+  return true;
+}
+
+// a fault of class "type" qualified, its latency is closed when Interrupt() pulls the pin
+void latencyQualified(int8_t type, uint32_t convUs)
+{
+  if ( (type < 0) || (type >= LATENCY_CLASSES) )
+    return;
+  struct latencyStats &st = latency[type];
+  if ( st.pending )
+    return;                             // keep the earliest fault of this class
+  st.pending = true;
+  st.pendingConvUs = convUs;
+  st.pendingDecisionUs = micros();
+}
+
+void latencyPinAsserted(void)
+{
+  uint32_t now = micros();
+  for ( uint8_t c = 0; c < LATENCY_CLASSES; c++ )
+  {
+    struct latencyStats &st = latency[c];
+    if ( !st.pending )
+      continue;
+    st.pending = false;
+    uint32_t dt = now - st.pendingConvUs;
+    st.lastDecisionToPinUs = now - st.pendingDecisionUs;
+    if ( (st.count == 0) || (dt < st.minUs) )
+      st.minUs = dt;
+    if ( dt > st.maxUs )
+      st.maxUs = dt;
+    st.sumUs += dt;
+    st.count++;
+    uint32_t b = dt / (LATENCY_BUCKET_MS * 1000UL);
+    if ( b >= LATENCY_BUCKETS )
+      b = LATENCY_BUCKETS - 1;
+    if ( st.bucket[b] < 0xFFFF )
+      st.bucket[b]++;
+  }
 }
 
-void checkVoltageFlag(void)
+// upper edge of the bucket holding the 99th percentile, at most maxUs (max for the overflow bucket)
+uint32_t latencyP99Us(const struct latencyStats &st)
 {
-  for ( uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+  uint32_t total = 0;
+  for ( uint8_t b = 0; b < LATENCY_BUCKETS; b++ )
+    total += st.bucket[b];
+  uint32_t target = (total * 99 + 99) / 100;
+  uint32_t sum = 0;
+  for ( uint8_t b = 0; b < LATENCY_BUCKETS - 1; b++ )
   {
-    for ( uint8_t i=0; i < 15; i++ )
+    sum += st.bucket[b];
+    if ( sum >= target )
     {
-      if ( cellVoltages[c_ic][i] < 0.5 )
-      {
-        errorFlag[0] = -1;
-        voltageErrorLoc[c_ic][i] = -1;
-      }
-
-      if ( cellVoltages[c_ic][i] > 6.0 )
-      {
-        errorFlag[1] = -1;
-        voltageErrorLoc[c_ic][i] = -1;
-      }
-
-      if ( (cellVoltages[c_ic][i] < underVoltageThreshold) && (cellVoltages[c_ic][i] > 0.5 ) )
-      {
-        errorFlag[2] = -1;
-        voltageErrorLoc[c_ic][i] = -1;
-      }
-
-      if ( (cellVoltages[c_ic][i] > overVoltageThreshold) && (cellVoltages[c_ic][i] < 6.0 ) )
-      {
-        errorFlag[3] = -1;
-        voltageErrorLoc[c_ic][i] = -1; 
-      }
+      uint32_t edge = (b + 1) * LATENCY_BUCKET_MS * 1000UL;
+      return edge < st.maxUs ? edge : st.maxUs;
     }
   }
+  return st.maxUs;
 }
 
-void checkTempFlag(void)
+void printLatencyStats(void)
 {
-  for ( uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+  SerialTx.println();
+  SerialTx.println("errorFlag,count,min ms,avg ms,p99 ms,max ms,last decision->pin us");
+  for ( uint8_t c = 0; c < LATENCY_CLASSES; c++ )
   {
-    for ( uint8_t i=0; i < 15; i++ )
+    const struct latencyStats &st = latency[c];
+    SerialTx.print(c);
+    SerialTx.print(",");
+    SerialTx.print(st.count);
+    if ( st.count )
     {
-      if ( cellTemperatures[c_ic][i] < 0.0 )
-      {
-        errorFlag[4] = -1;
-        tempErrorLoc[c_ic][i] = -1;
-      }
-
-      if ( cellTemperatures[c_ic][i] == 0.0 )
-      {
-        errorFlag[5] = -1;
-        tempErrorLoc[c_ic][i] = -1;
-      }
-
-      if ( (cellTemperatures[c_ic][i] > overTempThreshold) )
-      {
-        errorFlag[6] = -1;
-        tempErrorLoc[c_ic][i] = -1; 
-      }
+      SerialTx.print(",");
+      SerialTx.print(st.minUs / 1000.0, 1);
+      SerialTx.print(",");
+      SerialTx.print((double)st.sumUs / st.count / 1000.0, 1);
+      SerialTx.print(",");
+      SerialTx.print(latencyP99Us(st) / 1000.0, 1);
+      SerialTx.print(",");
+      SerialTx.print(st.maxUs / 1000.0, 1);
+      SerialTx.print(",");
+      SerialTx.print(st.lastDecisionToPinUs);
     }
+    SerialTx.println();
   }
+  SerialTx.print("max acquisition (conversion start -> read) us : volt ");
+  SerialTx.print(voltAcqMaxUs);
+  SerialTx.print(" temp ");
+  SerialTx.println(tempAcqMaxUs);
 }
 
-void triggerchargerError(void)
+void clearLatencyStats(void)
 {
-  output_voltage = (receive_msg.buf[0]*256 + receive_msg.buf[1])/10;
-  output_current = (receive_msg.buf[2]*256 + receive_msg.buf[3])/10;
- 
-  if(output_voltage>250 && chargingStarted_)
-  {
-    chargingStarted_=false;
-    chargingFlag=true;
-    delay(chgrDelay);
-    if(can3.read(receive_msg)){
-    //Serial.print("ID: 0x"); Serial.print(msg.id, HEX );
-    Serial.println(receive_msg.id, HEX);
-    Serial.print("LEN: "); Serial.println(receive_msg.len);
-    output_voltage = (receive_msg.buf[0]*256 + receive_msg.buf[1] + 1.5)/10;
-    output_current = (receive_msg.buf[2]*256 + receive_msg.buf[3])/10;
-    Serial.println("Attempting to start charging");
-    Serial.print("Output Voltage [CHARGER] : "); Serial.println(output_voltage);
-    Serial.print("Output Current [CHARGER] : "); Serial.println(output_current);
-    Serial.print("Error Byte :");
-    Serial.println(receive_msg.buf[4]);}
-    else{
-      Serial.println("Received no message from charger(2)");
-      chargerFlag = true;
-    }
-  }
-  if(output_voltage < 250 && (receive_msg.buf[4] == 8 || receive_msg.buf[4] == 24) && output_current < 1)
+  memset(latency, 0, sizeof(latency));
+  voltAcqMaxUs = 0;
+  tempAcqMaxUs = 0;
+}
+
+#ifdef faultInjection
+// overrides one measured channel with a value that raises errorFlag[injectType], right after the frame was read
+void applyFaultInjection(uint8_t type)
+{
+  if ( injectType < 0 )
+    return;
+  uint8_t c_ic = injectSlave - 1, i = injectCell - 1;
+  if ( (type == voltage) && (injectType < 4) )
   {
-   chargerFlag=false;
-   #ifndef GUI_Enabled
-   Serial.println("Connect battery");
-   printchargerError();
-   #endif
+    const double injectVolt[4] = { 0.3, 6.5, underVoltageThreshold - 0.1, overVoltageThreshold + 0.1 };
+    cellVoltages[c_ic][i] = injectVolt[injectType];
   }
-  else if(receive_msg.buf[4] != 0){
-    chargerFlag=true;
-    #ifndef GUI_Enabled
-    Serial.println("Received some error from charger check error byte");
-    printchargerError();
-    #endif
+  else if ( (type == temp) && (injectType >= 4) )
+  {
+    const double injectTemp[3] = { -5.0, 0.0, overTempThreshold + 5.0 };
+    cellTemperatures[c_ic][i] = injectTemp[injectType - 4];
   }
-  else if (output_voltage > 250 && receive_msg.buf[4] == 0 && output_current < 0.1)
+}
+#endif
+
+void deadlineLoopBegin(void)
+{
+  deadlineLoopStart = micros();
+  deadlineStageStart = deadlineLoopStart;
+}
+
+// closes "stage" (time since the end of the previous stage) and checks it against its budget
+void deadlineStageEnd(uint8_t stage)
+{
+  uint32_t now = micros();
+  uint32_t dt = now - deadlineStageStart;
+  deadlineStageStart = now;
+
+  struct stageStats &st = stageStat[stage];
+  st.lastUs = dt;
+  if ( dt > st.maxUs )
+    st.maxUs = dt;
+  if ( dt > stageBudgetUs[stage] )
   {
-    chargerFlag= true;
-    // if(chargingFlag==true)
-    // {
-    // // send_msg.flags.extended = 1;
-    // //  receive_msg.flags.extended = 1;
-    // //  send_msg.id=send_id;
-    // //  max_voltage = 0;
-    // // send_msg.buf[0]= (max_voltage)>>8;
-    // // send_msg.buf[1]= (max_voltage)%256;
-    // // send_msg.buf[2]= (max_current_without_decimal)>>8;
-    // // send_msg.buf[3]= (max_current_without_decimal)%256;
-    // // can3.write(send_msg);
-    // }
+    st.overruns++;
+    deadlineLastOverrunStage = stage;
+    deadlineLastOverrunCycle = cycleCount;
     #ifndef GUI_Enabled
-    Serial.println("Charger is ready | Voltage detected by charger | No current detected");
-    printchargerError();
+    SerialTx.print("DEADLINE : stage ");
+    SerialTx.print(stageName[stage]);
+    SerialTx.print(" took ");
+    SerialTx.print(dt);
+    SerialTx.print("us, budget ");
+    SerialTx.print(stageBudgetUs[stage]);
+    SerialTx.println("us");
     #endif
   }
-  else if (output_voltage > 250 && receive_msg.buf[4] == 0 && output_current > 1)
+}
+
+// the watchdog is fed only if the whole loop met its deadline
+void deadlineLoopEnd(void)
+{
+  uint32_t dt = micros() - deadlineLoopStart;
+  if ( dt > deadlineLoopMaxUs )
+    deadlineLoopMaxUs = dt;
+  if ( dt > LOOP_DEADLINE_MS * 1000UL )
   {
-    chargerFlag=false;
-    #ifndef GUI_Enabled
-    Serial.println("Charging ... Charging ... Charging ...");
-    #endif
+    deadlineLoopOverruns++;
+    return;
   }
-  else if (output_voltage > 250 && receive_msg.buf[4] != 0)
+  watchdogFeed();
+}
+
+void printDeadlineStats(void)
+{
+  SerialTx.println();
+  SerialTx.println("stage,last us,max us,budget us,overruns");
+  for ( uint8_t k = 0; k < STAGE_COUNT; k++ )
   {
-    chargerFlag=true;
-    #ifndef GUI_Enabled
-    Serial.println("Charging stopped due to charger error");
-    printchargerError();
-    #endif
+    SerialTx.print(stageName[k]);
+    SerialTx.print(",");
+    SerialTx.print(stageStat[k].lastUs);
+    SerialTx.print(",");
+    SerialTx.print(stageStat[k].maxUs);
+    SerialTx.print(",");
+    SerialTx.print(stageBudgetUs[k]);
+    SerialTx.print(",");
+    SerialTx.println(stageStat[k].overruns);
   }
-  else {
-    chargerFlag=true;
-    #ifndef GUI_Enabled
-    Serial.println("Entered confusing state");
-    printchargerError();
-    #endif
+  SerialTx.print("loop max us : ");
+  SerialTx.print(deadlineLoopMaxUs);
+  SerialTx.print(" , deadline : ");
+  SerialTx.print(LOOP_DEADLINE_MS * 1000UL);
+  SerialTx.print(" , overruns : ");
+  SerialTx.println(deadlineLoopOverruns);
+  if ( deadlineLastOverrunStage != 0xFF )
+  {
+    SerialTx.print("last overrun : stage ");
+    SerialTx.print(stageName[deadlineLastOverrunStage]);
+    SerialTx.print(" in cycle ");
+    SerialTx.println(deadlineLastOverrunCycle);
   }
+}
 
+#ifdef profiling
+void profileInit(void)
+{
+  ARM_DEMCR |= ARM_DEMCR_TRCENA;
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+  clearProfileStats();
+}
 
+// kept short, it runs at the end of every probe
+void profileRecord(uint8_t probe, uint32_t cycles)
+{
+  struct profileStats &st = profile[probe];
+  if ( (st.count == 0) || (cycles < st.minCyc) )
+    st.minCyc = cycles;
+  if ( cycles > st.maxCyc )
+    st.maxCyc = cycles;
+  st.sumCyc += cycles;
+  st.count++;
+  uint32_t b = cycles;
+  if ( cycles >= (1UL << PROFILE_SUB_BITS) )
+  {
+    uint8_t msb = 31 - __builtin_clz(cycles);
+    b = (msb << PROFILE_SUB_BITS) | ((cycles >> (msb - PROFILE_SUB_BITS)) & ((1UL << PROFILE_SUB_BITS) - 1));
+  }
+  if ( st.bucket[b] < 0xFFFF )
+    st.bucket[b]++;
 }
 
-void triggerError(void)
+// upper edge of the bucket holding the 99th percentile, at most maxCyc
+uint32_t profileP99Cyc(const struct profileStats &st)
 {
-  for ( uint8_t i=0; i<7; i++ )
+  uint32_t total = 0;
+  for ( uint16_t b = 0; b < PROFILE_BUCKETS; b++ )
+    total += st.bucket[b];
+  uint32_t target = (total * 99 + 99) / 100;
+  uint32_t sum = 0;
+  for ( uint16_t b = 0; b < PROFILE_BUCKETS; b++ )
   {
-    if ( errorFlag[i] == -1 )
-    { 
-      errorCheckingMode();
-      break;
+    sum += st.bucket[b];
+    if ( sum < target )
+      continue;
+    uint64_t edge = b + 1;
+    if ( b >= (1 << PROFILE_SUB_BITS) )
+    {
+      uint8_t msb = b >> PROFILE_SUB_BITS;
+      edge = (uint64_t)((1 << PROFILE_SUB_BITS) + (b & ((1 << PROFILE_SUB_BITS) - 1)) + 1) << (msb - PROFILE_SUB_BITS);
     }
+    return edge < st.maxCyc ? (uint32_t)edge : st.maxCyc;
   }
+  return st.maxCyc;
 }
 
-void triggerError_GUI(void)
+void printProfileStats(void)
 {
-  for ( uint8_t i=0; i<7; i++ )
+  const double cycPerUs = F_CPU_ACTUAL / 1.0e6;
+  SerialTx.println();
+  SerialTx.println("probe,count,min us,avg us,p99 us,max us");
+  for ( uint8_t k = 0; k < PROFILE_COUNT; k++ )
   {
-    if ( errorFlag[i] == -1 )
-    { if(enteredChecking==false){
-      errorCheckingMode();
-      break;}
-      if ( errorFlag[0] == -1 || errorFlag[1] == -1 || errorFlag[2] == -1 || errorFlag[3] == -1 )
-      {
-            voltFlag = true;
-            
-      }
-
-      if ( errorFlag[4] == -1 || errorFlag[5] == -1 || errorFlag[6] == -1 )
-      {
-           tempFlag = true;
-      }
+    const struct profileStats &st = profile[k];
+    SerialTx.print(profileName[k]);
+    SerialTx.print(",");
+    SerialTx.print(st.count);
+    if ( st.count )
+    {
+      SerialTx.print(",");
+      SerialTx.print(st.minCyc / cycPerUs, 1);
+      SerialTx.print(",");
+      SerialTx.print((double)st.sumCyc / st.count / cycPerUs, 1);
+      SerialTx.print(",");
+      SerialTx.print(profileP99Cyc(st) / cycPerUs, 1);
+      SerialTx.print(",");
+      SerialTx.print(st.maxCyc / cycPerUs, 1);
     }
+    SerialTx.println();
   }
 }
 
+void clearProfileStats(void)
+{
+  memset(profile, 0, sizeof(profile));
+}
+#endif
 
-void errorCheckingMode(void)
-{ 
-
-  enteredChecking=true;
-  if ( errorFlag[0] == -1 || errorFlag[1] == -1 || errorFlag[2] == -1 || errorFlag[3] == -1 )
-  {
-    voltagePlausibilityCheck();
-  }
+#ifdef kernelBenchmark
+void benchSaveState(void)
+{
+  memcpy(benchState.cells, cells, sizeof(cells));
+  memcpy(benchState.cells1, cells1, sizeof(cells1));
+  memcpy(benchState.cells2, cells2, sizeof(cells2));
+  memcpy(benchState.auxHigh1, auxHigh1, sizeof(auxHigh1));
+  memcpy(benchState.auxLow1, auxLow1, sizeof(auxLow1));
+  memcpy(benchState.auxHigh2, auxHigh2, sizeof(auxHigh2));
+  memcpy(benchState.auxLow2, auxLow2, sizeof(auxLow2));
+  memcpy(benchState.auxHigh, auxHigh, sizeof(auxHigh));
+  memcpy(benchState.auxLow, auxLow, sizeof(auxLow));
+  memcpy(benchState.cellVoltages, cellVoltages, sizeof(cellVoltages));
+  memcpy(benchState.cellTemperatures, cellTemperatures, sizeof(cellTemperatures));
+  benchState.maxVoltage = maxVoltage;
+  benchState.minVoltage = minVoltage;
+  benchState.maxTemp = maxTemp;
+  benchState.loopcount = loopcount;
+  benchState.BPM_ready = BPM_ready;
+}
 
-  if ( errorFlag[4] == -1 || errorFlag[5] == -1 || errorFlag[6] == -1 )
-  {
-    tempPlausibilityCheck();
-  }
+void benchRestoreState(void)
+{
+  memcpy(cells, benchState.cells, sizeof(cells));
+  memcpy(cells1, benchState.cells1, sizeof(cells1));
+  memcpy(cells2, benchState.cells2, sizeof(cells2));
+  memcpy(auxHigh1, benchState.auxHigh1, sizeof(auxHigh1));
+  memcpy(auxLow1, benchState.auxLow1, sizeof(auxLow1));
+  memcpy(auxHigh2, benchState.auxHigh2, sizeof(auxHigh2));
+  memcpy(auxLow2, benchState.auxLow2, sizeof(auxLow2));
+  memcpy(auxHigh, benchState.auxHigh, sizeof(auxHigh));
+  memcpy(auxLow, benchState.auxLow, sizeof(auxLow));
+  memcpy(cellVoltages, benchState.cellVoltages, sizeof(cellVoltages));
+  memcpy(cellTemperatures, benchState.cellTemperatures, sizeof(cellTemperatures));
+  maxVoltage = benchState.maxVoltage;
+  minVoltage = benchState.minVoltage;
+  maxTemp = benchState.maxTemp;
+  loopcount = benchState.loopcount;
+  BPM_ready = benchState.BPM_ready;
 }
 
-void voltagePlausibilityCheck(void)
+// synthetic full pack: 3.60..4.15 V cells, both chains within tolerance except every 7th cell, thermistors
+// around 25..45 degC against a 3 V reference in register 5
+void benchFillPack(void)
 {
-  double ti = millis(),delT = 0.0;
-  while( delT < voltTimer )
+  for ( uint8_t c_ic = 0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
   {
-    clearFlagsV();
-    cellVoltageLoop(0);
-    checkVoltageFlag();
-
-    if ( errorFlag[0] == -1 || errorFlag[1] == -1 || errorFlag[2] == -1 || errorFlag[3] == -1 )
+    for ( uint8_t i = 0; i < LTCDEF_CELLS_PER_CELL_MONITOR_COUNT; i++ )
     {
-      delT = millis() - ti ;
-      voltFlag = true;
+      double v = 3.60 + 0.01 * ((c_ic * 18 + i) * 7 % 56);
+      cells1[c_ic][i] = v;
+      cells2[LTCDEF_CELL_MONITOR_COUNT - c_ic - 1][i] = (i % 7 == 3) ? v - 2.0 : v - 0.002;
     }
-    else
-    { 
-      voltFlag = false;
-      break;
+    for ( uint8_t i = 0; i < LTCDEF_AUX_PER_CELL_MONITOR_COUNT; i++ )
+    {
+      double a = (i == 5) ? 3.0 : 1.2 + 0.02 * ((c_ic * 12 + i) % 17);
+      auxHigh1[c_ic][i] = a;
+      auxLow1[c_ic][i] = a + 0.01;
+      auxHigh2[LTCDEF_CELL_MONITOR_COUNT - c_ic - 1][i] = a;
+      auxLow2[LTCDEF_CELL_MONITOR_COUNT - c_ic - 1][i] = a + 0.01;
     }
   }
 }
 
-void tempPlausibilityCheck(void)
+// the stages after the conversion, as the loop runs them
+void benchFillVoltages(void)
 {
-  double ti = millis(),delT = 0.0;
-  while( delT < tempTimer )
-  {
-    clearFlagsT();
-    cellTempLoop(0);
-    checkTempFlag();
+  benchFillPack();
+  circularVoltdef();
+  cellsVoltSort();
+}
+
+void benchFillTemperatures(void)
+{
+  benchFillPack();
+  circularTempdef(true);
+  tempConvertSort(true);
+  benchFillPack();
+  circularTempdef(false);
+  tempConvertSort(false);
+}
+
+void benchFillLogging(void)
+{
+  benchFillVoltages();
+  benchFillTemperatures();
+  BPM_ready = true;
+  CellData = "";
+  CellData_GUI = "";
+}
+
+void benchVoltToTemp(void) { benchSink = voltToTemp(1.45, 3.0); }
+void benchCircularVoltdef(void) { circularVoltdef(); }
+void benchCellsVoltSort(void) { cellsVoltSort(); }
+void benchCircularTempdefHigh(void) { circularTempdef(true); }
+void benchCircularTempdefLow(void) { circularTempdef(false); }
+void benchTempConvertSortHigh(void) { tempConvertSort(true); }
+void benchTempConvertSortLow(void) { tempConvertSort(false); }
+void benchFindMaxVoltage(void) { findMax(voltage); }
+void benchFindMaxTemp(void) { findMax(temp); }
+void benchFindMin(void) { findMin(); }
+void benchCellsLogging(void) { cellsLogging(); }
+void benchAuxLogging(void) { auxLogging(); }
+void benchInitialiseEnergy(void) { benchSink = InitialiseEnergy(3.72, underVoltageThreshold); }
+
+const struct benchKernel benchKernels[] =
+{
+  { "voltToTemp", benchFillPack, benchVoltToTemp, 0 },          // inside circularTempdef, 12 per slave and mux phase
+  { "circularVoltdef", benchFillPack, benchCircularVoltdef, 1 },
+  { "cellsVoltSort", benchFillVoltages, benchCellsVoltSort, 1 },
+  { "circularTempdef mux1", benchFillPack, benchCircularTempdefHigh, 1 },
+  { "circularTempdef mux0", benchFillPack, benchCircularTempdefLow, 1 },
+  { "tempConvertSort mux1", benchFillTemperatures, benchTempConvertSortHigh, 1 },
+  { "tempConvertSort mux0", benchFillTemperatures, benchTempConvertSortLow, 1 },
+  { "findMax voltage", benchFillVoltages, benchFindMaxVoltage, 1 },
+  { "findMax temp", benchFillTemperatures, benchFindMaxTemp, 1 },
+  { "findMin", benchFillVoltages, benchFindMin, 1 },
+  { "cellsLogging", benchFillLogging, benchCellsLogging, 1 },
+  #ifndef GUI_Enabled
+  { "auxLogging", benchFillLogging, benchAuxLogging, 1 },   // prints the GUI frame with GUI_Enabled
+  #endif
+  { "InitialiseEnergy", benchFillPack, benchInitialiseEnergy, 0 },   // once after start-up
+};
 
-    if ( errorFlag[4] == -1 || errorFlag[5] == -1 || errorFlag[6] == -1 )
+#define BENCH_KERNEL_COUNT (sizeof(benchKernels) / sizeof(benchKernels[0]))
+
+void benchRun(void)
+{
+  const double cycPerUs = F_CPU_ACTUAL / 1.0e6;
+  uint32_t minCyc[BENCH_KERNEL_COUNT], maxCyc[BENCH_KERNEL_COUNT];
+  uint64_t sumCyc[BENCH_KERNEL_COUNT];
+  String savedCellData = CellData;
+  String savedCellDataGui = CellData_GUI;
+
+  ARM_DEMCR |= ARM_DEMCR_TRCENA;
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+  benchSaveState();
+  for ( size_t k = 0; k < BENCH_KERNEL_COUNT; k++ )
+  {
+    minCyc[k] = 0xFFFFFFFFUL;
+    maxCyc[k] = 0;
+    sumCyc[k] = 0;
+    for ( uint16_t n = 0; n < BENCH_ITERATIONS; n++ )
     {
-      delT = millis() - ti ;
-      tempFlag = true;
+      benchKernels[k].prepare();
+      uint32_t start = ARM_DWT_CYCCNT;
+      benchKernels[k].run();
+      uint32_t cyc = ARM_DWT_CYCCNT - start;
+      if ( cyc < minCyc[k] )
+        minCyc[k] = cyc;
+      if ( cyc > maxCyc[k] )
+        maxCyc[k] = cyc;
+      sumCyc[k] += cyc;
     }
-    else
+    watchdogFeed();
+  }
+  benchRestoreState();
+  CellData = savedCellData;
+  CellData_GUI = savedCellDataGui;
+
+  double frameUs = 0;
+  SerialTx.println();
+  SerialTx.print("build ");
+  SerialTx.print(__DATE__ " " __TIME__);
+  SerialTx.print(" , ");
+  SerialTx.print(LTCDEF_CELL_MONITOR_COUNT);
+  SerialTx.print(" slaves x ");
+  SerialTx.print(LTCDEF_CELLS_PER_SLAVE);
+  SerialTx.print(" cells , ");
+  SerialTx.print(BENCH_ITERATIONS);
+  SerialTx.println(" iterations");
+  SerialTx.println("kernel,per cycle,min us,avg us,max us");
+  for ( size_t k = 0; k < BENCH_KERNEL_COUNT; k++ )
+  {
+    double avgUs = (double)sumCyc[k] / BENCH_ITERATIONS / cycPerUs;
+    frameUs += avgUs * benchKernels[k].perFrame;
+    SerialTx.print(benchKernels[k].name);
+    SerialTx.print(",");
+    SerialTx.print(benchKernels[k].perFrame);
+    SerialTx.print(",");
+    SerialTx.print(minCyc[k] / cycPerUs, 2);
+    SerialTx.print(",");
+    SerialTx.print(avgUs, 2);
+    SerialTx.print(",");
+    SerialTx.println(maxCyc[k] / cycPerUs, 2);
+  }
+  SerialTx.print("per cycle us : ");
+  SerialTx.print(frameUs, 1);
+  SerialTx.print(" , per slave : ");
+  SerialTx.print(frameUs / LTCDEF_CELL_MONITOR_COUNT, 1);
+  SerialTx.print(" , budget : ");
+  SerialTx.print(BENCH_FRAME_BUDGET_US);
+  SerialTx.println(frameUs > BENCH_FRAME_BUDGET_US ? " , OVER BUDGET" : "");
+
+  #ifdef startLogging
+  // FILE_WRITE appends, one line per kernel and run
+  File benchFile = SD.open(BENCH_FILE_NAME, FILE_WRITE);
+  if ( benchFile )
+  {
+    for ( size_t k = 0; k < BENCH_KERNEL_COUNT; k++ )
     {
-      tempFlag = false;
-      break;
+      benchFile.print(__DATE__ " " __TIME__);
+      benchFile.print(",");
+      benchFile.print(bootNumber);
+      benchFile.print(",");
+      benchFile.print(LTCDEF_CELL_MONITOR_COUNT);
+      benchFile.print(",");
+      benchFile.print(benchKernels[k].name);
+      benchFile.print(",");
+      benchFile.print(minCyc[k]);
+      benchFile.print(",");
+      benchFile.print((uint32_t)(sumCyc[k] / BENCH_ITERATIONS));
+      benchFile.print(",");
+      benchFile.println(maxCyc[k]);
     }
+    benchFile.close();
   }
+  #endif
+}
+#endif
+
+// WDOG1 of the i.MX RT1062, clocked from the 32 kHz clock, timeout and pre-timeout in 0.5 s steps
+void watchdogInit(void)
+{
+  CCM_CCGR3 |= CCM_CCGR3_WDOG1(CCM_CCGR_ON);
+  attachInterruptVector(IRQ_WDOG1, watchdogIsr);
+  NVIC_SET_PRIORITY(IRQ_WDOG1, 0);
+  NVIC_ENABLE_IRQ(IRQ_WDOG1);
+  WDOG1_WICR = WDOG_WICR_WIE | WDOG_WICR_WTIS | WDOG_WICR_WICT(WDOG_PRETIMEOUT_MS / 500);
+  // SRS and WDA must be written as 1, 0 would trigger a software reset / assert WDOG_B
+  WDOG1_WCR = WDOG_WCR_WT(WDOG_TIMEOUT_MS / 500 - 1) | WDOG_WCR_WDE | WDOG_WCR_SRS | WDOG_WCR_WDA;
+  watchdogRunning = true;
+  watchdogFeed();
+}
+
+void watchdogFeed(void)
+{
+  if ( !watchdogRunning )
+    return;
+  WDOG1_WSR = 0x5555;
+  WDOG1_WSR = 0xAAAA;
+}
+
+// pre-timeout: the loop is stuck, fail safe before the reset
+void watchdogIsr(void)
+{
+  WDOG1_WICR |= WDOG_WICR_WTIS;
+  digitalWriteFast( BMS_FLT_3V3 , LOW );
 }
 
 void triggerInterrupt(void)
@@ -2787,8 +5306,8 @@ void triggerInterrupt(void)
   { 
     if ( voltFlag && tempFlag && chargerFlag )
     {
-      Serial.print('\n');
-      Serial.print(" Interrupted due to voltage,temperature and charger flag ");
+      SerialTx.print('\n');
+      SerialTx.print(" Interrupted due to voltage,temperature and charger flag ");
       printErrLocV();
       printErrLocT();
       //printchargerError();
@@ -2796,8 +5315,8 @@ void triggerInterrupt(void)
 
     else if ( voltFlag && tempFlag )
     {
-      Serial.print('\n');
-      Serial.print(" Interrupted due to voltage and temperature flag ");
+      SerialTx.print('\n');
+      SerialTx.print(" Interrupted due to voltage and temperature flag ");
       printErrLocT();
       printErrLocV();
       
@@ -2805,51 +5324,52 @@ void triggerInterrupt(void)
 
     else if ( voltFlag && chargerFlag )
     {
-      Serial.print('\n');
-      Serial.print(" Interrupted due to voltage and charger flag ");
+      SerialTx.print('\n');
+      SerialTx.print(" Interrupted due to voltage and charger flag ");
       printErrLocV();
       //printchargerError();
     }
 
     else if ( chargerFlag && tempFlag )
     {
-      Serial.print('\n');
-      Serial.print(" Interrupted due to temperature and charger flag ");
+      SerialTx.print('\n');
+      SerialTx.print(" Interrupted due to temperature and charger flag ");
       printErrLocT();
       //printchargerError();
     }
 
     else if (  tempFlag )
     {
-      Serial.print('\n');
-      Serial.print(" Interrupted due to temperature flag only ");
+      SerialTx.print('\n');
+      SerialTx.print(" Interrupted due to temperature flag only ");
       printErrLocT();
       
     }
 
     else if ( chargerFlag  )
     {
-      Serial.print('\n');
-      Serial.print(" Interrupted due to charger flag only ");
+      SerialTx.print('\n');
+      SerialTx.print(" Interrupted due to charger flag only ");
       
       printchargerError();
     }
 
     else if ( voltFlag  )
     {
-      Serial.print('\n');
-      Serial.print(" Interrupted due to voltage flag only ");
+      SerialTx.print('\n');
+      SerialTx.print(" Interrupted due to voltage flag only ");
       
       printErrLocV();
     }
 
-    #ifdef Interrupt_Debug
-    Interrupt_for_Debug();
-    #endif
-
-    #ifndef Interrupt_Debug
-    Interrupt();
-    #endif
+    if ( debugHoldMode )
+    {
+      Interrupt_for_Debug();
+    }
+    else
+    {
+      Interrupt();
+    }
   }
 }
 
@@ -2858,31 +5378,32 @@ void triggerInterrupt_GUI(void)
   bmsFlag = voltFlag || tempFlag;
   if(voltFlag && tempFlag)
   {
-    Serial.println("0,0,1,0,");
+    SerialTx.println("0,0,1,0,");
   }
   else if(voltFlag)
   {
-    Serial.println("1,0,0,0,");
+    SerialTx.println("1,0,0,0,");
   }
   else if(tempFlag)
   {
-    Serial.println("0,1,0,0,");
+    SerialTx.println("0,1,0,0,");
   }
   else
   {
-    Serial.println("0,0,0,0,");
+    SerialTx.println("0,0,0,0,");
   }
 
   if(bmsFlag || chargerFlag)
   {
 
-    #ifdef Interrupt_Debug
-    Interrupt_for_Debug();
-    #endif
-
-    #ifndef Interrupt_Debug
-    Interrupt();
-    #endif  
+    if ( debugHoldMode )
+    {
+      Interrupt_for_Debug();
+    }
+    else
+    {
+      Interrupt();
+    }
   }
 }
 
@@ -2891,8 +5412,8 @@ void showError(void)
 {
   if ( voltFlag && tempFlag )
     {
-      Serial.print('\n');
-      Serial.print(" Interrupted due to voltage and temperature flag ");
+      SerialTx.print('\n');
+      SerialTx.print(" Interrupted due to voltage and temperature flag ");
       printErrLocT();
       printErrLocV();
       
@@ -2901,16 +5422,16 @@ void showError(void)
   
   else if (  tempFlag )
     {
-      Serial.print('\n');
-      Serial.print(" Interrupted due to temperature flag only ");
+      SerialTx.print('\n');
+      SerialTx.print(" Interrupted due to temperature flag only ");
       printErrLocT();
       
     }
 
   else if ( voltFlag  )
     {
-      Serial.print('\n');
-      Serial.print(" Interrupted due to voltage flag only ");
+      SerialTx.print('\n');
+      SerialTx.print(" Interrupted due to voltage flag only ");
       
       printErrLocV();
     }  
@@ -2919,30 +5440,22 @@ void showError(void)
 
 void Interrupt_for_Debug(void)
 {
-  bool error_received = false;
-  char input = 0;
-  while (input != 'r' )
+  // latch the fault, it is released by the 'r' console command (see serviceConsole)
+  if ( !debugHoldActive )
   {
-    digitalWriteFast( BMS_FLT_3V3 , LOW );               
-    switchErrorLed();
-    if (input == 's' && (error_received==false))
-    {
-      printCells();
-      printAux();
-      showError();
-      error_received =true;
-    }
-    if (Serial.available() > 0)
-    {
-      input = read_char();
-    } 
-    delay(100); 
+    debugHoldActive = true;
+    SerialTx.println();
+    SerialTx.println("DEBUG HOLD : BMS_FLT_3V3 latched low, 's' to show, 'r' to release");
   }
+  digitalWriteFast( BMS_FLT_3V3 , LOW );               
+  latencyPinAsserted();
+  switchErrorLed();
 }
 
 void Interrupt(void)
 {
   digitalWriteFast( BMS_FLT_3V3 , LOW );               
+  latencyPinAsserted();
   switchErrorLed();
 }
 
@@ -2985,7 +5498,7 @@ void switchErrorLed(void)
 
 void pull_3V3_high(void)
 {
-  if(bmsFlag==false)
+  if(bmsFlag==false && debugHoldActive==false)
   {
   digitalWriteFast(BMS_FLT_3V3,HIGH);
   }
@@ -3007,40 +5520,11 @@ void clearFlags(void)
 
   for ( uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
   {
-    for ( uint8_t i=0; i < 15; i++ )
-    {
-      voltageErrorLoc[c_ic][i] = 0;
-      tempErrorLoc[c_ic][i] = 0;
-    }
-  }
-}
-
-void clearFlagsV(void)
-{
-  for ( uint8_t i=0; i < 4; i++ )
-  {
-    errorFlag[i] = 0;
-  }
-
-  for ( uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
-  {
-    for ( uint8_t i=0; i < 15; i++ )
+    for ( uint8_t i=0; i < LTCDEF_CELLS_PER_SLAVE; i++ )
     {
       voltageErrorLoc[c_ic][i] = 0;
     }
-  }
-}
-
-void clearFlagsT(void)
-{
-  for ( uint8_t i=4; i < 7; i++ )
-  {
-    errorFlag[i] = 0;
-  }
-
-  for ( uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
-  {
-    for ( uint8_t i=0; i < 15; i++ )
+    for ( uint8_t i=0; i < LTCDEF_TEMPS_PER_SLAVE; i++ )
     {
       tempErrorLoc[c_ic][i] = 0;
     }
@@ -3051,17 +5535,17 @@ void printErrLocV(void)
 {
   for (uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
   {
-    Serial.println();
-    Serial.print("IC : ");
-    Serial.print(c_ic+1);
+    SerialTx.println();
+    SerialTx.print("IC : ");
+    SerialTx.print(c_ic+1);
 
-    for (uint8_t i=0; i < 15; i++ )
+    for (uint8_t i=0; i < cellsPerStack[c_ic]; i++ )
     {
-      Serial.print(" C");
-      Serial.print(i+1);
-      Serial.print(":");
-      Serial.print(voltageErrorLoc[c_ic][i]);
-      Serial.print(",");
+      SerialTx.print(" C");
+      SerialTx.print(i+1);
+      SerialTx.print(":");
+      SerialTx.print(voltageErrorLoc[c_ic][i]);
+      SerialTx.print(",");
     }
   }
 }
@@ -3070,55 +5554,58 @@ void printErrLocT(void)
 {
   for (uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
   {
-    Serial.println();
-    Serial.print("IC : ");
-    Serial.print(c_ic+1);
+    SerialTx.println();
+    SerialTx.print("IC : ");
+    SerialTx.print(c_ic+1);
 
-    for (uint8_t i=0; i < 15; i++ )
+    for (uint8_t i=0; i < tempsPerStack[c_ic]; i++ )
     {
-      Serial.print(" T");
-      Serial.print(i+1);
-      Serial.print(":");
-      Serial.print(tempErrorLoc[c_ic][i]);
-      Serial.print(",");
+      SerialTx.print(" T");
+      SerialTx.print(i+1);
+      SerialTx.print(":");
+      SerialTx.print(tempErrorLoc[c_ic][i]);
+      SerialTx.print(",");
     }
   }
 }
 
 void printchargerError(void)
 {
-  Serial.println("");
-  Serial.print("Charger Error Byte:");
-  Serial.println(receive_msg.buf[4]);
+  SerialTx.println("");
+  SerialTx.print("Charger Error Byte:");
+  SerialTx.println(receive_msg.buf[4]);
       if (receive_msg.buf[4] == 1)
-      Serial.println("Status: Hardware Failure"); 
+      SerialTx.println("Status: Hardware Failure"); 
       if (receive_msg.buf[4] == 2)
-      Serial.println("Status: Charger overheated"); 
+      SerialTx.println("Status: Charger overheated"); 
       if (receive_msg.buf[4] == 4)
-      Serial.println("Status: Incorrect Input Voltage"); 
+      SerialTx.println("Status: Incorrect Input Voltage"); 
       if (receive_msg.buf[4] == 8)
-      Serial.println("Status: Battery Disconnected"); 
+      SerialTx.println("Status: Battery Disconnected"); 
       if (receive_msg.buf[4] == 16)
-      Serial.println("Status: Communication failed");
+      SerialTx.println("Status: Communication failed");
       if (receive_msg.buf[4] == 12)
-      Serial.println("Status: Battery disconnected and incorrect input voltage");
+      SerialTx.println("Status: Battery disconnected and incorrect input voltage");
       if (receive_msg.buf[4] == 24)
-      Serial.println("Status: Battery disconnected and communication failed");
+      SerialTx.println("Status: Battery disconnected and communication failed");
 }
 
 void initialiseNormalizeChannel(void)
 {
   for (uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
   {
-    for (uint8_t i=0; i < 15; i++ )
+    for (uint8_t i=0; i < LTCDEF_CELLS_PER_SLAVE; i++ )
     {
       voltageNormalize[c_ic][i] = 0;
+    }
+    for (uint8_t i=0; i < LTCDEF_TEMPS_PER_SLAVE; i++ )
+    {
       tempNormalize[c_ic][i] = 0;
     }
   }
 }
 
-void setNormalizeChannels(uint8_t ic , uint16_t * vChannels, uint16_t * tChannels )
+void setNormalizeChannels(uint32_t ic , const uint32_t * vChannels, const uint32_t * tChannels )
 {
   for (int c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
   {
@@ -3129,9 +5616,9 @@ void setNormalizeChannels(uint8_t ic , uint16_t * vChannels, uint16_t * tChannel
   }  
 }
 
-void setNormalizeFlag( uint8_t nic, uint16_t voltChannels, uint16_t tempChannels )
+void setNormalizeFlag( uint8_t nic, uint32_t voltChannels, uint32_t tempChannels )
 {
-  for ( int i=0; i < 15; i++ )
+  for ( int i=0; i < LTCDEF_CELLS_PER_SLAVE; i++ )
   {
     if( (voltChannels >> i) & 1 )
     {
@@ -3139,7 +5626,7 @@ void setNormalizeFlag( uint8_t nic, uint16_t voltChannels, uint16_t tempChannels
     }
   }
 
-  for ( int i=0; i < 15; i++ )
+  for ( int i=0; i < LTCDEF_TEMPS_PER_SLAVE; i++ )
   {
     if( (tempChannels >> i) & 1 )
     {
@@ -3152,7 +5639,7 @@ void checkVoltNormalize(void)
 {
   for (int c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
   {
-    for ( int i=0; i<15; i++ )
+    for ( int i=0; i<LTCDEF_CELLS_PER_SLAVE; i++ )
     {
       if ( voltageNormalize[c_ic][i] == -1 )
       {
@@ -3166,7 +5653,7 @@ void checkTempNormalize(void)
 {
   for (int c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
   {
-    for ( int i=0; i<15; i++ )
+    for ( int i=0; i<LTCDEF_TEMPS_PER_SLAVE; i++ )
     {
       if ( tempNormalize[c_ic][i] == -1 )
       {
@@ -3180,14 +5667,14 @@ void initialiseSplitChannel(void)
 {
   for ( uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
   {
-    for ( uint8_t i=0; i<15; i++ )
+    for ( uint8_t i=0; i<LTCDEF_CELLS_PER_SLAVE; i++ )
     {
       voltageSplit[c_ic][i] = 0;
     }
   }
 }
 
-void setVoltSplitChannels(uint8_t ic, uint16_t * channels )
+void setVoltSplitChannels(uint32_t ic, const uint32_t * channels )
 {
   for ( int c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
   {
@@ -3198,9 +5685,9 @@ void setVoltSplitChannels(uint8_t ic, uint16_t * channels )
   }
 }
 
-void setVoltSplitFlag( uint8_t nic, uint16_t channels )
+void setVoltSplitFlag( uint8_t nic, uint32_t channels )
 {
-  for ( int i=0; i < 15; i++ )
+  for ( int i=0; i < LTCDEF_CELLS_PER_SLAVE; i++ )
   {
     if( (channels >> i) & 1 )              
     {
@@ -3213,7 +5700,7 @@ void checkVoltSplit(void)
 {
   for ( uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
   {
-    for ( uint8_t i=0; i<15; i++ )
+    for ( uint8_t i=0; i<LTCDEF_CELLS_PER_SLAVE; i++ )
     {
       if( voltageSplit[c_ic][i] == -1 )      // set split flag for right channel among the two channels of a split
       {
@@ -3242,31 +5729,61 @@ void checkACUsignalStatus(void)
   }
 }
 
+// PI control of the fan duty on the hottest thermistor, once per loop after findMax(), with a feed-forward from the
+// filtered I^2 of the pack current so the fans speed up with the load before the cells warm up.
+// Anti-windup by conditional integration: the integral is frozen while the output is saturated in the error direction.
+// Faults and temperature trend warnings run the fans at full duty.
 void performDynamicCooling(void)
 {
+  uint32_t now = millis();
+  float dt = (now - fanLastMs) / 1000.0f;
+  fanLastMs = now;
+  if ( dt > 5 )
+    dt = 5;     // first call or a stalled loop, do not let the integral jump
+
+  float k = dt / FAN_FF_TAU_S;
+  float i = batCurrPower_num[0];
+  fanCurrentSq += (i * i - fanCurrentSq) * k;
+  float ff = fanCurrentSq / (FAN_FF_FULL_A * FAN_FF_FULL_A);
+
+  float t = maxTemp.val;
+  #ifdef predictiveCooling
+  if ( maxTempRate.val > 0 )
+    t += maxTempRate.val * FAN_PREDICT_MIN;
+  #endif
+  float e = t - dynamicCoolingThreshold;
 
-if (flag_fan == 0) {
-    if (maxTemp.val <= 35)
-        digitalWriteFast(FAN_MBED, LOW);
-    else {
-        digitalWriteFast(FAN_MBED, HIGH);
-        flag_fan = 1;
-    }
-}
-else {
-    if (maxTemp.val > 33)
-        digitalWriteFast(FAN_MBED, HIGH);
-    else {
-        digitalWriteFast(FAN_MBED, LOW);
-        flag_fan = 0;
-    }
-}
+  float u = ff + FAN_KP * e + fanIntegral;
+  if ( !((u >= 1.0f) && (e > 0)) && !((u <= 0.0f) && (e < 0)) )
+  {
+    fanIntegral += FAN_KI * e * dt;
+    if ( fanIntegral > 1.0f ) fanIntegral = 1.0f;
+    if ( fanIntegral < -1.0f ) fanIntegral = -1.0f;
+    u = ff + FAN_KP * e + fanIntegral;
+  }
+  if ( tempFlag || tempTrendWarn )
+    u = 1.0f;
+  if ( u > 1.0f ) u = 1.0f;
+  if ( u < (fanDuty > 0 ? FAN_MIN_DUTY : FAN_START_DUTY) )
+    u = 0;
+
+  fanDuty = u;
+  analogWrite(FAN_MBED, (int)(u * FAN_PWM_MAX + 0.5f));
 
+  #ifndef GUI_Enabled
+  SerialTx.print("FAN : ");
+  SerialTx.print(fanDuty * 100, 0);
+  SerialTx.print("% (T ");
+  SerialTx.print(t, 1);
+  SerialTx.print("degC, feed-forward ");
+  SerialTx.print(ff * 100, 0);
+  SerialTx.println("%)");
+  #endif
 }
 
-void findMax(double array[LTCDEF_CELL_MONITOR_COUNT][15], uint8_t type)
+void findMax(uint8_t type)
 {
-  double max = array[0][0];
+  double max = type == voltage ? cellVoltages[0][0] : cellTemperatures[0][0];
   uint8_t sLoc=0, cLoc=0;
    if ( type == voltage ){
   for ( uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
@@ -3274,9 +5791,9 @@ void findMax(double array[LTCDEF_CELL_MONITOR_COUNT][15], uint8_t type)
     for ( uint8_t i=0; i<cellsPerStack[c_ic]; i++ )
     {
       if(voltageNormalize[c_ic][i]!=-1){
-      if ( array[c_ic][i] > max )
+      if ( cellVoltages[c_ic][i] > max )
       {
-        max = array[c_ic][i];
+        max = cellVoltages[c_ic][i];
         sLoc = c_ic;
         cLoc = i;
       }
@@ -3291,12 +5808,12 @@ void findMax(double array[LTCDEF_CELL_MONITOR_COUNT][15], uint8_t type)
   if ( type == temp )
   {for ( uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
   {
-    for ( uint8_t i=0; i<cellsPerStack[c_ic]; i++ )
+    for ( uint8_t i=0; i<tempsPerStack[c_ic]; i++ )
     {
       if(tempNormalize[c_ic][i]!=-1){
-      if ( array[c_ic][i] > max )
+      if ( cellTemperatures[c_ic][i] > max )
       {
-        max = array[c_ic][i];
+        max = cellTemperatures[c_ic][i];
         sLoc = c_ic;
         cLoc = i;
       }
@@ -3309,17 +5826,17 @@ void findMax(double array[LTCDEF_CELL_MONITOR_COUNT][15], uint8_t type)
   }
 }
 
-void findMin(double array[LTCDEF_CELL_MONITOR_COUNT][15])
+void findMin(void)
 {
-  double min = array[0][0];
+  double min = cellVoltages[0][0];
   uint8_t sLoc=0, cLoc=0;
   for ( uint8_t c_ic=0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
   {
     for ( uint8_t i=0; i<cellsPerStack[c_ic]; i++ )
     {if(voltageNormalize[c_ic][i]!=-1){
-      if ( array[c_ic][i] < min )
+      if ( cellVoltages[c_ic][i] < min )
       {
-        min = array[c_ic][i];
+        min = cellVoltages[c_ic][i];
         sLoc = c_ic;
         cLoc = i;
       }
@@ -3334,40 +5851,41 @@ void findMin(double array[LTCDEF_CELL_MONITOR_COUNT][15])
 
 void printMaxMinParameters(void)
 {
-  Serial.println();
-
-  Serial.print(" Max Voltage : ");
-  Serial.print(maxVoltage.val , 4);
-  Serial.print("  Location --> ");
-  Serial.print("S");
-  Serial.print(maxVoltage.slaveLoc);
-  Serial.print("C");
-  Serial.print(maxVoltage.cellLoc);
+  SerialTx.println();
+
+  SerialTx.print(" Max Voltage : ");
+  SerialTx.print(maxVoltage.val , 4);
+  SerialTx.print("  Location --> ");
+  SerialTx.print("S");
+  SerialTx.print(maxVoltage.slaveLoc);
+  SerialTx.print("C");
+  SerialTx.print(maxVoltage.cellLoc);
   
-  Serial.println();
+  SerialTx.println();
   
-  Serial.print(" Max Temperature : ");
-  Serial.print(maxTemp.val , 4);
-  Serial.print("  Location --> ");
-  Serial.print("S");
-  Serial.print(maxTemp.slaveLoc);
-  Serial.print("C");
-  Serial.print(maxTemp.cellLoc);
-
-  Serial.println();
+  SerialTx.print(" Max Temperature : ");
+  SerialTx.print(maxTemp.val , 4);
+  SerialTx.print("  Location --> ");
+  SerialTx.print("S");
+  SerialTx.print(maxTemp.slaveLoc);
+  SerialTx.print("C");
+  SerialTx.print(maxTemp.cellLoc);
+
+  SerialTx.println();
   
-  Serial.print(" Min Voltage : ");
-  Serial.print(minVoltage.val , 4);
-  Serial.print("  Location --> ");
-  Serial.print("S");
-  Serial.print(minVoltage.slaveLoc);
-  Serial.print("C");
-  Serial.print(minVoltage.cellLoc);
+  SerialTx.print(" Min Voltage : ");
+  SerialTx.print(minVoltage.val , 4);
+  SerialTx.print("  Location --> ");
+  SerialTx.print("S");
+  SerialTx.print(minVoltage.slaveLoc);
+  SerialTx.print("C");
+  SerialTx.print(minVoltage.cellLoc);
 }
 
 
 void SDcardLogging(void)
 {
+  PROFILE_SCOPE(PROFILE_SD);
   dataFile.println(CellData);
   // Serial.println();
   // Serial.println(CellData);
@@ -3385,18 +5903,19 @@ void initialiseSDcard(void)
   
   int eeprom_value = EEPROM.read(0);
   eeprom_value++;
-  Serial.println(eeprom_value);
+  SerialTx.println(eeprom_value);
   EEPROM.write(0,eeprom_value);
+  bootNumber = eeprom_value;
   #ifndef GUI_Enabled
   
-   Serial.print("Initializing SD card...");
+   SerialTx.print("Initializing SD card...");
   // make sure that the default chip select pin is set to
   // output, even if you don't use it:
 
   // see if the card is present and can be initialized:
   if (!SD.begin(chipSelect)) 
   {
-     Serial.println("Card failed, or not present");
+     SerialTx.println("Card failed, or not present");
     // don't do anything more:
     // while (1) ;
   }
@@ -3410,24 +5929,63 @@ void initialiseSDcard(void)
   #ifndef GUI_Enabled
   if (! dataFile) 
   {
-    Serial.println("error opening file");
+    SerialTx.println("error opening file");
     // Wait forever since we cant write data
     // while (1) ;
   }
   #endif
+
+  String faultFileName = "AMSFaults" + String(eeprom_value) + ".txt";
+  faultFile = SD.open(faultFileName.c_str(), FILE_WRITE);
+  if ( faultFile )
+  {
+    faultFile.println("boot,time ms,cycle,event,errorFlag,slave,cell,value");
+    faultFile.flush();
+  }
 }
 void initCAN(void) {
     Can2.begin();
-    Can2.setBaudRate(250000);  // Set baud rate to 500kbps
+    Can2.setBaudRate(ECU_CAN_BAUDRATE);
+    canTxLastService = micros();
 }
 
 void initialiseCAN(void)
 {
   can3.begin();
   can3.setBaudRate(250000);
-//  can.enableFIFO(); //enabling FIFO
-//  can.enableFIFOInterrupt(); //all FIFO interrupt enabled
-//  can.onReceive(read_update);
+  can3.enableFIFO(); //enabling FIFO
+  can3.enableFIFOInterrupt(); //all FIFO interrupt enabled
+  can3.setFIFOFilter(REJECT_ALL);
+  can3.setFIFOFilter(0, receive_id, EXT); // only the charger status frame is of interest
+  can3.onReceive(chargerReceive);
+  // Note: can3.events() is never called, so FlexCAN_T4 fires chargerReceive directly from the interrupt
+}
+
+void chargerReceive(const CAN_message_t &msg)
+{
+  if ( msg.id != receive_id )
+    return;
+  memcpy((void *)&chargerRx.msg, &msg, sizeof(CAN_message_t));
+  chargerRx.rxMillis = millis();
+  chargerRx.count++;
+}
+
+// copies the latest charger status to receive_msg, true if it is not older than CHARGER_RX_TIMEOUT_MS
+bool chargerStatusSnapshot(void)
+{
+  __disable_irq();
+  uint32_t count = chargerRx.count;
+  uint32_t rxMillis = chargerRx.rxMillis;
+  memcpy(&receive_msg, (const void *)&chargerRx.msg, sizeof(CAN_message_t));
+  __enable_irq();
+
+  if ( count == 0 )
+  {
+    chargerRxAge = 0xFFFFFFFF;
+    return false;
+  }
+  chargerRxAge = millis() - rxMillis;
+  return chargerRxAge < CHARGER_RX_TIMEOUT_MS;
 }
 
 void initialiseFlags(void)
@@ -3439,44 +5997,322 @@ void initialiseFlags(void)
 }
 
 
+size_t SerialTxQueue::write(uint8_t c)
+{
+  return write(&c, 1);
+}
+
+size_t SerialTxQueue::write(const uint8_t * data, size_t len)
+{
+  uint32_t h = head;
+  uint32_t fill = h - tail;
+  if ( len > SERIAL_TX_QUEUE_SIZE - fill )
+  {
+    droppedBytes += len;
+    droppedWrites++;
+    return 0;
+  }
+  for ( size_t i = 0; i < len; i++ )
+  {
+    buf[(h + i) & (SERIAL_TX_QUEUE_SIZE - 1)] = data[i];
+  }
+  head = h + len;           // publish only after the data is in place
+  if ( fill + len > highWater )
+  {
+    highWater = fill + len;
+  }
+  return len;
+}
+
+void serialTxDrain(void)
+{
+  PROFILE_SCOPE(PROFILE_SERIAL);
+  uint32_t pending = SerialTx.used();
+  if ( pending == 0 )
+    return;
+
+  int room = Serial.availableForWrite();   // never write more than fits, Serial.write would block otherwise
+  if ( room <= 0 )
+    return;
+
+  uint32_t n = pending;
+  if ( n > (uint32_t)room ) n = room;
+  if ( n > SERIAL_TX_DRAIN_MAX ) n = SERIAL_TX_DRAIN_MAX;
+
+  uint32_t t = SerialTx.tail;
+  uint32_t idx = t & (SERIAL_TX_QUEUE_SIZE - 1);
+  uint32_t firstPart = SERIAL_TX_QUEUE_SIZE - idx;  // bytes until the end of the ring
+  if ( firstPart > n ) firstPart = n;
+
+  Serial.write(&SerialTx.buf[idx], firstPart);
+  if ( n > firstPart )
+  {
+    Serial.write(&SerialTx.buf[0], n - firstPart);
+  }
+  SerialTx.tail = t + n;
+}
+
+// SerialTx versions of PrintComma(), PrintOkErr() and SerialPrintByteArrayHex() of ltcmuc_tools,
+// the library ones write to Serial directly and would tear lines that are queued in SerialTx
+void serialTxComma(void)
+{
+  SerialTx.print(',');
+}
+
+void serialTxOkErr(byte error)
+{
+  if ( error )
+  {
+    SerialTx.print(F("ERR:0x"));
+    SerialTx.println(error, HEX);
+  }
+  else
+    SerialTx.println(F("OK"));
+}
+
+void serialTxByteArrayHex(byte * data, int len, bool withPrefix)
+{
+  if ( withPrefix )
+    SerialTx.print(F("0x"));
+  for ( int i = 0; i < len; i++ )
+  {
+    if ( data[i] < 0x10 )
+      SerialTx.print('0');
+    SerialTx.print(data[i], HEX);
+  }
+}
+
+void printSerialTxStats(void)
+{
+  // only report when something new got lost, the report itself goes through the queue as well
+  if ( SerialTx.droppedBytes == reportedDroppedBytes )
+    return;
+  reportedDroppedBytes = SerialTx.droppedBytes;
+  SerialTx.print("SERIAL TX DROPPED : ");
+  SerialTx.print(SerialTx.droppedBytes);
+  SerialTx.print(" bytes in ");
+  SerialTx.print(SerialTx.droppedWrites);
+  SerialTx.print(" writes, queue high water ");
+  SerialTx.print(SerialTx.highWater);
+  SerialTx.println(" bytes");
+}
+
 int8_t read_char()
 {
-  read_data();
+  if ( read_data() == 0 )
+    return 0;
   return(ui_buffer[0]);
 }
 
+// non-blocking: consumes only the characters already received and returns
+// the line length once CR or LF arrived, 0 while the line is still incomplete
 uint8_t read_data()
 {
-  uint8_t index = 0; //index to hold current location in ui_buffer
-  int c; // single character used to store incoming keystrokes
-  while (index < UI_BUFFER_SIZE-1)
+  while ( Serial.available() > 0 )
   {
-    c = Serial.read(); //read one character
-    if (((char) c == '\r') || ((char) c == '\n')) break; // if carriage return or linefeed, stop and return data
-    if ( ((char) c == '\x7F') || ((char) c == '\x08') )   // remove previous character (decrement index) if Backspace/Delete key pressed      index--;
+    int c = Serial.read(); //read one character
+    if ( (char) c == '\n' && ui_lastWasCR )   // LF following a CR belongs to the same line end
+    {
+      ui_lastWasCR = false;
+      continue;
+    }
+    ui_lastWasCR = ((char) c == '\r');
+    if (((char) c == '\r') || ((char) c == '\n')) // if carriage return or linefeed, stop and return data
+    {
+      uint8_t len = ui_index;
+      ui_buffer[ui_index] = '\0';  // terminate string with NULL
+      ui_index = 0;
+      if ( len > 0 )
+        return len;
+    }
+    else if ( ((char) c == '\x7F') || ((char) c == '\x08') )   // remove previous character if Backspace/Delete key pressed
     {
-      if (index > 0) index--;
+      if (ui_index > 0) ui_index--;
     }
-    else if (c >= 0)
+    else if ( (c >= 0) && (ui_index < UI_BUFFER_SIZE-1) )
     {
-      ui_buffer[index++]=(char) c; // put character into ui_buffer
+      ui_buffer[ui_index++]=(char) c; // put character into ui_buffer
     }
   }
-  ui_buffer[index]='\0';  // terminate string with NULL
+  return 0;
+}
+
+void serviceConsole(void)
+{
+  if ( read_data() > 0 )
+  {
+    executeConsoleCommand(ui_buffer);
+  }
+}
 
-  if ((char) c == '\r')    // if the last character was a carriage return, also clear linefeed if it is next characterde
+void executeConsoleCommand(char * line)
+{
+  SerialTx.println();
+  switch ( line[0] )
   {
-    delay(10);  // allow 10ms for linefeed to appear on serial pins
-    if (Serial.peek() == '\n') Serial.read(); // if linefeed appears, read it and throw it away
+    case 's':
+      printCells();
+      printAux();
+      showError();
+      break;
+    case 'c':
+      printCells();
+      break;
+    case 'a':
+      printAux();
+      break;
+    case 'e':
+      showError();
+      printErrLocV();
+      printErrLocT();
+      break;
+    case 'd':
+      printDeadlineStats();
+      break;
+    case 'b':
+      printBalance();
+      break;
+    #ifdef kernelBenchmark
+    case 'k':
+      benchRun();
+      break;
+    #endif
+    #ifdef profiling
+    case 'p':
+      if ( line[1] == 'c' )
+      {
+        clearProfileStats();
+        SerialTx.println("Profile statistics cleared");
+      }
+      else
+      {
+        printProfileStats();
+      }
+      break;
+    #endif
+    #ifdef simulatedChain
+    case 'x':
+      simConsoleCommand(line + 1);
+      break;
+    #endif
+    case 'l':
+      if ( line[1] == 'c' )
+      {
+        clearLatencyStats();
+        SerialTx.println("Latency statistics cleared");
+      }
+      else
+      {
+        printLatencyStats();
+      }
+      break;
+    #ifdef faultInjection
+    case 'f':
+      if ( (line[1] >= '0') && (line[1] < '0' + LATENCY_CLASSES) )
+      {
+        char * end;
+        injectType = line[1] - '0';
+        injectSlave = strtol(line + 2, &end, 10);
+        injectCell = strtol(end, &end, 10);
+        if ( (injectSlave < 1) || (injectSlave > LTCDEF_CELL_MONITOR_COUNT) || (injectCell < 1) || (injectCell > (injectType < 4 ? cellsPerStack[injectSlave - 1] : tempsPerStack[injectSlave - 1])) )
+        {
+          injectType = -1;
+          SerialTx.println("usage: f<type 0-6> <slave> <cell>");
+          break;
+        }
+        SerialTx.print("Injecting fault type ");
+        SerialTx.print(injectType);
+        SerialTx.print(" at Slave ");
+        SerialTx.print(injectSlave);
+        SerialTx.print(" Cell ");
+        SerialTx.println(injectCell);
+      }
+      else
+      {
+        injectType = -1;
+        SerialTx.println("Fault injection stopped");
+      }
+      break;
+    #endif
+    case 'j':
+      if ( line[1] == 'c' )
+      {
+        faultJournalClear();
+        SerialTx.println("Fault journal cleared");
+      }
+      else
+      {
+        printFaultJournal();
+      }
+      break;
+    case 'r':
+      // release the debug hold and clear all latched flags, they are re-evaluated with the next measurement
+      debugHoldActive = false;
+      clearFlags();
+      chargerFlag = false;
+      if ( (chargerState == CHARGER_FAULT) || (chargerState == CHARGER_COMPLETE) )
+        chargerSetState(CHARGER_IDLE);
+      switchErrorLed();
+      SerialTx.println("Faults cleared");
+      break;
+    case 'm':
+      if ( line[1] == ' ' ) line++;
+      if ( line[1] == 'd' )
+      {
+        debugHoldMode = true;
+        SerialTx.println("Mode : debug hold");
+      }
+      else if ( line[1] == 'n' )
+      {
+        debugHoldMode = false;
+        debugHoldActive = false;
+        SerialTx.println("Mode : normal");
+      }
+      else
+      {
+        SerialTx.print("Mode : ");
+        SerialTx.println(debugHoldMode ? "debug hold" : "normal");
+      }
+      break;
+    default:
+      printConsoleHelp();
+      break;
   }
+  SerialTx.println();
+}
 
-  return index; // return number of characters, not including null terminator
+void printConsoleHelp(void)
+{
+  SerialTx.println("Commands:");
+  SerialTx.println(" s  show cells, temperatures and errors");
+  SerialTx.println(" c  show cell voltages");
+  SerialTx.println(" a  show cell temperatures");
+  SerialTx.println(" e  show error locations");
+  SerialTx.println(" j  show fault journal, jc clear it");
+  SerialTx.println(" d  show loop stage timing / deadline overruns");
+  SerialTx.println(" b  show balancing cells (B) and cells waiting for the thermal budget (w)");
+  SerialTx.println(" l  show fault latency statistics, lc clear them");
+  #ifdef kernelBenchmark
+  SerialTx.println(" k  benchmark the processing functions on a synthetic pack (blocks the loop, appended to " BENCH_FILE_NAME ")");
+  #endif
+  #ifdef profiling
+  SerialTx.println(" p  show cycle count profile per probe (min / avg / p99 / max), pc clear it");
+  #endif
+  #ifdef faultInjection
+  SerialTx.println(" f<type> <slave> <cell>  inject an errorFlag[type] fault (e.g. f3 1 5), f stop");
+  #endif
+  #ifdef simulatedChain
+  SerialTx.println(" x  show simulation, xi <A> current, xv <slave> <cell> <V>, xt <slave> <sensor> <degC> (0 = all),");
+  SerialTx.println("    xp <%> PEC errors, xb <n> break the link behind slave n (0 repair), xc <us> conversion time");
+  #endif
+  SerialTx.println(" r  clear faults / release debug hold");
+  SerialTx.println(" md debug hold mode, mn normal mode, m show mode");
 }
 
 byte ReadPrintCellVoltages(uint16_t rdcv, uint16_t * cellMonDat)
 {
 	// in case LTC2949 is parallel to the daisychain, we now read only the cell voltages
-	byte error = LTC2949_68XX_RdCells(rdcv, cellMonDat);
+	byte error = HAL_RdCells(rdcv, cellMonDat);
 	PrintCellVoltages(cellMonDat, true);
 	return error;
 }
@@ -3484,7 +6320,7 @@ byte ReadPrintCellVoltages(uint16_t rdcv, uint16_t * cellMonDat)
 byte ReadPrintAuxVoltages(uint16_t rdaux, uint16_t * cellMonDat)
 {
 	// in case LTC2949 is parallel to the daisychain, we now read only the cell voltages
-	byte error = LTC2949_68XX_RdAux(rdaux, cellMonDat);
+	byte error = HAL_RdAux(rdaux, cellMonDat);
 	PrintAuxVoltages(cellMonDat, true);
 	return error;
 }
@@ -3499,6 +6335,9 @@ the isoSPI interface while measurement is running.
 ***********************************************************************/
 byte ChkDeviceStatCfg()
 {
+#ifdef simulatedChain
+	return 0; // the simulated LTC2949 is always configured
+#endif
 	byte error;
 	byte data[10];
 	byte dataOthers;
@@ -3519,23 +6358,23 @@ byte ChkDeviceStatCfg()
 	if (expChkFailed)
 	{
 		error = LTC2949_ERRCODE_OTHER; // STATUS (EXT)FAULTS, ALERT check failed
-		SerialPrintByteArrayHex(data, 10, true); // report the status
-		PrintComma();
+		serialTxByteArrayHex(data, 10, true); // report the status
+		serialTxComma();
 		return LTC2949_ERRCODE_OTHER;
 	}
 
 	// check BRCEN bit
-	if (err_detected(error = LTC2949_READ(LTC2949_REG_REGSCTRL, 1, &dataOthers)))
+	if (err_detected(error = HAL_READ(LTC2949_REG_REGSCTRL, 1, &dataOthers)))
 		return error; // PEC error
 	if (bitMaskSetClrChk(dataOthers, LTC2949_BM_REGSCTRL_BCREN, !LTC2949_onTopOfDaisychain))
 		return LTC2949_ERRCODE_OTHER; // BRCEN != LTC2949_onTopOfDaisychain
 
-	if (err_detected(error = LTC2949_READ(LTC2949_REG_OPCTRL, 1, &dataOthers)))
+	if (err_detected(error = HAL_READ(LTC2949_REG_OPCTRL, 1, &dataOthers)))
 		return error; // PEC error
 	if (dataOthers != LTC2949_BM_OPCTRL_CONT)
 		return LTC2949_ERRCODE_OTHER; // not in continuous mode
 
-	if (err_detected(error = LTC2949_READ(LTC2949_REG_FACTRL, 1, &dataOthers)))
+	if (err_detected(error = HAL_READ(LTC2949_REG_FACTRL, 1, &dataOthers)))
 		return error; // PEC error
 	if (dataOthers != LTCDEF_FACTRL_CONFIG)
 		return LTC2949_ERRCODE_OTHER;  // not or wrong fast mode
@@ -3553,10 +6392,13 @@ byte ChkDeviceStatCfg()
 ***********************************************************************/
 byte WakeUpReportStatus()
 {
+#ifdef simulatedChain
+	return 0;
+#endif
 	byte  error = LTC2949_WakeupAndAck();
 	error |= LTC2949_ReadChkStatusFaults(true, true);
-	PrintComma();
-	PrintOkErr(error);
+	serialTxComma();
+	serialTxOkErr(error);
 	return error;
 }
 
@@ -3567,6 +6409,9 @@ byte WakeUpReportStatus()
 ***********************************************************************/
 byte Cont(boolean enable)
 {
+#ifdef simulatedChain
+	return 0;
+#endif
 	if (enable)
 	{
 		byte error = 0;
@@ -3626,7 +6471,7 @@ here in the code cellMonDat[i * 6 + 0] represents the CFGRA0 registers byte of t
 byte CellMonitorCFGA(byte * cellMonDat, bool verbose)
 {
 	// read configuration and print
-	byte error = LTC2949_68XX_RdCfg(cellMonDat);
+	byte error = HAL_RdCfg(cellMonDat);
 	if (verbose)
 	{
 		//SerialPrintByteArrayHex(cellMonDat, LTCDEF_CELL_MONITOR_COUNT * 6, true);
@@ -3644,11 +6489,11 @@ byte CellMonitorCFGA(byte * cellMonDat, bool verbose)
     // cellMonDat[i * 6 + 1] = 0; //clear UV & OV
     // cellMonDat[i * 6 + 2] = 0; //clear UV & OV
     // cellMonDat[i * 6 + 3] = 0; //clear UV & OV
-		cellMonDat[i * 6 + 4] = 0; //clear all DCC
+		cellMonDat[i * 6 + 4] = 0; //clear all DCC, measurement window (see balanceWriteDcc())
 		cellMonDat[i * 6 + 5] = 0; //clear all DCC
 	}
 	// write configuration registers
-	error |= LTC2949_68XX_WrCfg(cellMonDat);
+	error |= HAL_WrCfg(cellMonDat);
 	return error;
 }
 
@@ -3666,7 +6511,7 @@ here in the code cellMonDat[i * 6 + 0] represents the CFGBR0 registers byte of t
 byte CellMonitorCFGB(byte * cellMonDat, bool verbose, bool muxSelect)
 {
 	// read configuration and print
-	byte error = LTC2949_68XX_RdCfgb(cellMonDat);
+	byte error = HAL_RdCfgb(cellMonDat);
 	if (verbose)
 	{
 		//SerialPrintByteArrayHex(cellMonDat, LTCDEF_CELL_MONITOR_COUNT * 6, true);
@@ -3689,24 +6534,24 @@ byte CellMonitorCFGB(byte * cellMonDat, bool verbose, bool muxSelect)
 		cellMonDat[i * 6 + 5] = 0; 
 	}
 	// write configuration registers
-	error |= LTC2949_68XX_WrCfgb(cellMonDat);
+	error |= HAL_WrCfgb(cellMonDat);
 	return error;
 }
 
 byte CellMonitorInit()
 {
 	byte cellMonDat[LTCDEF_CELL_MONITOR_COUNT * 6];
-	LTC2949_68XX_RdCfg(cellMonDat); // dummy read
+	HAL_RdCfg(cellMonDat); // dummy read
 	// dummy read of cell voltage group A
 	byte error = ReadPrintCellVoltages(LTC2949_68XX_CMD_RDCVA, (uint16_t*)cellMonDat);
 	// clear all cell voltage groups
-	error |= LTC2949_68XX_ClrCells();
-  error |= LTC2949_68XX_ClrAux();
+	error |= HAL_ClrCells();
+  error |= HAL_ClrAux();
 
 	error |= CellMonitorCFGA(cellMonDat, true);
 
 	// // read configuration and print
-	error |= LTC2949_68XX_RdCfg(cellMonDat);
+	error |= HAL_RdCfg(cellMonDat);
   // for ( uint8_t i = 0; i < LTCDEF_CELL_MONITOR_COUNT; i++ )
   // {
   //   Serial.println();
@@ -3719,7 +6564,7 @@ byte CellMonitorInit()
 	//PrintComma();
   
   error |= CellMonitorCFGB(cellMonDat, true, false);
-  error |= LTC2949_68XX_RdCfgb(cellMonDat);
+  error |= HAL_RdCfgb(cellMonDat);
 	//SerialPrintByteArrayHex(cellMonDat, LTCDEF_CELL_MONITOR_COUNT * 6, true);
 	//PrintComma();
   
@@ -3728,7 +6573,7 @@ byte CellMonitorInit()
 
 	// // trigger cell voltage measurement of all cells in fast mode
   //Serial.println("Start ADCV");
-	error |= LTC2949_ADxx(
+	error |= HAL_ADxx(
 		/*byte md = MD_NORMAL     : */MD_FAST,
 		/*byte ch = CELL_CH_ALL   : */CELL_CH_ALL,
 		/*byte dcp = DCP_DISABLED : */DCP_DISABLED,
@@ -3746,7 +6591,7 @@ byte CellMonitorInit()
 	// //error |= ReadPrintCellVoltages(LTC2949_68XX_CMD_RDCVF, (uint16_t*)cellMonDat);
   
   //Serial.println("Start ADAX ");
-  error |= LTC2949_ADAX(
+  error |= HAL_ADAX(
 		/*byte md = MD_NORMAL     : */MD_FAST,
 		/*byte ch = CELL_CH_ALL   : */CELL_CH_ALL,
 		/*byte dcp = DCP_DISABLED : */DCP_DISABLED,
@@ -3768,6 +6613,500 @@ byte CellMonitorInit()
 
 
 
+#ifdef simulatedChain
+void simInit(void)
+{
+  for ( uint8_t p = 0; p < LTCDEF_CELL_MONITOR_COUNT; p++ )
+  {
+    struct simMonitor &m = simChain[p];
+    for ( uint8_t c = 0; c < LTCDEF_CELLS_PER_CELL_MONITOR_COUNT; c++ )
+    {
+      m.soc[c] = SIM_START_SOC + random(-10, 11) * 0.001f;   // +-1% spread to give the balancing something to do
+      m.v1[c] = 0;
+      m.cv[c] = 0xFFFFU;
+    }
+    for ( uint8_t t = 0; t < LTCDEF_TEMPS_PER_SLAVE; t++ )
+      m.tempBase[t] = SIM_TEMP_AMBIENT;
+    for ( uint8_t a = 0; a < LTCDEF_AUX_PER_CELL_MONITOR_COUNT; a++ )
+      m.aux[a] = 0xFFFFU;
+    m.tempRise = 0;
+    memset(m.cfga, 0, 6);
+    memset(m.cfgb, 0, 6);
+  }
+  simStepUs = micros();
+  simSlowMs = millis();
+  simStep();
+}
+
+void simSelectChain(uint8_t selCS)
+{
+  simForward = selCS == LTCDEF__CS;
+}
+
+// physical slave behind position k of the register buffers
+uint8_t simSlave(uint8_t k)
+{
+  return simForward ? k : LTCDEF_CELL_MONITOR_COUNT - 1 - k;
+}
+
+bool simReachable(uint8_t p)
+{
+  if ( simLinkBreak == 0 )
+    return true;
+  return simForward ? (p < simLinkBreak) : (p >= simLinkBreak);
+}
+
+bool simDcc(const struct simMonitor &m, uint8_t c)
+{
+  if ( c < 8 ) return m.cfga[4] & (1 << c);
+  if ( c < 12 ) return m.cfga[5] & (1 << (c - 8));
+  if ( c < 16 ) return m.cfgb[0] & (1 << (c - 12 + 4));
+  return m.cfgb[1] & (1 << (c - 16));
+}
+
+float simCellVoltage(const struct simMonitor &m, uint8_t c)
+{
+  if ( c % 6 >= cellsPerSection(&m - simChain) )
+    return 0;         // GNDed input
+  float slope;
+  return ocvVoltageLookup(OCV_CURVE, m.soc[c], &slope) + m.v1[c] + simCurrentA * SIM_CELL_R;
+}
+
+// inverse of voltToTemp(): 10k pull-up to the aux reference, 103JT thermistor
+float simTempToVolt(float t)
+{
+  const double B = 3420.50726961, C = B / 293.15;
+  double rt = 12.11e3 * exp(B / (t + 273.15) - C);
+  return SIM_AUX_REF * rt / (10000.0 + rt);
+}
+
+uint16_t simRaw(float v)
+{
+  int32_t raw = (int32_t)(v / 100e-6f) + random(-SIM_NOISE_LSB, SIM_NOISE_LSB + 1);
+  return raw < 0 ? 0 : (raw > 0xFFFE ? 0xFFFE : (uint16_t)raw);
+}
+
+// advances SOC, temperatures and the LTC2949 accumulators to now
+void simStep(void)
+{
+  uint32_t now = micros();
+  float dt = (now - simStepUs) * 1e-6f;
+  simStepUs = now;
+  float k = dt / SIM_TEMP_TAU_S;
+  if ( k > 1 ) k = 1;
+  float a = expf(-dt / SIM_CELL_TAU_S);
+
+  float vPack = 0;
+  for ( uint8_t p = 0; p < LTCDEF_CELL_MONITOR_COUNT; p++ )
+  {
+    struct simMonitor &m = simChain[p];
+    for ( uint8_t c = 0; c < LTCDEF_CELLS_PER_CELL_MONITOR_COUNT; c++ )
+    {
+      float v = simCellVoltage(m, c);
+      float i = simCurrentA;
+      if ( simDcc(m, c) )
+        i -= v / BALANCE_RESISTOR_OHM;
+      vPack += v;
+      m.soc[c] += i * dt / (3600.0f * (float)CELL_BLOCK_CAPACITY_AH);
+      m.v1[c] = a * m.v1[c] + SIM_CELL_R1 * (1.0f - a) * i;
+      if ( m.soc[c] < 0 ) m.soc[c] = 0;
+      if ( m.soc[c] > 1 ) m.soc[c] = 1;
+    }
+    m.tempRise += (simCurrentA * simCurrentA * SIM_TEMP_RISE_PER_A2 - m.tempRise) * k;
+  }
+  simPackV = vPack;
+  simChargeAs += simCurrentA * dt;
+  simEnergyJ += simCurrentA * vPack * dt;
+}
+
+void simWaitConversion(uint32_t startUs)
+{
+  while ( micros() - startUs < simConvUs )
+    ;
+}
+
+byte simADxx(byte md, byte ch, byte dcp, uint8_t pollTimeout)
+{
+  simStep();
+  for ( uint8_t p = 0; p < LTCDEF_CELL_MONITOR_COUNT; p++ )
+  {
+    if ( !simReachable(p) )
+      continue;
+    struct simMonitor &m = simChain[p];
+    for ( uint8_t c = 0; c < LTCDEF_CELLS_PER_CELL_MONITOR_COUNT; c++ )
+      m.cv[c] = simRaw(simCellVoltage(m, c) - (simDcc(m, c) ? SIM_DCC_DROP_V : 0));
+  }
+  simCvStartUs = micros();
+  simFastFresh = simForward;    // the LTC2949 parallel to the forward chain does a fast single shot with every ADCV
+  if ( pollTimeout )
+    simWaitConversion(simCvStartUs);
+  return 0;
+}
+
+byte simADAX(byte md, byte ch, byte dcp, uint8_t pollTimeout)
+{
+  for ( uint8_t p = 0; p < LTCDEF_CELL_MONITOR_COUNT; p++ )
+  {
+    if ( !simReachable(p) )
+      continue;
+    struct simMonitor &m = simChain[p];
+    bool high = m.cfgb[0] & 0x08;     // GPIO9 selects the thermistor bank, see CellMonitorCFGB()
+    for ( uint8_t a = 0; a < LTCDEF_AUX_PER_CELL_MONITOR_COUNT; a++ )
+    {
+      float v = SIM_AUX_REF;          // register 5 is the reference, unused inputs read open
+      if ( (a != 5) && (a < 9) )
+      {
+        uint8_t t = (high ? LTCDEF_TEMPS_LOW_BANK : 0) + (a < 5 ? a : a - 1);
+        if ( t < LTCDEF_TEMPS_PER_SLAVE )
+          v = simTempToVolt(m.tempBase[t] + m.tempRise);
+      }
+      m.aux[a] = simRaw(v);
+    }
+  }
+  simAuxStartUs = micros();
+  if ( pollTimeout )
+    simWaitConversion(simAuxStartUs);
+  return 0;
+}
+
+// register group "group" (3 registers) of every slave in buffer order
+byte simReadGroup(uint16_t * data, bool aux, uint8_t group)
+{
+  byte err = 0;
+  bool busy = micros() - (aux ? simAuxStartUs : simCvStartUs) < simConvUs;
+  int16_t pec = random(100) < simPecPercent ? random(LTCDEF_CELL_MONITOR_COUNT) : -1;
+  for ( uint8_t k = 0; k < LTCDEF_CELL_MONITOR_COUNT; k++ )
+  {
+    uint8_t p = simSlave(k);
+    bool bad = !simReachable(p) || (k == pec);
+    for ( uint8_t r = 0; r < 3; r++ )
+    {
+      uint16_t reg = aux ? simChain[p].aux[3 * group + r] : simChain[p].cv[3 * group + r];
+      data[3 * k + r] = (bad || busy) ? 0xFFFFU : reg;
+    }
+    if ( bad )
+      err |= SIM_PEC_ERROR;
+  }
+  return err;
+}
+
+byte simRdCells(uint16_t rdcv, uint16_t * data)
+{
+  switch ( rdcv )
+  {
+    case LTC2949_68XX_CMD_RDCVA: return simReadGroup(data, false, 0);
+    case LTC2949_68XX_CMD_RDCVB: return simReadGroup(data, false, 1);
+    case LTC2949_68XX_CMD_RDCVC: return simReadGroup(data, false, 2);
+    case LTC2949_68XX_CMD_RDCVD: return simReadGroup(data, false, 3);
+    case LTC2949_68XX_CMD_RDCVE: return simReadGroup(data, false, 4);
+    case LTC2949_68XX_CMD_RDCVF: return simReadGroup(data, false, 5);
+  }
+  return LTC2949_ERRCODE_OTHER;
+}
+
+byte simRdAux(uint16_t rdaux, uint16_t * data)
+{
+  switch ( rdaux )
+  {
+    case LTC2949_68XX_CMD_RDAUXA: return simReadGroup(data, true, 0);
+    case LTC2949_68XX_CMD_RDAUXB: return simReadGroup(data, true, 1);
+    case LTC2949_68XX_CMD_RDAUXC: return simReadGroup(data, true, 2);
+    case LTC2949_68XX_CMD_RDAUXD: return simReadGroup(data, true, 3);
+  }
+  return LTC2949_ERRCODE_OTHER;
+}
+
+byte simRdCfgReg(byte * data, bool cfgb)
+{
+  byte err = 0;
+  for ( uint8_t k = 0; k < LTCDEF_CELL_MONITOR_COUNT; k++ )
+  {
+    uint8_t p = simSlave(k);
+    if ( simReachable(p) )
+    {
+      memcpy(data + 6 * k, cfgb ? simChain[p].cfgb : simChain[p].cfga, 6);
+    }
+    else
+    {
+      memset(data + 6 * k, 0xFF, 6);
+      err |= SIM_PEC_ERROR;
+    }
+  }
+  return err;
+}
+
+byte simWrCfgReg(byte * data, bool cfgb)
+{
+  for ( uint8_t k = 0; k < LTCDEF_CELL_MONITOR_COUNT; k++ )
+  {
+    uint8_t p = simSlave(k);
+    if ( simReachable(p) )
+      memcpy(cfgb ? simChain[p].cfgb : simChain[p].cfga, data + 6 * k, 6);
+  }
+  return 0;
+}
+
+byte simClr(bool aux)
+{
+  for ( uint8_t p = 0; p < LTCDEF_CELL_MONITOR_COUNT; p++ )
+  {
+    if ( !simReachable(p) )
+      continue;
+    if ( aux )
+      for ( uint8_t a = 0; a < LTCDEF_AUX_PER_CELL_MONITOR_COUNT; a++ ) simChain[p].aux[a] = 0xFFFFU;
+    else
+      for ( uint8_t c = 0; c < LTCDEF_CELLS_PER_CELL_MONITOR_COUNT; c++ ) simChain[p].cv[c] = 0xFFFFU;
+  }
+  return 0;
+}
+
+int16_t simClamp16(float raw)
+{
+  return raw > 32767 ? 32767 : (raw < -32768 ? -32768 : (int16_t)raw);
+}
+
+byte simRdFastData(int16_t * fastData, uint16_t * cellMonDat, uint16_t rdcv, uint16_t pollTimeout)
+{
+  if ( !simForward )
+    return LTC2949_ERRCODE_OTHER;
+  if ( pollTimeout )
+    simWaitConversion(simCvStartUs);
+  if ( simFastFresh && (micros() - simCvStartUs >= simConvUs) )
+  {
+    fastData[LTC2949_RDFASTDATA_I2] = simClamp16(simCurrentA * LTCDEF_SENSE_RESISTOR / LTC2949_LSB_FIFOI2);
+    fastData[LTC2949_RDFASTDATA_BAT] = simClamp16(simPackV / POT_DIV_BPM / LTC2949_LSB_FIFOBAT);
+    fastData[LTC2949_RDFASTDATA_HS] = SIM_FAST_HS_DONE;
+    simFastFresh = false;
+  }
+  else
+  {
+    fastData[LTC2949_RDFASTDATA_HS] = 0;
+  }
+  return cellMonDat ? simRdCells(rdcv, cellMonDat) : 0;
+}
+
+bool simChkUpdate(byte * error)
+{
+  if ( millis() - simSlowMs < LTC2949_TIMING_CONT_CYCLE )
+    return false;
+  simSlowMs = millis();
+  simStep();
+  return true;
+}
+
+uint32_t simGetLastTBxInt(void)
+{
+  return (uint32_t)(simSlowMs / (1.0e3 * LTC2949_LSB_TB1));
+}
+
+byte simREAD(uint16_t addr, uint16_t len, byte * data)
+{
+  if ( !simForward )
+    return LTC2949_ERRCODE_OTHER;
+  int64_t raw = 0;
+  switch ( addr )
+  {
+    case LTC2949_VAL_I1: raw = simCurrentA * LTCDEF_SENSE_RESISTOR / LTC2949_LSB_I1; break;
+    case LTC2949_VAL_P1: raw = simCurrentA * simPackV / POT_DIV_POWER * LTCDEF_SENSE_RESISTOR / LTC2949_LSB_P1; break;
+    case LTC2949_VAL_BAT: raw = simPackV / POT_DIV_BPM / LTC2949_LSB_BAT; break;
+    case LTC2949_VAL_TEMP: raw = SIM_TEMP_AMBIENT / LTC2949_LSB_TEMP; break;
+    case LTC2949_VAL_TB1: raw = simGetLastTBxInt(); break;
+    case LTC2949_VAL_C1: raw = simChargeAs * LTCDEF_SENSE_RESISTOR / LTC2949_LSB_C1; break;
+    case LTC2949_VAL_E1: raw = simEnergyJ * LTCDEF_SENSE_RESISTOR / (LTC2949_LSB_E1 * POT_DIV_POWER); break;
+    default: break;     // SLOT1 and the control registers read 0
+  }
+  // big endian, see bytesToInt64()
+  for ( int16_t i = len - 1; i >= 0; i-- )
+  {
+    data[i] = raw & 0xFF;
+    raw >>= 8;
+  }
+  return 0;
+}
+
+void simConsoleCommand(char * arg)
+{
+  char * end;
+  char cmd = arg[0];
+  long n = strtol(arg + 1, &end, 10);
+  switch ( cmd )
+  {
+    case 0:
+      break;
+    case 'i':
+      simCurrentA = strtod(arg + 1, &end);
+      break;
+    case 'p':
+      simPecPercent = n < 0 ? 0 : (n > 100 ? 100 : n);
+      break;
+    case 'b':
+      simLinkBreak = (n > 0) && (n < LTCDEF_CELL_MONITOR_COUNT) ? n : 0;
+      break;
+    case 'c':
+      simConvUs = n > 0 ? n : LTC2949_68XX_T6C_27KHZ_US;
+      break;
+    case 'v':
+    case 't':
+    {
+      long i = strtol(end, &end, 10);
+      float val = strtod(end, &end);
+      for ( uint8_t p = 0; p < LTCDEF_CELL_MONITOR_COUNT; p++ )
+      {
+        if ( (n != 0) && (n != p + 1) )
+          continue;
+        for ( uint8_t c = 0; c < (cmd == 'v' ? cellsPerStack[p] : tempsPerStack[p]); c++ )
+        {
+          if ( (i != 0) && (i != c + 1) )
+            continue;
+          if ( cmd == 'v' )
+            simChain[p].soc[cellInput(p, c)] = socFromOcv(OCV_CURVE, val);
+          else
+            simChain[p].tempBase[c] = val;
+        }
+      }
+      break;
+    }
+    default:
+      printConsoleHelp();
+      return;
+  }
+  printSimulation();
+}
+
+void printSimulation(void)
+{
+  simStep();
+  SerialTx.print("Simulation : ");
+  SerialTx.print(simForward ? "forward" : "backward");
+  SerialTx.print(" chain, ");
+  SerialTx.print(simCurrentA, 1);
+  SerialTx.print("A, pack ");
+  SerialTx.print(simPackV, 2);
+  SerialTx.print("V, conversion ");
+  SerialTx.print(simConvUs);
+  SerialTx.print("us, PEC errors ");
+  SerialTx.print(simPecPercent);
+  SerialTx.print("%, link ");
+  if ( simLinkBreak )
+  {
+    SerialTx.print("broken between slave ");
+    SerialTx.print(simLinkBreak);
+    SerialTx.print(" and ");
+    SerialTx.println(simLinkBreak + 1);
+  }
+  else
+  {
+    SerialTx.println("intact");
+  }
+  for ( uint8_t p = 0; p < LTCDEF_CELL_MONITOR_COUNT; p++ )
+  {
+    SerialTx.print("S");
+    SerialTx.print(p + 1);
+    SerialTx.print(" :");
+    for ( uint8_t c = 0; c < cellsPerStack[p]; c++ )
+    {
+      SerialTx.print(" ");
+      SerialTx.print(simCellVoltage(simChain[p], cellInput(p, c)), 3);
+    }
+    SerialTx.print("  +");
+    SerialTx.print(simChain[p].tempRise, 1);
+    SerialTx.println("degC");
+  }
+  printSimResistanceCheck();
+}
+
+// the RLS has to move the estimates from EKF_R0 to SIM_CELL_R once there were load steps
+// ('xi' with at least CELL_RES_MIN_DI difference), on the forward frames only with circular
+void printSimResistanceCheck(void)
+{
+  float mean = cellResMean();
+  SerialTx.print("Resistance : ");
+  SerialTx.print(cellResUpdates);
+  SerialTx.print(" updates, mean ");
+  SerialTx.print(mean * 1e3f, 2);
+  SerialTx.print("mOhm, model ");
+  SerialTx.print(SIM_CELL_R * 1e3f, 2);
+  SerialTx.print("mOhm, start ");
+  SerialTx.print(EKF_R0 * 1e3f, 2);
+  SerialTx.print("mOhm : ");
+  if ( cellResUpdates == 0 )
+    SerialTx.println("no load step yet");
+  else if ( fabsf(mean - SIM_CELL_R) < fabsf(mean - EKF_R0) )
+    SerialTx.println("OK");
+  else
+    SerialTx.println("FAIL, still at EKF_R0");
+}
+#endif
+
+// HOST SECTION
+#ifdef AMS_HOST
+/*
+  Entry points for the log replay of the host build (host/replay.cpp): the cell voltages and the current of
+  every SD row with cell voltages go through the same estimators as in loop(), in the same order.
+  hostBench() is the 'k' command without the console, for ams_bench --bench.
+*/
+// the part of setup() the estimators depend on
+void hostReplayBegin(void)
+{
+  initPackLayout();
+  initialiseNormalizeChannel();
+  setNormalizeChannels(slavesToNormalize, voltChannelToNormalize, tempChannelToNormalize );
+}
+
+uint16_t hostCellCount(void)
+{
+  uint16_t n = 0;
+  for ( uint8_t c_ic = 0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+    n += cellsPerStack[c_ic];
+  return n;
+}
+
+uint16_t hostTempCount(void)
+{
+  uint16_t n = 0;
+  for ( uint8_t c_ic = 0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+    n += tempsPerStack[c_ic];
+  return n;
+}
+
+// volts in the order of cellsLogging()
+void hostReplayFrame(const float * volts, float current)
+{
+  for ( uint8_t c_ic = 0; c_ic < LTCDEF_CELL_MONITOR_COUNT; c_ic++ )
+  {
+    for ( uint8_t i = 0; i < cellsPerStack[c_ic]; i++ )
+      cellVoltages[c_ic][i] = *volts++;
+  }
+  cellFrameCurrent = current;
+  cellFrameCurrentSync = true;
+  cellResistanceUpdate();
+  socEkfUpdate(meanCellVoltage(), cellFrameCurrent);
+}
+
+float hostEkfSoc(void)
+{
+  return socEkf.init ? socEkf.soc : -1;
+}
+
+float hostCapacityAh(void)
+{
+  return CELL_BLOCK_CAPACITY_AH;
+}
+
+// one benchmark run after setup(), the table goes to stdout and a line per kernel to BENCH_FILE_NAME
+bool hostBench(void)
+{
+  #ifdef kernelBenchmark
+  benchRun();
+  while ( SerialTx.used() > 0 )
+    serialTxDrain();
+  return true;
+  #else
+  return false;
+  #endif
+}
+#endif
+
 // New functions
 
 
@@ -0,0 +1,24 @@
+// Host-only controls of the shim and the entry points of final_fsa_code.c's HOST SECTION.
+#pragma once
+
+#include <stdint.h>
+
+// shim
+extern bool hostFastClock;                  // delay() advances the clock instead of sleeping
+void hostClockAdvanceTo(uint64_t us);       // move the clock forward to us after start, never back
+void hostSerialInject(const char * line);   // queue a console line, read before stdin
+
+// final_fsa_code.c
+void setup(void);
+void loop(void);
+void hostReplayBegin(void);
+uint16_t hostCellCount(void);
+uint16_t hostTempCount(void);
+void hostReplayFrame(const float * volts, float current);
+float hostEkfSoc(void);
+float hostCapacityAh(void);
+bool hostBench(void);
+float cellResMean(void);
+
+// replay.cpp
+int hostReplay(const char * path, float boundPct, float settleS, bool trace);
@@ -0,0 +1,128 @@
+// Host entry point for final_fsa_code.c built with AMS_HOST: runs the sketch against the
+// simulated chain like the Teensy core does, setup() once and loop() until stopped.
+//
+//   ams_host [--loops N] [--until MS] [--fast] [--script FILE]
+//   ams_host --replay FILE [--bound PCT] [--settle S] [--trace]
+//   ams_bench --bench [--fast]
+//
+// Console commands are read from stdin (e.g. "xi50" for a 50 A load step), output goes to stdout.
+// --fast     delay() advances the clock instead of sleeping, the sketch runs as fast as the host can
+// --script   lines "<ms> <console command>", each is injected once millis() reached <ms>, '#' starts a comment
+// --until    stop at the first loop starting at or after MS
+// --replay   replay an SD log through the EKF SOC estimator, see replay.cpp, exit code 0 if within the bound
+// --bench    setup(), one 'k' benchmark run and exit, needs kernelBenchmark (the ams_bench build)
+#include <Arduino.h>
+#include "host.h"
+
+#include <vector>
+
+struct scriptLine
+{
+    unsigned long ms;
+    std::string cmd;
+};
+
+static bool readScript(const char * path, std::vector<scriptLine> & script)
+{
+    FILE * f = fopen(path, "r");
+    if (!f)
+    {
+        fprintf(stderr, "cannot open %s\n", path);
+        return false;
+    }
+    char buf[256];
+    while (fgets(buf, sizeof(buf), f))
+    {
+        char * hash = strchr(buf, '#');
+        if (hash)
+            *hash = 0;
+        char * end;
+        unsigned long ms = strtoul(buf, &end, 10);
+        if (end == buf)
+            continue;         // empty or comment line
+        while (*end == ' ' || *end == '\t')
+            end++;
+        std::string cmd = end;
+        while (!cmd.empty() && (cmd.back() == '\n' || cmd.back() == '\r' || cmd.back() == ' '))
+            cmd.pop_back();
+        script.push_back({ ms, cmd });
+    }
+    fclose(f);
+    return true;
+}
+
+static int usage(const char * prog)
+{
+    fprintf(stderr, "usage: %s [--loops N] [--until MS] [--fast] [--script FILE]\n"
+                    "       %s --replay FILE [--bound PCT] [--settle S] [--trace]\n"
+                    "       %s --bench [--fast]\n", prog, prog, prog);
+    return 2;
+}
+
+int main(int argc, char ** argv)
+{
+    long loops = -1;
+    long until = -1;
+    const char * scriptPath = NULL;
+    const char * replayPath = NULL;
+    float bound = 3.0f;
+    float settle = 60.0f;
+    bool trace = false;
+    bool bench = false;
+    for (int i = 1; i < argc; i++)
+    {
+        bool more = i + 1 < argc;
+        if (!strcmp(argv[i], "--loops") && more)
+            loops = atol(argv[++i]);
+        else if (!strcmp(argv[i], "--until") && more)
+            until = atol(argv[++i]);
+        else if (!strcmp(argv[i], "--fast"))
+            hostFastClock = true;
+        else if (!strcmp(argv[i], "--script") && more)
+            scriptPath = argv[++i];
+        else if (!strcmp(argv[i], "--replay") && more)
+            replayPath = argv[++i];
+        else if (!strcmp(argv[i], "--bound") && more)
+            bound = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--settle") && more)
+            settle = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--trace"))
+            trace = true;
+        else if (!strcmp(argv[i], "--bench"))
+            bench = true;
+        else
+            return usage(argv[0]);
+    }
+
+    if (replayPath)
+        return hostReplay(replayPath, bound, settle, trace);
+
+    if (bench)
+    {
+        setup();
+        if (!hostBench())
+        {
+            fprintf(stderr, "%s: built without kernelBenchmark\n", argv[0]);
+            return 2;
+        }
+        fflush(stdout);
+        return 0;
+    }
+
+    std::vector<scriptLine> script;
+    if (scriptPath && !readScript(scriptPath, script))
+        return 2;
+    size_t next = 0;
+
+    setup();
+    for (long n = 0; loops < 0 || n < loops; n++)
+    {
+        if (until >= 0 && millis() >= (unsigned long)until)
+            break;
+        while (next < script.size() && millis() >= script[next].ms)
+            hostSerialInject(script[next++].cmd.c_str());
+        loop();
+    }
+    fflush(stdout);
+    return 0;
+}
@@ -0,0 +1,119 @@
+// Replay of an SD log (AMSCellDataN.txt) through the EKF SOC estimator and the RLS resistance estimate that
+// feeds its R0. The reference is coulomb counting of the logged current from the SOC the EKF starts with,
+// so the log has to start at rest. The EKF passes if it stays within the bound of the reference once
+// it had settleS seconds to converge.
+#include <Arduino.h>
+#include "host.h"
+
+#include <string>
+#include <vector>
+
+static bool splitRow(const char * line, std::vector<float> & cols)
+{
+    cols.clear();
+    const char * p = line;
+    while (*p && *p != '\r' && *p != '\n')
+    {
+        char * end;
+        float v = strtof(p, &end);
+        if (end == p)
+            return false;     // not a number, e.g. a hex balancing mask, everything needed is in front of it
+        cols.push_back(v);
+        p = end;
+        if (*p == ',')
+            p++;
+    }
+    return true;
+}
+
+int hostReplay(const char * path, float boundPct, float settleS, bool trace)
+{
+    FILE * f = fopen(path, "r");
+    if (!f)
+    {
+        fprintf(stderr, "replay: cannot open %s\n", path);
+        return 2;
+    }
+
+    hostReplayBegin();
+    const uint16_t nCells = hostCellCount();
+    const uint16_t nTemps = hostTempCount();
+    const size_t iCurrent = 1 + nCells + nTemps + 1;   // ms, cells, temperatures, pack voltage, current
+    const float capacityAh = hostCapacityAh();
+
+    std::vector<float> cols;
+    std::string line;
+    char buf[8192];
+    uint32_t frames = 0, skipped = 0;
+    uint32_t t0 = 0, tPrev = 0;
+    float iPrev = 0;
+    float ref = 0;
+    float errMax = 0, errSum2 = 0, errLast = 0;
+    uint32_t errN = 0;
+
+    if (trace)
+        printf("t_s,current_A,ekf_pct,ref_pct,err_pct,r0_mOhm\n");
+    while (fgets(buf, sizeof(buf), f))
+    {
+        line = buf;
+        while (!line.empty() && line.back() != '\n' && fgets(buf, sizeof(buf), f))
+            line += buf;
+        splitRow(line.c_str(), cols);
+        if (cols.size() <= iCurrent)
+        {
+            skipped++;        // rows without a slow channel update carry no cell voltages
+            continue;
+        }
+        uint32_t t = (uint32_t)cols[0];
+        if (frames && (t < tPrev))
+        {
+            fprintf(stderr, "replay: time goes backwards at row %u (%u ms after %u ms), reset in the log?\n", frames + skipped + 1, t, tPrev);
+            break;
+        }
+        float current = cols[iCurrent];
+        hostClockAdvanceTo((uint64_t)t * 1000);
+        hostReplayFrame(&cols[1], current);
+        float ekf = hostEkfSoc();
+        if (ekf < 0)
+        {
+            skipped++;        // no plausible cell voltages yet
+            continue;
+        }
+
+        if (frames == 0)
+        {
+            t0 = t;
+            ref = ekf;
+        }
+        else
+            ref += 0.5f * (current + iPrev) * ((t - tPrev) * 1e-3f) / (3600.0f * capacityAh);
+        tPrev = t;
+        iPrev = current;
+        frames++;
+
+        float err = (ekf - ref) * 100;
+        if ((t - t0) * 1e-3f >= settleS)
+        {
+            if (fabsf(err) > errMax)
+                errMax = fabsf(err);
+            errSum2 += err * err;
+            errN++;
+        }
+        errLast = err;
+        if (trace)
+            printf("%.3f,%.2f,%.3f,%.3f,%.3f,%.3f\n", (t - t0) * 1e-3f, current, ekf * 100, ref * 100, err, cellResMean() * 1e3f);
+    }
+    fclose(f);
+
+    printf("replay %s : %u frames, %u rows skipped, %.1f s, %u cells, R0 %.2f mOhm\n", path, frames, skipped,
+           frames ? (tPrev - t0) * 1e-3f : 0.0f, nCells, cellResMean() * 1e3f);
+    if (errN == 0)
+    {
+        printf("EKF SOC error : no frames after the %.0f s settle time : FAIL\n", settleS);
+        return 1;
+    }
+    bool pass = errMax <= boundPct;
+    printf("EKF SOC error vs coulomb count after %.0f s : max %.2f%%, rms %.2f%%, final %.2f%%, bound %.2f%% : %s\n",
+           settleS, errMax, sqrtf(errSum2 / errN), errLast, boundPct, pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
+}
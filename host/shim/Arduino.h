@@ -0,0 +1,169 @@
+// Minimal Arduino / Teensy 4 core for the host build of final_fsa_code.c.
+// Only what the sketch uses with simulatedChain: time, pins (no-ops), String, Print, Serial on stdin / stdout
+// and the Teensy registers the watchdog and the DWT cycle counter are written through.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <string>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define F(x) (x)
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+#define BUILTIN_SDCARD 254
+#define FASTRUN
+#define __disable_irq()
+#define __enable_irq()
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield(void);
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int val);
+void digitalWriteFast(int pin, int val);
+int digitalRead(int pin);
+void analogWrite(int pin, int val);
+void analogWriteFrequency(int pin, float freq);
+void analogWriteResolution(int bits);
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+
+using std::abs;
+
+template<class T> T constrain(T x, T lo, T hi) { return x < lo ? lo : (x > hi ? hi : x); }
+
+class String
+{
+  public:
+    String(void) {}
+    String(const char * s) : s(s ? s : "") {}
+    String(const std::string & s) : s(s) {}
+    String(char c) : s(1, c) {}
+    String(int v, int base = DEC) : s(fromInt(v, base)) {}
+    String(unsigned int v, int base = DEC) : s(fromUnsigned(v, base)) {}
+    String(long v, int base = DEC) : s(fromInt(v, base)) {}
+    String(unsigned long v, int base = DEC) : s(fromUnsigned(v, base)) {}
+    String(long long v, int base = DEC) : s(fromInt(v, base)) {}
+    String(unsigned long long v, int base = DEC) : s(fromUnsigned(v, base)) {}
+    String(unsigned char v, int base = DEC) : s(fromUnsigned(v, base)) {}
+    String(float v, int digits = 2) : s(fromDouble(v, digits)) {}
+    String(double v, int digits = 2) : s(fromDouble(v, digits)) {}
+
+    // like the Arduino core, numbers are appended in decimal, only char is appended as a character
+    String & operator+=(const String & o) { s += o.s; return *this; }
+    String & operator+=(const char * o) { s += o; return *this; }
+    String & operator+=(char c) { s += c; return *this; }
+    String & operator+=(unsigned char v) { return *this += String(v); }
+    String & operator+=(int v) { return *this += String(v); }
+    String & operator+=(unsigned int v) { return *this += String(v); }
+    String & operator+=(long v) { return *this += String(v); }
+    String & operator+=(unsigned long v) { return *this += String(v); }
+    String & operator+=(float v) { return *this += String(v); }
+    String & operator+=(double v) { return *this += String(v); }
+    friend String operator+(const String & a, const String & b) { return String(a.s + b.s); }
+    friend String operator+(const char * a, const String & b) { return String(std::string(a) + b.s); }
+    friend String operator+(const String & a, const char * b) { return String(a.s + b); }
+    template<class T> friend String operator+(const String & a, T v) { String r(a); r += v; return r; }
+    bool operator==(const String & o) const { return s == o.s; }
+    bool operator!=(const String & o) const { return s != o.s; }
+
+    const char * c_str(void) const { return s.c_str(); }
+    unsigned int length(void) const { return s.size(); }
+
+  private:
+    static std::string fromUnsigned(unsigned long long v, int base);
+    static std::string fromInt(long long v, int base);
+    static std::string fromDouble(double v, int digits);
+    std::string s;
+};
+
+class Print
+{
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t * buf, size_t n);
+    size_t write(const char * s) { return write((const uint8_t *)s, strlen(s)); }
+
+    size_t print(const char * s) { return write(s); }
+    size_t print(const String & s) { return write(s.c_str()); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(signed char v, int base = DEC) { return printSigned(v, base); }
+    size_t print(unsigned char v, int base = DEC) { return printUnsigned(v, base); }
+    size_t print(int v, int base = DEC) { return printSigned(v, base); }
+    size_t print(unsigned int v, int base = DEC) { return printUnsigned(v, base); }
+    size_t print(long v, int base = DEC) { return printSigned(v, base); }
+    size_t print(unsigned long v, int base = DEC) { return printUnsigned(v, base); }
+    size_t print(long long v, int base = DEC) { return printSigned(v, base); }
+    size_t print(unsigned long long v, int base = DEC) { return printUnsigned(v, base); }
+    size_t print(double v, int digits = 2) { return print(String(v, digits)); }
+
+    size_t println(void) { return write("\r\n"); }
+    template<class T> size_t println(const T & v) { size_t n = print(v); return n + println(); }
+    template<class T> size_t println(const T & v, int fmt) { size_t n = print(v, fmt); return n + println(); }
+
+  private:
+    size_t printSigned(long long v, int base) { return print(String(v, base)); }
+    size_t printUnsigned(unsigned long long v, int base) { return print(String(v, base)); }
+};
+
+// USB serial: output to stdout, input from stdin without blocking
+class HardwareSerial : public Print
+{
+  public:
+    void begin(long baud) {}
+    int available(void);
+    int read(void);
+    int peek(void);
+    int availableForWrite(void) { return 4096; }
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t write(const uint8_t * buf, size_t n);
+    using Print::write;
+    void flush(void) { fflush(stdout); }
+    operator bool(void) { return true; }
+};
+
+extern HardwareSerial Serial;
+
+// i.MX RT1062 registers used by the watchdog and the profiler, plain variables on the host
+extern volatile uint16_t WDOG1_WCR, WDOG1_WSR, WDOG1_WICR, WDOG1_WMCR;
+extern volatile uint32_t SRC_SRSR, CCM_CCGR3;
+#define WDOG_WCR_WT(n) ((uint16_t)(((n) & 0xFF) << 8))
+#define WDOG_WCR_WDE ((uint16_t)(1 << 2))
+#define WDOG_WCR_SRS ((uint16_t)(1 << 4))
+#define WDOG_WCR_WDA ((uint16_t)(1 << 5))
+#define WDOG_WICR_WIE ((uint16_t)(1 << 15))
+#define WDOG_WICR_WTIS ((uint16_t)(1 << 14))
+#define WDOG_WICR_WICT(n) ((uint16_t)((n) & 0xFF))
+#define SRC_SRSR_WDOG_RST_B ((uint32_t)(1 << 4))
+#define CCM_CCGR3_WDOG1(n) ((uint32_t)(((n) & 0x03) << 16))
+#define CCM_CCGR_ON 3
+#define IRQ_WDOG1 92
+void attachInterruptVector(int irq, void (*isr)(void));
+#define NVIC_ENABLE_IRQ(n)
+#define NVIC_SET_PRIORITY(n, p)
+
+// DWT cycle counter: derived from the host clock at F_CPU_ACTUAL
+extern volatile uint32_t ARM_DEMCR, ARM_DWT_CTRL;
+uint32_t hostCycleCount(void);
+#define ARM_DWT_CYCCNT (hostCycleCount())
+#define ARM_DEMCR_TRCENA (1 << 24)
+#define ARM_DWT_CTRL_CYCCNTENA (1 << 0)
+extern uint32_t F_CPU_ACTUAL;
@@ -0,0 +1,33 @@
+// Emulated Teensy 4 EEPROM for the host build, kept in eeprom.bin in the working directory.
+#pragma once
+
+#include <Arduino.h>
+
+#define EEPROM_SIZE 4284
+
+class EEPROMClass
+{
+  public:
+    uint8_t read(int idx);
+    void write(int idx, uint8_t val);
+    void update(int idx, uint8_t val) { if (read(idx) != val) write(idx, val); }
+    int length(void) { return EEPROM_SIZE; }
+
+    template<class T> T & get(int idx, T & t)
+    {
+        uint8_t * p = (uint8_t *)&t;
+        for (size_t i = 0; i < sizeof(T); i++)
+            p[i] = read(idx + i);
+        return t;
+    }
+
+    template<class T> const T & put(int idx, const T & t)
+    {
+        const uint8_t * p = (const uint8_t *)&t;
+        for (size_t i = 0; i < sizeof(T); i++)
+            update(idx + i, p[i]);
+        return t;
+    }
+};
+
+extern EEPROMClass EEPROM;
@@ -0,0 +1,54 @@
+// FlexCAN_T4 for the host build: nothing is ever received, transmitted frames are
+// accepted and printed to stderr when AMS_HOST_CAN_LOG is set in the environment.
+#pragma once
+
+#include <Arduino.h>
+
+typedef struct CAN_message_t
+{
+    uint32_t id = 0;
+    uint16_t timestamp = 0;
+    uint8_t idhit = 0;
+    struct
+    {
+        bool extended = 0;
+        bool remote = 0;
+        bool overrun = 0;
+        bool reserved = 0;
+    } flags;
+    uint8_t len = 8;
+    uint8_t buf[8] = { 0 };
+    int8_t mb = 0;
+    uint8_t bus = 0;
+    bool seq = 0;
+} CAN_message_t;
+
+enum CAN_DEV_TABLE { CAN1, CAN2, CAN3 };
+enum RXQUEUE_TABLE { RX_SIZE_2 = 2, RX_SIZE_4 = 4, RX_SIZE_8 = 8, RX_SIZE_16 = 16, RX_SIZE_32 = 32, RX_SIZE_64 = 64, RX_SIZE_128 = 128, RX_SIZE_256 = 256 };
+enum TXQUEUE_TABLE { TX_SIZE_2 = 2, TX_SIZE_4 = 4, TX_SIZE_8 = 8, TX_SIZE_16 = 16, TX_SIZE_32 = 32, TX_SIZE_64 = 64, TX_SIZE_128 = 128, TX_SIZE_256 = 256 };
+enum FLEXCAN_IDE { NONE, EXT, STD, RTR };
+enum FLEXCAN_MAILBOX { MB0, MB1, MB2, MB3, MB4, MB5, MB6, MB7, MB8, MB9, MB10, MB11, MB12, MB13, MB14, MB15, FIFO };
+enum FLEXCAN_FILTER { REJECT_ALL, ACCEPT_ALL };
+
+typedef void (*_MB_ptr)(const CAN_message_t & msg);
+
+void hostCanLog(int bus, const CAN_message_t & msg);
+
+template<CAN_DEV_TABLE _bus, RXQUEUE_TABLE _rxSize = RX_SIZE_16, TXQUEUE_TABLE _txSize = TX_SIZE_16>
+class FlexCAN_T4
+{
+  public:
+    void begin(void) {}
+    void setBaudRate(uint32_t baud) {}
+    void setMaxMB(uint8_t n) {}
+    void enableFIFO(bool status = 1) {}
+    void enableFIFOInterrupt(bool status = 1) {}
+    void onReceive(_MB_ptr handler) {}
+    void onReceive(FLEXCAN_MAILBOX mb, _MB_ptr handler) {}
+    void setFIFOFilter(const FLEXCAN_FILTER & input) {}
+    bool setFIFOFilter(uint8_t filter, uint32_t id1, const FLEXCAN_IDE & ide, const FLEXCAN_IDE & remote = NONE) { return 1; }
+    void mailboxStatus(void) {}
+    uint64_t events(void) { return 0; }
+    int read(CAN_message_t & msg) { return 0; }
+    int write(const CAN_message_t & msg) { hostCanLog((int)_bus + 1, msg); return 1; }
+};
@@ -0,0 +1,128 @@
+// LTC2949 library interface for the host build. With simulatedChain every HAL_* call goes to
+// the sim* backend in the sketch, so the functions here are link stubs that report success.
+// The register addresses and LSB values are placeholders: the simulator encodes and decodes
+// its readings with the same constants, so only their consistency matters on the host.
+#pragma once
+
+#include <Arduino.h>
+#include <SPI.h>
+
+extern SPISettings LTC2949_SPISettings;
+extern uint8_t LTC2949_CS;
+extern bool LTC2949_onTopOfDaisychain;
+extern uint8_t LTC2949_CellMonitorCount;
+
+#define MD_FAST 1
+#define MD_NORMAL 2
+#define MD_FILTERED 3
+#define CELL_CH_ALL 0
+#define DCP_DISABLED 0
+#define DCP_ENABLED 1
+
+#define LTC2949_DEFAULT_SPIMODE SPI_MODE3
+#define LTC2949_MAX_SPIFREQU 1000000
+#define LTC2949_ERRCODE_OTHER 0x80
+
+// fast data: I2, BAT and the two handshake bytes of a fast single shot
+#define LTC2949_RDFASTDATA_LENGTH 4
+#define LTC2949_RDFASTDATA_I2 0
+#define LTC2949_RDFASTDATA_BAT 1
+#define LTC2949_RDFASTDATA_HS 3
+#define LTC2949_FASTSSHT_HS_OK(FASTDATA) ((FASTDATA)[LTC2949_RDFASTDATA_HS] == 0x0F0F)
+#define LTC2949_FASTSSHT_HS_CLR(FASTDATA) ((FASTDATA)[LTC2949_RDFASTDATA_HS] == 0)
+#define LTC2949_FASTSSHT_HS_LAST_OK(FASTDATA) (((FASTDATA)[LTC2949_RDFASTDATA_HS] & 0xFF) == 0x0F)
+
+#define LTC2949_68XX_T6C_27KHZ_US 1200
+#define LTC2949_FASTSSHT_RDY_TIME_US 1200
+#define LTC2949_68XX_GETADCVTIMEOUT16US(US) ((US) / 16)
+
+#define LTC2949_TIMING_BOOTUP 10
+#define LTC2949_TIMING_CONT_CYCLE 100
+#define LTC2949_TIMING_IDLE2CONT2UPDATE 100
+#define LTC2949_TIMING_AUTO_SLEEP_MAX 100
+
+#define LTC2949_LSB_TB1 1e-3
+#define LTC2949_LSB_I1 1e-6
+#define LTC2949_LSB_P1 1e-6
+#define LTC2949_LSB_BAT 1e-3
+#define LTC2949_LSB_TEMP 0.1
+#define LTC2949_LSB_FIFOI2 10e-6   // 16 bit fast channel, must span the +-300mV shunt input range
+#define LTC2949_LSB_FIFOBAT 1e-3
+#define LTC2949_LSB_C1 1e-6
+#define LTC2949_LSB_E1 1e-6
+
+#define LTC2949_BM_FACTRL_FACH2 0x02
+#define LTC2949_BM_ADCCONF_NTC1 0x01
+#define LTC2949_BM_ADCCONF_P2ASV 0x02
+#define LTC2949_BM_OPCTRL_CONT 0x08
+#define LTC2949_BM_REGSCTRL_BCREN 0x20
+#define LTC2949_STATFAULTSCHK_IGNORE_STATUPD 0x01
+#define LTC2949_STATFAULTSCHK_DFLT_AFTER_CLR 0x02
+
+enum
+{
+    LTC2949_VAL_I1 = 0x90,
+    LTC2949_VAL_P1,
+    LTC2949_VAL_BAT,
+    LTC2949_VAL_SLOT1,
+    LTC2949_VAL_TEMP,
+    LTC2949_VAL_RREF1,
+    LTC2949_VAL_RREF2,
+    LTC2949_VAL_NTC1A,
+    LTC2949_VAL_NTC1B,
+    LTC2949_VAL_NTC1C,
+    LTC2949_VAL_NTC2A,
+    LTC2949_VAL_NTC2B,
+    LTC2949_VAL_NTC2C,
+    LTC2949_VAL_C1,
+    LTC2949_VAL_E1,
+    LTC2949_VAL_TB1,
+    LTC2949_REG_REGSCTRL,
+    LTC2949_REG_OPCTRL,
+    LTC2949_REG_FACTRL,
+    LTC2949_REG_ACCCTRL1
+};
+
+enum
+{
+    LTC2949_68XX_CMD_RDCVA = 0x04,
+    LTC2949_68XX_CMD_RDCVB,
+    LTC2949_68XX_CMD_RDCVC,
+    LTC2949_68XX_CMD_RDCVD,
+    LTC2949_68XX_CMD_RDCVE,
+    LTC2949_68XX_CMD_RDCVF,
+    LTC2949_68XX_CMD_RDAUXA,
+    LTC2949_68XX_CMD_RDAUXB,
+    LTC2949_68XX_CMD_RDAUXC,
+    LTC2949_68XX_CMD_RDAUXD
+};
+
+void LTC2949_init_lib(byte cellMonitorCount, bool ltc2949onTopOfDaisychain, bool debugEnable);
+void LTC2949_init_device_state(void);
+void LTC2949_reset(void);
+uint32_t LTC2949_GetLastTBxInt(void);
+bool LTC2949_ChkUpdate(byte * tbx);
+byte LTC2949_READ(uint16_t addr, uint16_t len, byte * data);
+byte LTC2949_WRITE(uint16_t addr, uint16_t len, byte * data);
+byte LTC2949_68XX_ClrCells(void);
+byte LTC2949_68XX_ClrAux(void);
+byte LTC2949_68XX_RdCfg(byte * data);
+byte LTC2949_68XX_WrCfg(byte * data);
+byte LTC2949_68XX_RdCfgb(byte * data);
+byte LTC2949_68XX_WrCfgb(byte * data);
+byte LTC2949_68XX_RdCells(uint16_t rdcv, uint16_t * data);
+byte LTC2949_68XX_RdAux(uint16_t rdaux, uint16_t * data);
+byte LTC2949_ADxx(byte md, byte ch, byte dcp, uint8_t pollTimeout16us);
+byte LTC2949_ADAX(byte md, byte chg, byte dcp, uint8_t pollTimeout16us);
+byte LTC2949_RdFastData(int16_t * data, uint16_t * cellMonDat = 0, uint16_t cellMonCmd = 0, uint16_t pollTimeout16us = 0);
+byte LTC2949_ReadChkStatusFaults(bool lockMemAndClr, bool printResult, byte len = 0, byte * statFaultsExpAndRd = 0, boolean * expChkFailed = 0, byte expDefaultSet = 0);
+byte LTC2949_ADCConfigRead(byte * data);
+byte LTC2949_WakeupAndAck(void);
+byte LTC2949_EEPROMRead(void);
+byte LTC2949_EEPROMWrite(void);
+byte LTC2949_GoCont(byte cfgFast, byte adcCfg);
+void LTC2949_SlotFastCfg(int slotp, int slotn);
+void LTC2949_SlotsCfg(int slot1p, int slot1n, int slot2p, int slot2n);
+void LTC2949_WriteFastCfg(byte cfgFast);
+void LTC2949_OpctlIdle(void);
+void LTC2949_FloatToF24Bytes(float f, byte * bytes);
@@ -0,0 +1,35 @@
+// SD card for the host build: files are created under sd/ in the working directory.
+#pragma once
+
+#include <Arduino.h>
+#include <memory>
+
+#define FILE_READ 0
+#define FILE_WRITE 1
+
+class File : public Print
+{
+  public:
+    File(void) {}
+    explicit File(FILE * f) : f(f, fclose) {}
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t write(const uint8_t * buf, size_t n) { return f ? fwrite(buf, 1, n, f.get()) : 0; }
+    using Print::write;
+    int availableForWrite(void) { return 512; }
+    void flush(void) { if (f) fflush(f.get()); }
+    void close(void) { f.reset(); }
+    operator bool(void) { return (bool)f; }
+
+  private:
+    std::shared_ptr<FILE> f;
+};
+
+class SDClass
+{
+  public:
+    bool begin(uint8_t csPin);
+    File open(const char * name, uint8_t mode = FILE_READ);
+    bool exists(const char * name);
+};
+
+extern SDClass SD;
@@ -0,0 +1,24 @@
+// SPI for the host build: settings only, the simulated chain never reaches the bus.
+#pragma once
+
+#include <Arduino.h>
+
+#define MSBFIRST 1
+#define SPI_MODE3 3
+
+struct SPISettings
+{
+    SPISettings(void) {}
+    SPISettings(uint32_t clock, uint8_t bitOrder, uint8_t dataMode) {}
+};
+
+class SPIClass
+{
+  public:
+    void begin(void) {}
+    void beginTransaction(SPISettings settings) {}
+    void endTransaction(void) {}
+    uint8_t transfer(uint8_t data) { return 0xFF; }
+};
+
+extern SPIClass SPI;
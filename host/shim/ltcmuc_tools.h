@@ -0,0 +1,15 @@
+// ltcmuc_tools for the host build: the helpers from the Linduino library the sketch calls.
+#pragma once
+
+#include <Arduino.h>
+
+#define LTC_TIMEOUT_CHECK(CURRENT_TIME, TIMEOUT) ((long)((CURRENT_TIME) - (TIMEOUT)) >= 0)
+
+void PrintComma(void);
+void PrintOkErr(byte error);
+void SerialPrintByteArrayHex(byte * buffer, int length, bool lsbFirst);
+bool bitMaskSetClrChk(byte data, byte mask, bool setClr);
+bool bitMaskSetChk(byte data, byte mask);
+bool bitMaskClrChk(byte data, byte mask);
+int32_t LTC_3BytesToInt32(byte * bytes);
+int16_t LTC_2BytesToInt16(byte * bytes);
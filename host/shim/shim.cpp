@@ -0,0 +1,343 @@
+// Definitions behind the host shim headers: clock, stdin / stdout serial, SD files under sd/,
+// EEPROM in eeprom.bin, CAN frame log and the LTC2949 / ltcmuc_tools link stubs.
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <SD.h>
+#include <SPI.h>
+#include <FlexCAN_T4.h>
+#include <LTC2949.h>
+#include <ltcmuc_tools.h>
+#include "../host.h"
+
+#include <chrono>
+#include <thread>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static const std::chrono::steady_clock::time_point hostStart = std::chrono::steady_clock::now();
+static uint64_t hostSkippedNs = 0;    // time delay() did not sleep for with hostFastClock
+bool hostFastClock = false;
+
+static uint64_t hostNanos(void)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - hostStart).count() + hostSkippedNs;
+}
+
+void hostClockAdvanceTo(uint64_t us)
+{
+    uint64_t now = hostNanos();
+    if (us * 1000 > now)
+        hostSkippedNs += us * 1000 - now;
+}
+
+unsigned long millis(void) { return (unsigned long)(uint32_t)(hostNanos() / 1000000); }
+unsigned long micros(void) { return (unsigned long)(uint32_t)(hostNanos() / 1000); }
+
+void delay(unsigned long ms)
+{
+    if (hostFastClock)
+        hostSkippedNs += (uint64_t)ms * 1000000;
+    else
+        std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    if (hostFastClock)
+        hostSkippedNs += (uint64_t)us * 1000;
+    else
+        std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+void yield(void) {}
+
+void pinMode(int pin, int mode) {}
+void digitalWrite(int pin, int val) {}
+void digitalWriteFast(int pin, int val) {}
+int digitalRead(int pin) { return HIGH; }
+void analogWrite(int pin, int val) {}
+void analogWriteFrequency(int pin, float freq) {}
+void analogWriteResolution(int bits) {}
+
+long random(long howbig) { return howbig > 0 ? rand() % howbig : 0; }
+long random(long howsmall, long howbig) { return howbig > howsmall ? howsmall + random(howbig - howsmall) : howsmall; }
+void randomSeed(unsigned long seed) { srand(seed); }
+
+volatile uint16_t WDOG1_WCR, WDOG1_WSR, WDOG1_WICR, WDOG1_WMCR;
+volatile uint32_t SRC_SRSR, CCM_CCGR3;
+volatile uint32_t ARM_DEMCR, ARM_DWT_CTRL;
+uint32_t F_CPU_ACTUAL = 600000000;
+
+void attachInterruptVector(int irq, void (*isr)(void)) {}
+
+uint32_t hostCycleCount(void)
+{
+    return (uint32_t)(hostNanos() * (F_CPU_ACTUAL / 1000000) / 1000);
+}
+
+/************************************************************************************************
+ * String / Print
+ ************************************************************************************************/
+std::string String::fromUnsigned(unsigned long long v, int base)
+{
+    char buf[72];
+    char * p = buf + sizeof(buf) - 1;
+    *p = 0;
+    if (base < 2)
+        base = DEC;
+    do
+    {
+        unsigned d = v % base;
+        *--p = d < 10 ? '0' + d : 'A' + d - 10;
+        v /= base;
+    } while (v);
+    return p;
+}
+
+std::string String::fromInt(long long v, int base)
+{
+    // like the Arduino core, negative numbers only get a sign in decimal
+    if (base == DEC && v < 0)
+        return "-" + fromUnsigned(-(unsigned long long)v, base);
+    return fromUnsigned((unsigned long long)v, base);
+}
+
+std::string String::fromDouble(double v, int digits)
+{
+    char buf[64];
+    if (isnan(v))
+        return "nan";
+    if (isinf(v))
+        return "inf";
+    snprintf(buf, sizeof(buf), "%.*f", digits < 0 ? 0 : digits, v);
+    return buf;
+}
+
+size_t Print::write(const uint8_t * buf, size_t n)
+{
+    size_t i = 0;
+    while (i < n && write(buf[i]))
+        i++;
+    return i;
+}
+
+HardwareSerial Serial;
+
+size_t HardwareSerial::write(const uint8_t * buf, size_t n)
+{
+    return fwrite(buf, 1, n, stdout);
+}
+
+// injected lines (hostSerialInject()) come first, then stdin, which is polled so the sketch's
+// console keeps its non-blocking Serial.available() semantics
+static std::string serialIn;
+
+void hostSerialInject(const char * line)
+{
+    serialIn += line;
+    serialIn += '\n';
+}
+
+int HardwareSerial::available(void)
+{
+    if (serialIn.empty())
+    {
+        struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+        char buf[256];
+        ssize_t n;
+        if (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN) && (n = ::read(STDIN_FILENO, buf, sizeof(buf))) > 0)
+            serialIn.append(buf, n);
+    }
+    return serialIn.size();
+}
+
+int HardwareSerial::read(void)
+{
+    if (!available())
+        return -1;
+    int c = (unsigned char)serialIn[0];
+    serialIn.erase(0, 1);
+    return c;
+}
+
+int HardwareSerial::peek(void)
+{
+    return available() ? (unsigned char)serialIn[0] : -1;
+}
+
+SPIClass SPI;
+
+/************************************************************************************************
+ * EEPROM / SD
+ ************************************************************************************************/
+EEPROMClass EEPROM;
+
+static uint8_t eepromImage[EEPROM_SIZE];
+static bool eepromLoaded = false;
+
+static void eepromLoad(void)
+{
+    if (eepromLoaded)
+        return;
+    eepromLoaded = true;
+    memset(eepromImage, 0xFF, sizeof(eepromImage)); // erased flash reads 0xFF like on the Teensy
+    FILE * f = fopen("eeprom.bin", "rb");
+    if (!f)
+        return;
+    if (fread(eepromImage, 1, sizeof(eepromImage), f)) {}
+    fclose(f);
+}
+
+uint8_t EEPROMClass::read(int idx)
+{
+    eepromLoad();
+    return idx >= 0 && idx < EEPROM_SIZE ? eepromImage[idx] : 0;
+}
+
+void EEPROMClass::write(int idx, uint8_t val)
+{
+    eepromLoad();
+    if (idx < 0 || idx >= EEPROM_SIZE)
+        return;
+    eepromImage[idx] = val;
+    FILE * f = fopen("eeprom.bin", "r+b");
+    if (!f)
+        f = fopen("eeprom.bin", "w+b");
+    if (!f)
+        return;
+    if (fseek(f, 0, SEEK_END) == 0 && ftell(f) < EEPROM_SIZE)
+    {
+        rewind(f);
+        fwrite(eepromImage, 1, sizeof(eepromImage), f);
+    }
+    else
+    {
+        fseek(f, idx, SEEK_SET);
+        fputc(val, f);
+    }
+    fclose(f);
+}
+
+SDClass SD;
+
+static std::string sdPath(const char * name)
+{
+    return std::string("sd/") + (name[0] == '/' ? name + 1 : name);
+}
+
+bool SDClass::begin(uint8_t csPin)
+{
+    mkdir("sd", 0777);
+    struct stat st;
+    return stat("sd", &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+File SDClass::open(const char * name, uint8_t mode)
+{
+    FILE * f = fopen(sdPath(name).c_str(), mode == FILE_WRITE ? "ab" : "rb");
+    return f ? File(f) : File();
+}
+
+bool SDClass::exists(const char * name)
+{
+    struct stat st;
+    return stat(sdPath(name).c_str(), &st) == 0;
+}
+
+/************************************************************************************************
+ * FlexCAN_T4
+ ************************************************************************************************/
+void hostCanLog(int bus, const CAN_message_t & msg)
+{
+    static const bool enabled = getenv("AMS_HOST_CAN_LOG") != NULL;
+    if (!enabled)
+        return;
+    fprintf(stderr, "CAN%d %08X [%u]", bus, (unsigned)msg.id, (unsigned)msg.len);
+    for (uint8_t i = 0; i < msg.len && i < 8; i++)
+        fprintf(stderr, " %02X", msg.buf[i]);
+    fprintf(stderr, "\n");
+}
+
+/************************************************************************************************
+ * ltcmuc_tools
+ ************************************************************************************************/
+void PrintComma(void) { Serial.print(','); }
+
+void PrintOkErr(byte error)
+{
+    if (error)
+    {
+        Serial.print(F("ERR:0x"));
+        Serial.println(error, HEX);
+    }
+    else
+        Serial.println(F("OK"));
+}
+
+void SerialPrintByteArrayHex(byte * buffer, int length, bool lsbFirst)
+{
+    for (int i = 0; i < length; i++)
+    {
+        byte b = buffer[lsbFirst ? length - 1 - i : i];
+        if (b < 0x10)
+            Serial.print('0');
+        Serial.print(b, HEX);
+    }
+}
+
+bool bitMaskSetChk(byte data, byte mask) { return (data & mask) == mask; }
+bool bitMaskClrChk(byte data, byte mask) { return (data & mask) == 0; }
+bool bitMaskSetClrChk(byte data, byte mask, bool setClr) { return setClr ? bitMaskSetChk(data, mask) : bitMaskClrChk(data, mask); }
+
+int32_t LTC_3BytesToInt32(byte * bytes)
+{
+    int32_t v = ((int32_t)bytes[0] << 16) | ((int32_t)bytes[1] << 8) | bytes[2];
+    return v & 0x800000 ? v - 0x1000000 : v;
+}
+
+int16_t LTC_2BytesToInt16(byte * bytes)
+{
+    return (int16_t)(((uint16_t)bytes[0] << 8) | bytes[1]);
+}
+
+/************************************************************************************************
+ * LTC2949 link stubs, never reached through HAL_* with simulatedChain
+ ************************************************************************************************/
+SPISettings LTC2949_SPISettings;
+uint8_t LTC2949_CS;
+bool LTC2949_onTopOfDaisychain;
+uint8_t LTC2949_CellMonitorCount;
+
+void LTC2949_init_lib(byte cellMonitorCount, bool ltc2949onTopOfDaisychain, bool debugEnable)
+{
+    LTC2949_CellMonitorCount = cellMonitorCount;
+    LTC2949_onTopOfDaisychain = ltc2949onTopOfDaisychain;
+}
+void LTC2949_init_device_state(void) {}
+void LTC2949_reset(void) {}
+uint32_t LTC2949_GetLastTBxInt(void) { return 0; }
+bool LTC2949_ChkUpdate(byte * tbx) { return false; }
+byte LTC2949_READ(uint16_t addr, uint16_t len, byte * data) { memset(data, 0, len); return 0; }
+byte LTC2949_WRITE(uint16_t addr, uint16_t len, byte * data) { return 0; }
+byte LTC2949_68XX_ClrCells(void) { return 0; }
+byte LTC2949_68XX_ClrAux(void) { return 0; }
+byte LTC2949_68XX_RdCfg(byte * data) { return 0; }
+byte LTC2949_68XX_WrCfg(byte * data) { return 0; }
+byte LTC2949_68XX_RdCfgb(byte * data) { return 0; }
+byte LTC2949_68XX_WrCfgb(byte * data) { return 0; }
+byte LTC2949_68XX_RdCells(uint16_t rdcv, uint16_t * data) { return 0; }
+byte LTC2949_68XX_RdAux(uint16_t rdaux, uint16_t * data) { return 0; }
+byte LTC2949_ADxx(byte md, byte ch, byte dcp, uint8_t pollTimeout16us) { return 0; }
+byte LTC2949_ADAX(byte md, byte chg, byte dcp, uint8_t pollTimeout16us) { return 0; }
+byte LTC2949_RdFastData(int16_t * data, uint16_t * cellMonDat, uint16_t cellMonCmd, uint16_t pollTimeout16us) { return 0; }
+byte LTC2949_ReadChkStatusFaults(bool lockMemAndClr, bool printResult, byte len, byte * statFaultsExpAndRd, boolean * expChkFailed, byte expDefaultSet) { return 0; }
+byte LTC2949_ADCConfigRead(byte * data) { *data = 0; return 0; }
+byte LTC2949_WakeupAndAck(void) { return 0; }
+byte LTC2949_EEPROMRead(void) { return 0; }
+byte LTC2949_EEPROMWrite(void) { return 0; }
+byte LTC2949_GoCont(byte cfgFast, byte adcCfg) { return 0; }
+void LTC2949_SlotFastCfg(int slotp, int slotn) {}
+void LTC2949_SlotsCfg(int slot1p, int slot1n, int slot2p, int slot2n) {}
+void LTC2949_WriteFastCfg(byte cfgFast) {}
+void LTC2949_OpctlIdle(void) {}
+void LTC2949_FloatToF24Bytes(float f, byte * bytes) { memset(bytes, 0, 3); }